@@ -1,42 +1,211 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include "hashtable.h"
+#include "chashtable.h"
+#include "gzip.h"
 #include "cache.h"
 
 /**
- * Allocate a cache entry
+ * Hash some bytes, with the same function as the cache's index; cheap
+ * enough to run on every fill
  */
-struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length)
+unsigned long long cache_hash(void *data, int length)
+{
+	return hashtable_hash(data, length);
+}
+
+/**
+ * Hash a path for looking it up, so it's hashed once however many times
+ * it's looked up
+ */
+void cache_key_init(struct cache_key *key, char *path)
+{
+	key->path = path;
+	key->length = strlen(path);
+	key->hash = cache_hash(path, key->length);
+}
+
+/**
+ * Write the strong ETag for some content into etag (MX_ETAG_LEN bytes)
+ */
+void cache_make_etag(void *content, int content_length, char *etag)
+{
+	snprintf(etag, MX_ETAG_LEN, "\"%llx-%x\"", cache_hash(content, content_length), content_length);
+}
+
+/**
+ * Allocate a cache entry with a ready-made gzip variant
+ *
+ * gzip_content is copied if given. If it's NULL and the type is text, the
+ * content is compressed here, once, so hits never have to. If mapped is
+ * set, content is a read-only mmap the entry takes over instead of copying.
+ */
+static struct cache_entry *alloc_entry_gzip(char *path, char *content_type, void *content, int content_length, void *gzip_content, int gzip_length, int mapped)
 {
     struct cache_entry *newEntry;
 	newEntry = (struct cache_entry*)malloc(sizeof(struct cache_entry));
 	
 	int pathLen = (strlen(path)>MX_PATH_LEN)?MX_PATH_LEN:strlen(path);
-	newEntry->path = (char*)malloc(pathLen);
+	newEntry->path = (char*)calloc(pathLen+1, 1);
 	strncpy(newEntry->path, path, pathLen);
 	
 	int typeLen = (strlen(content_type)>MX_TYPE_LEN)?MX_TYPE_LEN:strlen(content_type);
-	newEntry->content_type = (char*)malloc(typeLen);
+	newEntry->content_type = (char*)calloc(typeLen+1, 1);
 	strncpy(newEntry->content_type, content_type, typeLen);
 	newEntry->created_at = time(NULL);
+	newEntry->mtime = newEntry->created_at;
+	cache_make_etag(content, content_length, newEntry->etag);
 
-	newEntry->content = malloc(content_length);
-	memcpy(newEntry->content, content, content_length);
+	if(gzip_content != NULL){
+		newEntry->gzip_content = malloc(gzip_length);
+		memcpy(newEntry->gzip_content, gzip_content, gzip_length);
+		newEntry->gzip_length = gzip_length;
+	}
+	else if(gzip_compressible(newEntry->content_type)){
+		newEntry->gzip_content = gzip_compress(content, content_length, &newEntry->gzip_length);
+	}
+	else{
+		newEntry->gzip_content = NULL;
+	}
+	if(newEntry->gzip_content == NULL){
+		newEntry->gzip_length = 0;
+	}
+	newEntry->gzip_etag[0] = '\0';
+	if(newEntry->gzip_content != NULL){
+		// A different representation needs a different strong ETag
+		snprintf(newEntry->gzip_etag, MX_ETAG_LEN, "%.*s-gz\"", (int)strlen(newEntry->etag) - 1, newEntry->etag);
+	}
+
+	if(mapped){
+		newEntry->content = content;
+	}
+	else{
+		newEntry->content = malloc(content_length);
+		memcpy(newEntry->content, content, content_length);
+	}
+	newEntry->mapped = mapped;
+	newEntry->headers = NULL;
+	newEntry->gzip_headers = NULL;
+	newEntry->headers_length = 0;
+	newEntry->gzip_headers_length = 0;
 	
 	newEntry->content_length = content_length;
+	newEntry->refcount = 1;
 	newEntry->prev = NULL; newEntry->next = NULL;
+	newEntry->policy_prev = NULL; newEntry->policy_next = NULL;
+	newEntry->segment = 0;
+	newEntry->referenced = 0;
 	return newEntry;
 }
 
+/**
+ * Allocate a cache entry
+ *
+ * The entry gets its own copies of everything, plus an ETag computed from
+ * the content and, for text, a gzip-encoded copy. mtime defaults to now.
+ */
+struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length)
+{
+	struct cache_entry *entry = alloc_entry_gzip(path, content_type, content, content_length, NULL, 0, 0);
+	entry->hash = cache_hash(entry->path, strlen(entry->path));
+	return entry;
+}
+
 /**
  * Deallocate a cache entry
  */
 void free_entry(struct cache_entry *entry)
 {
+	free(entry->path);
+	free(entry->content_type);
+	if(entry->mapped){
+		munmap(entry->content, entry->content_length);
+	}
+	else{
+		free(entry->content);
+	}
+	free(entry->gzip_content);
+	free(entry->headers);
+	free(entry->gzip_headers);
 	free(entry);
 }
 
+/**
+ * Format the headers of a full 200 response for one variant of an entry
+ *
+ * Everything after the status line, Date and Connection lines, which
+ * change with every response, up to and including the blank line that
+ * ends the headers. Returns a malloc'd string, its length in
+ * *headers_length.
+ */
+static char *entry_format_headers(struct cache_entry *ce, int length, char *etag, char *encoding, int *headers_length)
+{
+	char buf[512];
+	char lastModified[64];
+	struct tm tm;
+
+	gmtime_r(&ce->mtime, &tm);
+	strftime(lastModified, sizeof lastModified, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	int len = snprintf(buf, sizeof buf, "Content-Length: %d\r\nAccept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s%sContent-Type: %s\r\n\r\n",
+		length, etag, lastModified,
+		encoding != NULL ? "Content-Encoding: " : "", encoding != NULL ? encoding : "", encoding != NULL ? "\r\n" : "",
+		ce->gzip_content != NULL ? "Vary: Accept-Encoding\r\n" : "",
+		ce->content_type);
+
+	if(len >= (int)sizeof buf){
+		return NULL;
+	}
+
+	char *headers = malloc(len);
+	if(headers != NULL){
+		memcpy(headers, buf, len);
+		*headers_length = len;
+	}
+	return headers;
+}
+
+/**
+ * Prepare the headers a hit on each of an entry's variants will be sent
+ * with, so hits don't have to format them
+ *
+ * Done once mtime is final and before the entry is shared.
+ */
+static void entry_prebuild(struct cache_entry *ce)
+{
+	ce->headers = entry_format_headers(ce, ce->content_length, ce->etag, NULL, &ce->headers_length);
+	if(ce->gzip_content != NULL){
+		ce->gzip_headers = entry_format_headers(ce, ce->gzip_length, ce->gzip_etag, "gzip", &ce->gzip_headers_length);
+	}
+}
+
+/**
+ * Bytes an entry counts against the cache's memory budget
+ */
+static long entry_bytes(struct cache_entry *ce)
+{
+	return (long)ce->content_length + ce->gzip_length;
+}
+
+/**
+ * How much a cache holds, in the units its limit is set in: bytes if it
+ * has a memory budget, otherwise entries
+ */
+long cache_capacity(struct cache *cache)
+{
+	return cache->max_bytes > 0 ? cache->max_bytes : cache->max_size;
+}
+
+/**
+ * How much of cache_capacity() an entry takes up
+ */
+long cache_entry_weight(struct cache *cache, struct cache_entry *ce)
+{
+	return cache->max_bytes > 0 ? entry_bytes(ce) : 1;
+}
+
 /**
  * Insert a cache entry at the head of the linked list
  */
@@ -108,46 +277,214 @@ struct cache_entry *dllist_remove_tail(struct cache *cache)
     struct cache_entry *oldtail = cache->tail;
 
     cache->tail = oldtail->prev;
-    cache->tail->next = NULL;
+
+    if (cache->tail == NULL) {
+        // That was the only entry
+        cache->head = NULL;
+    } else {
+        cache->tail->next = NULL;
+    }
 
     cache->cur_size--;
+    cache->cur_bytes -= entry_bytes(oldtail);
 
     return oldtail;
 }
 
+/**
+ * Drop the reference an entry held for being in the index
+ *
+ * Only once no lookup can still be about to pin it.
+ */
+static void cache_index_release(void *entry)
+{
+	cache_release(entry);
+}
+
+/**
+ * Pin an entry a lookup has just found
+ */
+static void cache_pin(void *entry)
+{
+	__atomic_add_fetch(&((struct cache_entry *)entry)->refcount, 1, __ATOMIC_RELAXED);
+}
+
 /**
  * Create a new cache
  * 
- * max_size: maximum number of entries in the cache
+ * max_size: maximum number of entries in the cache (0 for no limit)
  * hashsize: hashtable size (0 for default)
+ *
+ * There's no memory budget until cache_set_budget() sets one.
  */
 struct cache *cache_create(int max_size, int hashsize)
 {
 	struct cache *newCache = (struct chache*)malloc(sizeof(struct cache));
-	newCache->index = hashtable_create(hashsize, NULL);
+	// Written under the shard's lock, so one stripe is enough
+	newCache->index = chashtable_create(hashsize, 1, NULL);
+	chashtable_set_release(newCache->index, cache_index_release);
 	newCache->head = NULL;
 	newCache->tail = NULL;
 	newCache->max_size = max_size;
 	newCache->cur_size = 0;
+	newCache->max_bytes = 0;
+	newCache->cur_bytes = 0;
+	newCache->max_object = 0;
+	newCache->policy = &cache_lru_policy;
+	newCache->policy_state = cache_lru_policy.create(newCache);
 	return newCache;
 }
 
-void cache_delete(struct cache *cache, struct cache_entry *ce){
+/**
+ * Limit a cache by memory rather than (or as well as) entry count
+ *
+ * max_bytes:  total size of cached bodies, gzip copies included (0 for no limit)
+ * max_object: largest body worth caching (0 for no limit). Keeps one big
+ *             file from pushing out lots of small, hot ones.
+ */
+void cache_set_budget(struct cache *cache, long max_bytes, int max_object)
+{
+	cache->max_bytes = max_bytes;
+	cache->max_object = max_object;
+}
+
+/**
+ * Plain LRU needs nothing beyond the cache's own recency list
+ */
+static void *lru_create(struct cache *cache)
+{
+	return cache;
+}
+
+static void lru_destroy(void *state)
+{
+	(void)state;
+}
+
+static void lru_insert(void *state, struct cache_entry *ce)
+{
+	(void)state; (void)ce; // already at the head
+}
+
+static void lru_hit(void *state, struct cache_entry *ce)
+{
+	dllist_move_to_head(state, ce);
+}
+
+static void lru_remove(void *state, struct cache_entry *ce, int evicted)
+{
+	(void)state; (void)ce; (void)evicted;
+}
+
+static struct cache_entry *lru_victim(void *state, struct cache_entry *incoming)
+{
+	struct cache *cache = state;
+
+	return cache->tail != incoming ? cache->tail : NULL;
+}
+
+struct cache_policy cache_lru_policy = {
+	"lru", lru_create, lru_destroy, lru_insert, lru_hit, lru_remove, lru_victim, 0
+};
+
+static struct cache_policy *policies[] = {
+	&cache_lru_policy, &cache_clock_policy, &cache_arc_policy, &cache_tinylfu_policy
+};
+
+/**
+ * Look up an eviction policy by name ("lru", "clock", "arc" or "tinylfu")
+ *
+ * Returns NULL if there's no such policy.
+ */
+struct cache_policy *cache_policy_find(char *name)
+{
+	for(unsigned int i=0;i<sizeof policies / sizeof policies[0];i++){
+		if(strcmp(policies[i]->name, name) == 0){
+			return policies[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Switch a cache to another eviction policy
+ *
+ * Only works while the cache is empty, and should come after
+ * cache_set_budget() since policies size themselves by the budget.
+ * Returns 0, or -1 if the cache already has entries or the policy couldn't
+ * be set up (the old one stays in place).
+ */
+int cache_set_policy(struct cache *cache, struct cache_policy *policy)
+{
+	if(cache->head != NULL){
+		return -1;
+	}
+	void *state = policy->create(cache);
+	if(state == NULL){
+		return -1;
+	}
+	cache->policy->destroy(cache->policy_state);
+	cache->policy = policy;
+	cache->policy_state = state;
+	return 0;
+}
+
+/**
+ * Check whether the cache is over its entry count or memory budget
+ */
+static int cache_over_budget(struct cache *cache)
+{
+	return (cache->max_size > 0 && cache->cur_size > cache->max_size) ||
+		(cache->max_bytes > 0 && cache->cur_bytes > cache->max_bytes);
+}
+
+/**
+ * Drop a reference to an entry, freeing it once nobody holds one
+ *
+ * Safe to call without the cache's lock.
+ */
+void cache_release(struct cache_entry *entry)
+{
+	if(__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) == 0){
+		free_entry(entry);
+	}
+}
+
+/**
+ * Take an entry off the cache's lists and out of its index
+ *
+ * The cache's reference goes with it out of the index, and is dropped
+ * once no lookup can still be pinning it.
+ */
+static void cache_unlink(struct cache *cache, struct cache_entry *ce, int evicted)
+{
+	cache->policy->remove(cache->policy_state, ce, evicted);
 	dllist_move_to_tail(cache, ce);
 	dllist_remove_tail(cache);
-	free_entry(ce);
+	chashtable_delete_hashed(cache->index, ce->path, strlen(ce->path), ce->hash);
+}
+
+/**
+ * Remove an entry from the cache
+ *
+ * Anyone still holding it from cache_get() can keep using it; it's freed
+ * when the last of them calls cache_release().
+ */
+void cache_delete(struct cache *cache, struct cache_entry *ce){
+	cache_unlink(cache, ce, 0);
 }
 
 void cache_free(struct cache *cache)
 {
     struct cache_entry *cur_entry = cache->head;
 
-    hashtable_destroy(cache->index);
+    chashtable_destroy(cache->index);
+    cache->policy->destroy(cache->policy_state);
 
     while (cur_entry != NULL) {
         struct cache_entry *next_entry = cur_entry->next;
 
-        free_entry(cur_entry);
+        cache_release(cur_entry);
 
         cur_entry = next_entry;
     }
@@ -155,54 +492,161 @@ void cache_free(struct cache *cache)
     free(cache);
 }
 
+static void cache_put_content(struct cache *cache, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, int mapped);
+static struct cache_entry *cache_lookup(struct cache *cache, struct cache_key *key);
+
 /**
  * Store an entry in the cache
  *
- * This will also remove the least-recently-used items as necessary.
+ * This will also evict entries, as the cache's policy picks them, as
+ * necessary. Bodies too big for the cache's limits aren't stored.
  * 
  * NOTE: doesn't check for duplicate cache entries
  */
 void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length)
+{
+	cache_put_file(cache, path, content_type, content, content_length, time(NULL), NULL, 0);
+}
+
+/**
+ * Store an entry in the cache, recording when its source was last modified
+ *
+ * gzip_content is a precompressed copy (e.g. from a .gz file next to the
+ * original), or NULL to compress content if it's text.
+ */
+void cache_put_file(struct cache *cache, char *path, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length)
+{
+	struct cache_key key;
+	cache_key_init(&key, path);
+	cache_put_content(cache, &key, content_type, content, content_length, mtime, gzip_content, gzip_length, 0);
+}
+
+/**
+ * Like cache_put_file(), but the entry takes over map, a read-only mmap of
+ * the file, rather than copying it
+ *
+ * The mapping is the entry's (and is unmapped with it) only if the entry
+ * is stored: check whether what's cached for path now has map as its
+ * content. Otherwise it's still the caller's.
+ */
+void cache_put_mapped(struct cache *cache, char *path, char *content_type, void *map, int content_length, time_t mtime, void *gzip_content, int gzip_length)
+{
+	struct cache_key key;
+	cache_key_init(&key, path);
+	cache_put_content(cache, &key, content_type, map, content_length, mtime, gzip_content, gzip_length, 1);
+}
+
+/**
+ * Build the entry for content, ready to be inserted
+ *
+ * Copying (or taking over) the content, compressing it and preparing its
+ * headers don't touch the cache itself, so none of it needs the cache's
+ * lock. Returns NULL if the body is too big for the cache's limits.
+ */
+static struct cache_entry *cache_build_entry(struct cache *cache, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, int mapped)
 {
     struct cache_entry *entry;
-	
-	printf("\n\n\n");
-	if(cache->head!=NULL){
-		printf("cache->head: %s   cache->tail: %s   ",cache->head->path, cache->tail->path);
-	}
-	printf("new Entry: %s\n\n\n", path);
-	entry = hashtable_get(cache->index, path);
-	if(entry==NULL){ // if the entry is not within the cache
-		printf("entry not within the cache\n");
-		entry = alloc_entry(path, content_type, content, content_length);
-		dllist_insert_head(cache, entry);
-		hashtable_put(cache->index, path, entry);
-		cache->cur_size++;
-		if(cache->cur_size > cache->max_size){
-			struct cache_entry *oldtail = dllist_remove_tail(cache);
-			hashtable_delete(cache->index, oldtail->path);
-			free_entry(oldtail);
+
+	if((cache->max_object > 0 && content_length > cache->max_object) ||
+		(cache->max_bytes > 0 && content_length > cache->max_bytes)){
+		return NULL;
+	}
+	entry = alloc_entry_gzip(key->path, content_type, content, content_length, gzip_content, gzip_length, mapped);
+	entry->mtime = mtime;
+	entry->hash = key->hash;
+	entry_prebuild(entry);
+	return entry;
+}
+
+/**
+ * Throw away a built entry that never made it into the cache
+ *
+ * A mapped entry's mapping is left to the caller.
+ */
+static void cache_discard_entry(struct cache_entry *entry)
+{
+	if(entry->mapped){
+		entry->content = NULL;
+		entry->mapped = 0;
+	}
+	free_entry(entry);
+}
+
+/**
+ * Insert a built entry, then evict whatever the policy picks until the
+ * cache fits its limits again
+ *
+ * The entry only goes in the index once it has made it past eviction, so
+ * a lookup never finds one the policy turned away. The cache takes over
+ * the entry's reference. NOTE: doesn't check for duplicate cache entries
+ */
+static void cache_insert(struct cache *cache, struct cache_key *key, struct cache_entry *entry)
+{
+	dllist_insert_head(cache, entry);
+	cache->cur_size++;
+	cache->cur_bytes += entry_bytes(entry);
+	cache->policy->insert(cache->policy_state, entry);
+	while(cache_over_budget(cache)){
+		struct cache_entry *victim = cache->policy->victim(cache->policy_state, entry);
+		if(victim == NULL){
+			break;
 		}
+		if(victim == entry){ // turned away by the policy
+			cache->policy->remove(cache->policy_state, entry, 1);
+			dllist_move_to_tail(cache, entry);
+			dllist_remove_tail(cache);
+			cache_discard_entry(entry); // the caller keeps its mapping
+			return;
+		}
+		cache_unlink(cache, victim, 1);
 	}
-	else{
-		printf("entry within the cache\n");
-		dllist_move_to_head(cache, entry);
+	chashtable_put_hashed(cache->index, key->path, key->length, key->hash, entry);
+}
+
+/**
+ * Store content, either copied or, if mapped is set, taken over
+ */
+static void cache_put_content(struct cache *cache, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, int mapped)
+{
+    struct cache_entry *entry;
+
+	entry = chashtable_get_hashed(cache->index, key->path, key->length, key->hash);
+	if(entry!=NULL){
+		cache->policy->hit(cache->policy_state, entry);
+		return;
+	}
+	entry = cache_build_entry(cache, key, content_type, content, content_length, mtime, gzip_content, gzip_length, mapped);
+	if(entry!=NULL){
+		cache_insert(cache, key, entry);
 	}
 }
 
 /**
  * Retrieve an entry from the cache
+ *
+ * The entry is pinned: it stays valid, even if it's evicted meanwhile,
+ * until the caller passes it to cache_release(). That lets the caller drop
+ * the cache's lock before sending it.
  */
 struct cache_entry *cache_get(struct cache *cache, char *path)
+{
+	struct cache_key key;
+	cache_key_init(&key, path);
+	return cache_lookup(cache, &key);
+}
+
+/**
+ * cache_get() for a path that's already hashed
+ */
+static struct cache_entry *cache_lookup(struct cache *cache, struct cache_key *key)
 {
     struct cache_entry *entry;
-	entry = hashtable_get(cache->index, path);
+	entry = chashtable_get_pinned(cache->index, key->path, key->length, key->hash, cache_pin);
 	if(entry==NULL){
-		printf("\n\n\n entry is NULL!!!\n\n\n");
 		return NULL;
 	}
 	
-	dllist_move_to_head(cache, entry);
+	cache->policy->hit(cache->policy_state, entry);
 	return entry;
 }
 
@@ -215,6 +659,10 @@ void print_cache(struct cache *cache){
 	printf("CACHE_PRINT\n");
 	printf("________________________________________________________________________\n");
 	entry = cache->head;
+	if(entry==NULL){ // nothing cached yet, e.g. the only response was too big to cache
+		printf("(empty)\n");
+		return;
+	}
 	do{
 		struct tm* timeFormat = localtime(&(entry->created_at));
 		int month, day, hour, min, sec, year;
@@ -230,4 +678,294 @@ void print_cache(struct cache *cache){
 	}while(entry!=NULL);
 	printf("________________________________________________________________________\n");
 	printf("head: %s  tail: %s  size:%d\n",cache->head->path, cache->tail->path, cache->cur_size);
-}
\ No newline at end of file
+}
+/**
+ * Create a sharded cache
+ *
+ * num_shards: number of independently locked shards
+ * max_bytes:  memory budget overall, split evenly between shards
+ * max_object: largest body worth caching (0 for no limit)
+ * hashsize:   hashtable size per shard (0 for default)
+ */
+struct sharded_cache *sharded_cache_create(int num_shards, long max_bytes, int max_object, int hashsize)
+{
+	struct sharded_cache *sc = malloc(sizeof *sc);
+	if(sc == NULL){
+		return NULL;
+	}
+	sc->num_shards = num_shards;
+	sc->max_object = max_object;
+	sc->shards = malloc(num_shards * sizeof *sc->shards);
+	if(sc->shards == NULL){
+		free(sc);
+		return NULL;
+	}
+	for(int i=0;i<num_shards;i++){
+		pthread_mutex_init(&sc->shards[i].lock, NULL);
+		sc->shards[i].generation = 0;
+		memset(sc->shards[i].hits, 0, sizeof sc->shards[i].hits);
+		sc->shards[i].cache = cache_create(0, hashsize);
+		cache_set_budget(sc->shards[i].cache, (max_bytes + num_shards - 1) / num_shards, max_object);
+	}
+	return sc;
+}
+
+/**
+ * Switch every shard to another eviction policy, before anything is cached
+ *
+ * Returns 0, or -1 if some shard already has entries.
+ */
+int sharded_cache_set_policy(struct sharded_cache *sc, struct cache_policy *policy)
+{
+	int rv = 0;
+	for(int i=0;i<sc->num_shards;i++){
+		pthread_mutex_lock(&sc->shards[i].lock);
+		if(cache_set_policy(sc->shards[i].cache, policy) < 0){
+			rv = -1;
+		}
+		pthread_mutex_unlock(&sc->shards[i].lock);
+	}
+	return rv;
+}
+
+static void shard_apply_hits(struct cache_shard *shard);
+
+void sharded_cache_free(struct sharded_cache *sc)
+{
+	for(int i=0;i<sc->num_shards;i++){
+		shard_apply_hits(&sc->shards[i]); // lets go of their pins
+		cache_free(sc->shards[i].cache);
+		pthread_mutex_destroy(&sc->shards[i].lock);
+	}
+	free(sc->shards);
+	free(sc);
+}
+
+/**
+ * Pick the shard a path lives in
+ *
+ * By the hash's high bits: within a shard, the low bits that pick a slot
+ * in its index are then as varied as ever.
+ */
+static struct cache_shard *shard_for(struct sharded_cache *sc, struct cache_key *key)
+{
+	return &sc->shards[(key->hash >> 32) % sc->num_shards];
+}
+
+/**
+ * Pass a shard's buffered hits on to its policy, and let go of their pins
+ *
+ * Called with the shard locked. A hit on an entry that has left the cache
+ * since is dropped.
+ */
+static void shard_apply_hits(struct cache_shard *shard)
+{
+	struct cache *cache = shard->cache;
+
+	for(int i=0;i<CACHE_HIT_BUFFER;i++){
+		struct cache_entry *entry = __atomic_exchange_n(&shard->hits[i], NULL, __ATOMIC_ACQUIRE);
+		if(entry == NULL){
+			continue;
+		}
+		if(chashtable_get_hashed(cache->index, entry->path, strlen(entry->path), entry->hash) == entry){
+			cache->policy->hit(cache->policy_state, entry);
+		}
+		cache_release(entry);
+	}
+}
+
+/**
+ * Record a hit for a policy that needs the shard's lock to take one
+ *
+ * The hit waits in the shard's buffer for whoever next holds the lock. If
+ * the buffer is full, it's emptied now, unless another thread has the lock,
+ * in which case this hit is dropped: an eviction policy can do without
+ * the odd hit, but a lookup shouldn't wait on a lock for one.
+ */
+static void shard_record_hit(struct cache_shard *shard, struct cache_entry *entry)
+{
+	cache_pin(entry); // the buffer's own, so it's still there to look at
+
+	for(int i=0;i<CACHE_HIT_BUFFER;i++){
+		struct cache_entry *empty = NULL;
+		if(__atomic_compare_exchange_n(&shard->hits[(entry->hash + i) % CACHE_HIT_BUFFER], &empty, entry, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+			return;
+		}
+	}
+
+	if(pthread_mutex_trylock(&shard->lock) == 0){
+		shard_apply_hits(shard);
+		if(chashtable_get_hashed(shard->cache->index, entry->path, strlen(entry->path), entry->hash) == entry){
+			shard->cache->policy->hit(shard->cache->policy_state, entry);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	cache_release(entry);
+}
+
+/**
+ * Take a shard's lock, to change it
+ *
+ * Buffered hits are applied first, so the policy is up to date.
+ */
+static void shard_lock(struct cache_shard *shard)
+{
+	pthread_mutex_lock(&shard->lock);
+	shard_apply_hits(shard);
+}
+
+/**
+ * Retrieve an entry, dropping it instead if it is older than max_age
+ * seconds (max_age < 0 never expires)
+ *
+ * Takes no lock, unless the entry has to be dropped. The entry comes back
+ * pinned; pass it to cache_release() when done.
+ */
+struct cache_entry *sharded_cache_get(struct sharded_cache *sc, struct cache_key *key, int max_age)
+{
+	struct cache_shard *shard = shard_for(sc, key);
+	struct cache *cache = shard->cache;
+
+	struct cache_entry *entry = chashtable_get_pinned(cache->index, key->path, key->length, key->hash, cache_pin);
+	if(entry == NULL){
+		return NULL;
+	}
+
+	if(max_age >= 0 && time(NULL) - entry->created_at >= max_age){
+		// Another thread may have dropped it first; our pin keeps the
+		// pointer from being reused.
+		shard_lock(shard);
+		if(chashtable_get_hashed(cache->index, key->path, key->length, key->hash) == entry){
+			cache_delete(cache, entry);
+		}
+		pthread_mutex_unlock(&shard->lock);
+		cache_release(entry);
+		return NULL;
+	}
+
+	if(cache->policy->shared_hits){
+		cache->policy->hit(cache->policy_state, entry);
+	}
+	else{
+		shard_record_hit(shard, entry);
+	}
+	return entry;
+}
+
+/**
+ * Note where a path's shard is up to, before loading what to cache for it
+ *
+ * Pass the result to sharded_cache_put_file(), so that if the path is
+ * invalidated while it's being loaded, the outdated copy isn't cached.
+ */
+unsigned long sharded_cache_generation(struct sharded_cache *sc, struct cache_key *key)
+{
+	return __atomic_load_n(&shard_for(sc, key)->generation, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Store an entry and return it pinned, like sharded_cache_get()
+ *
+ * If another thread cached the path first, that entry is returned instead.
+ * Returns NULL if the body is too big to cache, or if the shard has seen an
+ * invalidation since generation was taken.
+ */
+static struct cache_entry *sharded_cache_put(struct sharded_cache *sc, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, unsigned long generation, int mapped)
+{
+	struct cache_shard *shard = shard_for(sc, key);
+
+	// Built before taking the lock, so the shard's readers never wait on a
+	// copy or a compression
+	struct cache_entry *built = cache_build_entry(shard->cache, key, content_type, content, content_length, mtime, gzip_content, gzip_length, mapped);
+	if(built == NULL){
+		return NULL;
+	}
+
+	shard_lock(shard);
+	struct cache_entry *entry = cache_lookup(shard->cache, key);
+	if(entry == NULL && shard->generation == generation){
+		cache_insert(shard->cache, key, built);
+		// Not cache_get(): handing back what was just stored isn't a hit
+		entry = chashtable_get_pinned(shard->cache->index, key->path, key->length, key->hash, cache_pin);
+		built = NULL;
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	if(built != NULL){ // beaten to it, or invalidated meanwhile
+		cache_discard_entry(built);
+	}
+	return entry;
+}
+
+struct cache_entry *sharded_cache_put_file(struct sharded_cache *sc, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, unsigned long generation)
+{
+	return sharded_cache_put(sc, key, content_type, content, content_length, mtime, gzip_content, gzip_length, generation, 0);
+}
+
+/**
+ * Store a mapped file, like cache_put_mapped(), and return it pinned
+ *
+ * The mapping now belongs to the cache if the returned entry's content is
+ * map; otherwise it's still the caller's.
+ */
+struct cache_entry *sharded_cache_put_mapped(struct sharded_cache *sc, struct cache_key *key, char *content_type, void *map, int content_length, time_t mtime, void *gzip_content, int gzip_length, unsigned long generation)
+{
+	return sharded_cache_put(sc, key, content_type, map, content_length, mtime, gzip_content, gzip_length, generation, 1);
+}
+
+/**
+ * Drop a path from the cache because what it was loaded from changed
+ */
+void sharded_cache_invalidate(struct sharded_cache *sc, char *path)
+{
+	struct cache_key key;
+	cache_key_init(&key, path);
+	struct cache_shard *shard = shard_for(sc, &key);
+
+	shard_lock(shard);
+	__atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+	struct cache_entry *entry = chashtable_get_hashed(shard->cache->index, path, key.length, key.hash);
+	if(entry != NULL){
+		cache_delete(shard->cache, entry);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * Drop a directory and everything under it from the cache
+ *
+ * Paths under it can be in any shard, so this visits every entry.
+ */
+void sharded_cache_invalidate_tree(struct sharded_cache *sc, char *dir)
+{
+	int len = strlen(dir);
+
+	for(int i=0;i<sc->num_shards;i++){
+		struct cache_shard *shard = &sc->shards[i];
+
+		shard_lock(shard);
+		__atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+		struct cache_entry *entry = shard->cache->head;
+		while(entry != NULL){
+			struct cache_entry *next = entry->next;
+			if(strncmp(entry->path, dir, len) == 0 && (entry->path[len] == '\0' || entry->path[len] == '/' || dir[len-1] == '/')){
+				cache_delete(shard->cache, entry);
+			}
+			entry = next;
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/**
+ * Print the shard a path lives in
+ */
+void sharded_cache_print(struct sharded_cache *sc, struct cache_key *key)
+{
+	struct cache_shard *shard = shard_for(sc, key);
+
+	shard_lock(shard);
+	printf("shard %d of %d, %ld of %ld bytes, %s\n", (int)(shard - sc->shards), sc->num_shards, shard->cache->cur_bytes, shard->cache->max_bytes, shard->cache->policy->name);
+	print_cache(shard->cache);
+	pthread_mutex_unlock(&shard->lock);
+}
@@ -1,36 +1,154 @@
 #ifndef _WEBCACHE_H_
 #define _WEBCACHE_H_
 #include<time.h>
+#include<pthread.h>
 
 #define MX_PATH_LEN 1020
 #define MX_TYPE_LEN 100
+#define MX_ETAG_LEN 40
 
 // Individual hash table entry
+//
+// Never changed once it's in the cache (apart from its list links), so
+// whoever holds a reference can read it without the cache's lock.
 struct cache_entry {
     char *path;   // Endpoint path--key to the cache
+    unsigned long long hash; // hashtable_hash() of path
     char *content_type;
     int content_length;
     void *content;
     time_t created_at;
+    time_t mtime; // Last-Modified of what was cached
+    char etag[MX_ETAG_LEN]; // Strong validator: hash of content, quotes included
 
-    struct cache_entry *prev, *next; // Doubly-linked list
+    void *gzip_content; // gzip-encoded copy of content, or NULL if not worth it
+    int gzip_length;
+    char gzip_etag[MX_ETAG_LEN];
+
+    int mapped; // content is a read-only mmap of the file, not a copy
+
+    // Headers of a full 200 response for each variant, from Content-Length
+    // to the blank line, or NULL if not prepared. Only the status line,
+    // Date and Connection headers go in front of them.
+    char *headers;
+    int headers_length;
+    char *gzip_headers;
+    int gzip_headers_length;
+
+    int refcount; // One for the cache, one per cache_get() not yet released
+
+    struct cache_entry *prev, *next; // Doubly-linked list, most recently used first
+
+    // Eviction policy's own bookkeeping
+    struct cache_entry *policy_prev, *policy_next;
+    int segment; // Which of the policy's lists the entry is on
+    unsigned char referenced; // CLOCK's reference bit, set on every hit
+};
+
+// A path to look up, hashed once for every lookup of it: the high bits
+// of the hash pick the shard, the low ones the slot in its index
+struct cache_key {
+    char *path;
+    int length;
+    unsigned long long hash;
+};
+
+struct cache;
+
+// How a cache picks what to evict
+//
+// The cache keeps every entry on its head/tail list, newest first; LRU
+// moves entries back to the head when they're used. A policy that needs
+// more than that keeps its own lists through the entries'
+// policy_prev/policy_next links.
+struct cache_policy {
+    char *name;
+    void *(*create)(struct cache *cache);
+    void (*destroy)(void *state);
+    void (*insert)(void *state, struct cache_entry *ce); // Just stored
+    void (*hit)(void *state, struct cache_entry *ce);    // Found by cache_get()
+    void (*remove)(void *state, struct cache_entry *ce, int evicted); // Leaving, by eviction or deletion
+    // Next entry to go while the cache is over its limits. Returning
+    // incoming (the entry just stored) turns it away instead.
+    struct cache_entry *(*victim)(void *state, struct cache_entry *incoming);
+    int shared_hits; // hit() only sets atomic flags, so it needs no lock
 };
 
+extern struct cache_policy cache_lru_policy;     // Least recently used (default)
+extern struct cache_policy cache_clock_policy;   // CLOCK: approximate LRU, cheap hits
+extern struct cache_policy cache_arc_policy;     // Adaptive Replacement Cache
+extern struct cache_policy cache_tinylfu_policy; // W-TinyLFU
+
 // A cache
 struct cache {
-    struct hashtable *index;
+    struct chashtable *index; // Can be searched while the cache is being changed
     struct cache_entry *head, *tail; // Doubly-linked list
-    int max_size; // Maxiumum number of entries
+    int max_size; // Maxiumum number of entries, or 0 for no limit
     int cur_size; // Current number of entries
+    long max_bytes; // Memory budget for cached bodies, or 0 for no limit
+    long cur_bytes; // Bytes of bodies (both encodings) currently cached
+    int max_object; // Bodies bigger than this aren't cached at all (0: no limit)
+
+    struct cache_policy *policy;
+    void *policy_state;
 };
 
+#define CACHE_HIT_BUFFER 16 // Hits a shard holds on to before applying them
+
+// One independently locked part of a sharded cache
+//
+// Lookups take no lock: they search the index and pin what they find
+// without it. Anything that changes the shard takes the lock, and that
+// includes a hit for a policy whose hits move entries around (all but
+// shared_hits ones). So those hits are buffered, and applied by whoever
+// next has the lock.
+struct cache_shard {
+    pthread_mutex_t lock;
+    struct cache *cache;
+    unsigned long generation; // Bumped by every invalidation
+    // Hits not yet passed to the policy, each pinned, or NULL. Lossy: a
+    // hit that finds it full while someone else has the lock is dropped.
+    struct cache_entry *hits[CACHE_HIT_BUFFER];
+};
+
+// A cache split by path hash into shards, each with its own lock, index
+// and eviction lists, so threads working on different paths don't wait on each
+// other
+struct sharded_cache {
+    int num_shards;
+    int max_object; // Same for every shard
+    struct cache_shard *shards;
+};
+
+extern unsigned long long cache_hash(void *data, int length);
+extern void cache_key_init(struct cache_key *key, char *path);
+extern void cache_make_etag(void *content, int content_length, char *etag);
 extern struct cache_entry *alloc_entry(char *path, char *content_type, void *content, int content_length);
 extern void free_entry(struct cache_entry *entry);
 extern struct cache *cache_create(int max_size, int hashsize);
+extern void cache_set_budget(struct cache *cache, long max_bytes, int max_object);
+extern int cache_set_policy(struct cache *cache, struct cache_policy *policy);
+extern struct cache_policy *cache_policy_find(char *name);
+extern long cache_capacity(struct cache *cache);
+extern long cache_entry_weight(struct cache *cache, struct cache_entry *ce);
 extern void cache_delete(struct cache *cache, struct cache_entry *ce);
 extern void cache_free(struct cache *cache);
 extern void cache_put(struct cache *cache, char *path, char *content_type, void *content, int content_length);
+extern void cache_put_file(struct cache *cache, char *path, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length);
+extern void cache_put_mapped(struct cache *cache, char *path, char *content_type, void *map, int content_length, time_t mtime, void *gzip_content, int gzip_length);
 extern struct cache_entry *cache_get(struct cache *cache, char *path);
+extern void cache_release(struct cache_entry *entry);
 extern void print_cache(struct cache *cache);
 
+extern struct sharded_cache *sharded_cache_create(int num_shards, long max_bytes, int max_object, int hashsize);
+extern int sharded_cache_set_policy(struct sharded_cache *sc, struct cache_policy *policy);
+extern void sharded_cache_free(struct sharded_cache *sc);
+extern struct cache_entry *sharded_cache_get(struct sharded_cache *sc, struct cache_key *key, int max_age);
+extern unsigned long sharded_cache_generation(struct sharded_cache *sc, struct cache_key *key);
+extern struct cache_entry *sharded_cache_put_file(struct sharded_cache *sc, struct cache_key *key, char *content_type, void *content, int content_length, time_t mtime, void *gzip_content, int gzip_length, unsigned long generation);
+extern struct cache_entry *sharded_cache_put_mapped(struct sharded_cache *sc, struct cache_key *key, char *content_type, void *map, int content_length, time_t mtime, void *gzip_content, int gzip_length, unsigned long generation);
+extern void sharded_cache_invalidate(struct sharded_cache *sc, char *path);
+extern void sharded_cache_invalidate_tree(struct sharded_cache *sc, char *dir);
+extern void sharded_cache_print(struct sharded_cache *sc, struct cache_key *key);
+
 #endif
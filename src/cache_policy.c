@@ -0,0 +1,577 @@
+/**
+ * cache_policy.c -- eviction policies besides plain LRU
+ *
+ * Under plain LRU, one crawl over the site pushes every hot file out of
+ * the cache to make room for pages nobody will ask for again, and every
+ * hit has to relink the entry under an exclusive lock. These policies
+ * address one or the other:
+ *
+ *    clock    -- CLOCK. Not scan-resistant, but an approximation of LRU
+ *                whose hits only set a reference bit instead of moving
+ *                the entry, so lookups can make them without a lock.
+ *    arc      -- Adaptive Replacement Cache. Entries seen once and entries
+ *                seen again live on separate lists, and "ghost" lists of
+ *                recently evicted paths tune how big each list gets.
+ *    tinylfu  -- W-TinyLFU. New entries go through a small LRU window,
+ *                then have to beat the main cache's next victim on
+ *                estimated popularity (a count-min sketch) to stay.
+ *
+ * Sizes are in the cache's own units, from cache_capacity() and
+ * cache_entry_weight(): bytes if it has a memory budget, else entries.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "cache.h"
+
+// Entries strung together through their policy links
+struct policy_list {
+    struct cache_entry *head, *tail; // Most recently used first
+    long weight; // Total weight of the entries on it
+};
+
+/**
+ * Add an entry at the most recently used end of a list
+ */
+static void list_push_head(struct policy_list *list, struct cache_entry *ce, long weight)
+{
+    ce->policy_prev = NULL;
+    ce->policy_next = list->head;
+
+    if (list->head != NULL) list->head->policy_prev = ce;
+    else list->tail = ce;
+
+    list->head = ce;
+    list->weight += weight;
+}
+
+/**
+ * Take an entry off a list
+ */
+static void list_unlink(struct policy_list *list, struct cache_entry *ce, long weight)
+{
+    if (ce->policy_prev != NULL) ce->policy_prev->policy_next = ce->policy_next;
+    else list->head = ce->policy_next;
+
+    if (ce->policy_next != NULL) ce->policy_next->policy_prev = ce->policy_prev;
+    else list->tail = ce->policy_prev;
+
+    ce->policy_prev = ce->policy_next = NULL;
+    list->weight -= weight;
+}
+
+/*
+ * CLOCK
+ */
+
+// The cache's own list is the clock face, newest entries at the head. The
+// hand sweeps from the tail towards the head, then wraps around.
+struct clock {
+    struct cache *cache;
+    struct cache_entry *hand; // Next entry to look at; NULL for the tail
+};
+
+static void *clock_create(struct cache *cache)
+{
+    struct clock *clock = malloc(sizeof *clock);
+
+    if (clock == NULL) {
+        return NULL;
+    }
+
+    clock->cache = cache;
+    clock->hand = NULL;
+
+    return clock;
+}
+
+static void clock_destroy(void *state)
+{
+    free(state);
+}
+
+static void clock_insert(void *state, struct cache_entry *ce)
+{
+    (void)state; (void)ce; // already on the cache's list, unreferenced
+}
+
+static void clock_hit(void *state, struct cache_entry *ce)
+{
+    (void)state;
+    if (!__atomic_load_n(&ce->referenced, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&ce->referenced, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void clock_remove(void *state, struct cache_entry *ce, int evicted)
+{
+    struct clock *clock = state;
+
+    (void)evicted;
+    if (clock->hand == ce) {
+        clock->hand = ce->prev;
+    }
+}
+
+static struct cache_entry *clock_victim(void *state, struct cache_entry *incoming)
+{
+    struct clock *clock = state;
+
+    // Used entries get their bit cleared and another lap; the first one
+    // found unused goes. Two laps are always enough.
+    for (int i = 0; i <= 2 * clock->cache->cur_size; i++) {
+        struct cache_entry *ce = clock->hand != NULL ? clock->hand : clock->cache->tail;
+
+        if (ce == NULL) {
+            break;
+        }
+
+        clock->hand = ce->prev;
+
+        if (ce == incoming) {
+            continue;
+        }
+
+        if (__atomic_exchange_n(&ce->referenced, 0, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        return ce;
+    }
+
+    return NULL;
+}
+
+struct cache_policy cache_clock_policy = {
+    "clock", clock_create, clock_destroy, clock_insert, clock_hit, clock_remove, clock_victim, 1
+};
+
+/*
+ * ARC
+ */
+
+enum { ARC_T1 = 1, ARC_T2, ARC_B1, ARC_B2 };
+
+// A path that was evicted recently, remembered without its content
+struct arc_ghost {
+    char *path;
+    long weight;
+    int list; // ARC_B1 or ARC_B2
+    struct arc_ghost *prev, *next;
+};
+
+struct ghost_list {
+    struct arc_ghost *head, *tail; // Most recently evicted first
+    long weight;
+};
+
+struct arc {
+    struct cache *cache;
+    struct policy_list t1, t2; // Cached: used once lately, used more than once
+    struct ghost_list b1, b2;  // Recently evicted from t1 and t2
+    struct hashtable *ghosts;  // path -> struct arc_ghost
+    long p;                    // How much of the cache t1 should get
+};
+
+static void *arc_create(struct cache *cache)
+{
+    struct arc *arc = calloc(1, sizeof *arc);
+
+    if (arc == NULL) {
+        return NULL;
+    }
+
+    arc->cache = cache;
+    arc->ghosts = hashtable_create(0, NULL);
+
+    return arc;
+}
+
+static void ghost_list_free(struct ghost_list *list)
+{
+    struct arc_ghost *g = list->head;
+
+    while (g != NULL) {
+        struct arc_ghost *next = g->next;
+
+        free(g->path);
+        free(g);
+        g = next;
+    }
+}
+
+static void arc_destroy(void *state)
+{
+    struct arc *arc = state;
+
+    hashtable_destroy(arc->ghosts);
+    ghost_list_free(&arc->b1);
+    ghost_list_free(&arc->b2);
+    free(arc);
+}
+
+static struct ghost_list *ghost_list_of(struct arc *arc, struct arc_ghost *g)
+{
+    return g->list == ARC_B1 ? &arc->b1 : &arc->b2;
+}
+
+/**
+ * Forget a ghost
+ */
+static void ghost_remove(struct arc *arc, struct arc_ghost *g)
+{
+    struct ghost_list *list = ghost_list_of(arc, g);
+
+    if (g->prev != NULL) g->prev->next = g->next;
+    else list->head = g->next;
+
+    if (g->next != NULL) g->next->prev = g->prev;
+    else list->tail = g->prev;
+
+    list->weight -= g->weight;
+
+    hashtable_delete(arc->ghosts, g->path);
+    free(g->path);
+    free(g);
+}
+
+/**
+ * Remember an evicted entry's path on one of the ghost lists
+ */
+static void ghost_add(struct arc *arc, struct cache_entry *ce, int which, long weight)
+{
+    struct arc_ghost *g = malloc(sizeof *g);
+
+    if (g == NULL) {
+        return;
+    }
+
+    g->path = strdup(ce->path);
+    if (g->path == NULL) {
+        free(g);
+        return;
+    }
+    g->weight = weight;
+    g->list = which;
+
+    struct ghost_list *list = ghost_list_of(arc, g);
+
+    g->prev = NULL;
+    g->next = list->head;
+    if (list->head != NULL) list->head->prev = g;
+    else list->tail = g;
+    list->head = g;
+    list->weight += weight;
+
+    hashtable_put(arc->ghosts, g->path, g);
+}
+
+/**
+ * Keep the ghost lists to the sizes ARC allows: t1 and b1 together no more
+ * than the cache, and everything together no more than twice it
+ */
+static void arc_trim_ghosts(struct arc *arc)
+{
+    long c = cache_capacity(arc->cache);
+
+    while (arc->b1.tail != NULL && arc->t1.weight + arc->b1.weight > c) {
+        ghost_remove(arc, arc->b1.tail);
+    }
+
+    while (arc->b2.tail != NULL && arc->t1.weight + arc->t2.weight + arc->b1.weight + arc->b2.weight > 2 * c) {
+        ghost_remove(arc, arc->b2.tail);
+    }
+}
+
+static void arc_insert(void *state, struct cache_entry *ce)
+{
+    struct arc *arc = state;
+    long weight = cache_entry_weight(arc->cache, ce);
+    struct arc_ghost *g = hashtable_get(arc->ghosts, ce->path);
+
+    if (g == NULL) {
+        ce->segment = ARC_T1;
+        list_push_head(&arc->t1, ce, weight);
+    }
+    else {
+        // Evicted too soon. A miss that t1 would have caught with more room
+        // grows t1's share; one t2 would have caught shrinks it.
+        long c = cache_capacity(arc->cache);
+
+        if (g->list == ARC_B1) {
+            long delta = arc->b1.weight >= arc->b2.weight ? weight : weight * arc->b2.weight / arc->b1.weight;
+            arc->p = arc->p + delta < c ? arc->p + delta : c;
+        }
+        else {
+            long delta = arc->b2.weight >= arc->b1.weight ? weight : weight * arc->b1.weight / arc->b2.weight;
+            arc->p = arc->p - delta > 0 ? arc->p - delta : 0;
+        }
+
+        ghost_remove(arc, g);
+        ce->segment = ARC_T2;
+        list_push_head(&arc->t2, ce, weight);
+    }
+
+    arc_trim_ghosts(arc);
+}
+
+static void arc_hit(void *state, struct cache_entry *ce)
+{
+    struct arc *arc = state;
+    long weight = cache_entry_weight(arc->cache, ce);
+
+    list_unlink(ce->segment == ARC_T1 ? &arc->t1 : &arc->t2, ce, weight);
+    ce->segment = ARC_T2;
+    list_push_head(&arc->t2, ce, weight);
+}
+
+static void arc_remove(void *state, struct cache_entry *ce, int evicted)
+{
+    struct arc *arc = state;
+    long weight = cache_entry_weight(arc->cache, ce);
+
+    list_unlink(ce->segment == ARC_T1 ? &arc->t1 : &arc->t2, ce, weight);
+
+    // Deleted entries are stale, not unlucky; only evictions leave a ghost
+    if (evicted) {
+        ghost_add(arc, ce, ce->segment == ARC_T1 ? ARC_B1 : ARC_B2, weight);
+        arc_trim_ghosts(arc);
+    }
+}
+
+static struct cache_entry *arc_victim(void *state, struct cache_entry *incoming)
+{
+    struct arc *arc = state;
+    struct cache_entry *from_t1 = arc->t1.tail, *from_t2 = arc->t2.tail;
+
+    // The entry just stored is the newest on its list, so it's only the
+    // oldest if it's alone there
+    if (from_t1 == incoming) from_t1 = NULL;
+    if (from_t2 == incoming) from_t2 = NULL;
+
+    if (from_t1 != NULL && (arc->t1.weight > arc->p || from_t2 == NULL)) {
+        return from_t1;
+    }
+
+    return from_t2;
+}
+
+struct cache_policy cache_arc_policy = {
+    "arc", arc_create, arc_destroy, arc_insert, arc_hit, arc_remove, arc_victim, 0
+};
+
+/*
+ * W-TinyLFU
+ */
+
+#define SKETCH_DEPTH 4
+#define SKETCH_MAX_COUNT 15 // Counters saturate here, like 4-bit ones would
+#define SKETCH_AVG_ENTRY 4096 // Guess at entry size, to size the sketch by a byte budget
+
+// Count-min sketch: roughly how often each path has been asked for lately
+//
+// Every so often all the counters are halved, so paths that used to be
+// popular don't stay ahead forever.
+struct sketch {
+    unsigned char *counters; // SKETCH_DEPTH rows of mask + 1
+    unsigned int mask;
+    int additions;   // Since the counters were last halved
+    int sample_size; // Halve them after this many
+};
+
+enum { LFU_WINDOW = 1, LFU_PROBATION, LFU_PROTECTED };
+
+struct tinylfu {
+    struct cache *cache;
+    struct sketch sketch;
+    struct policy_list window;    // Newcomers, plain LRU, 1% of the cache
+    struct policy_list probation; // Main cache, not used since admitted
+    struct policy_list protected; // Main cache, used again; up to 80% of it
+};
+
+static int sketch_init(struct sketch *sketch, long entries)
+{
+    unsigned int width = 64;
+
+    while (width < entries && width < (1 << 20)) {
+        width <<= 1;
+    }
+
+    sketch->counters = calloc(SKETCH_DEPTH, width);
+    sketch->mask = width - 1;
+    sketch->additions = 0;
+    sketch->sample_size = 10 * width;
+
+    return sketch->counters != NULL ? 0 : -1;
+}
+
+/**
+ * Where a path's counter is in one row of the sketch, by the hash the
+ * cache already has for it
+ */
+static unsigned char *sketch_counter(struct sketch *sketch, unsigned long long hash, int row)
+{
+    unsigned int h1 = hash, h2 = (hash >> 32) | 1;
+
+    return &sketch->counters[row * (sketch->mask + 1) + ((h1 + row * h2) & sketch->mask)];
+}
+
+static void sketch_increment(struct sketch *sketch, unsigned long long hash)
+{
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned char *counter = sketch_counter(sketch, hash, row);
+
+        if (*counter < SKETCH_MAX_COUNT) (*counter)++;
+    }
+
+    if (++sketch->additions >= sketch->sample_size) {
+        for (unsigned int i = 0; i < SKETCH_DEPTH * (sketch->mask + 1); i++) {
+            sketch->counters[i] >>= 1;
+        }
+        sketch->additions /= 2;
+    }
+}
+
+static int sketch_estimate(struct sketch *sketch, unsigned long long hash)
+{
+    int estimate = SKETCH_MAX_COUNT;
+
+    for (int row = 0; row < SKETCH_DEPTH; row++) {
+        unsigned char *counter = sketch_counter(sketch, hash, row);
+
+        if (*counter < estimate) estimate = *counter;
+    }
+
+    return estimate;
+}
+
+static void *tinylfu_create(struct cache *cache)
+{
+    struct tinylfu *lfu = calloc(1, sizeof *lfu);
+    long entries = cache->max_bytes > 0 ? cache->max_bytes / SKETCH_AVG_ENTRY : cache->max_size;
+
+    if (lfu == NULL) {
+        return NULL;
+    }
+
+    if (sketch_init(&lfu->sketch, entries) < 0) {
+        free(lfu);
+        return NULL;
+    }
+
+    lfu->cache = cache;
+
+    return lfu;
+}
+
+static void tinylfu_destroy(void *state)
+{
+    struct tinylfu *lfu = state;
+
+    free(lfu->sketch.counters);
+    free(lfu);
+}
+
+static struct policy_list *tinylfu_list(struct tinylfu *lfu, struct cache_entry *ce)
+{
+    switch (ce->segment) {
+        case LFU_WINDOW: return &lfu->window;
+        case LFU_PROBATION: return &lfu->probation;
+        default: return &lfu->protected;
+    }
+}
+
+/**
+ * Move an entry from one segment to the front of another
+ */
+static void tinylfu_move(struct tinylfu *lfu, struct cache_entry *ce, int segment)
+{
+    long weight = cache_entry_weight(lfu->cache, ce);
+
+    list_unlink(tinylfu_list(lfu, ce), ce, weight);
+    ce->segment = segment;
+    list_push_head(tinylfu_list(lfu, ce), ce, weight);
+}
+
+static void tinylfu_insert(void *state, struct cache_entry *ce)
+{
+    struct tinylfu *lfu = state;
+    long window_max = cache_capacity(lfu->cache) / 100;
+
+    sketch_increment(&lfu->sketch, ce->hash);
+
+    ce->segment = LFU_WINDOW;
+    list_push_head(&lfu->window, ce, cache_entry_weight(lfu->cache, ce));
+
+    // What falls out of the window becomes a candidate for the main cache,
+    // at the front of probation where tinylfu_victim() will weigh it up
+    while (lfu->window.weight > window_max && lfu->window.tail != ce) {
+        tinylfu_move(lfu, lfu->window.tail, LFU_PROBATION);
+    }
+}
+
+static void tinylfu_hit(void *state, struct cache_entry *ce)
+{
+    struct tinylfu *lfu = state;
+    long capacity = cache_capacity(lfu->cache);
+    long protected_max = (capacity - capacity / 100) * 8 / 10;
+
+    sketch_increment(&lfu->sketch, ce->hash);
+
+    if (ce->segment == LFU_WINDOW) {
+        tinylfu_move(lfu, ce, LFU_WINDOW);
+        return;
+    }
+
+    tinylfu_move(lfu, ce, LFU_PROTECTED);
+
+    while (lfu->protected.weight > protected_max && lfu->protected.tail != ce) {
+        tinylfu_move(lfu, lfu->protected.tail, LFU_PROBATION);
+    }
+}
+
+static void tinylfu_remove(void *state, struct cache_entry *ce, int evicted)
+{
+    struct tinylfu *lfu = state;
+
+    (void)evicted;
+    list_unlink(tinylfu_list(lfu, ce), ce, cache_entry_weight(lfu->cache, ce));
+}
+
+static struct cache_entry *tinylfu_victim(void *state, struct cache_entry *incoming)
+{
+    struct tinylfu *lfu = state;
+    struct cache_entry *victim, *candidate;
+
+    // The oldest entry on probation is next out, unless the newest arrival
+    // there is less popular than it
+    victim = lfu->probation.tail;
+    candidate = lfu->probation.head;
+
+    if (victim == NULL) {
+        victim = lfu->protected.tail;
+        candidate = lfu->window.tail;
+    }
+
+    if (candidate == incoming) {
+        candidate = NULL;
+    }
+
+    if (victim == NULL) {
+        return candidate;
+    }
+
+    if (candidate != NULL && candidate != victim &&
+        sketch_estimate(&lfu->sketch, candidate->hash) <= sketch_estimate(&lfu->sketch, victim->hash)) {
+        return candidate;
+    }
+
+    return victim;
+}
+
+struct cache_policy cache_tinylfu_policy = {
+    "tinylfu", tinylfu_create, tinylfu_destroy, tinylfu_insert, tinylfu_hit, tinylfu_remove, tinylfu_victim, 0
+};
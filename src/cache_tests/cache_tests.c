@@ -1,9 +1,17 @@
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
 #include "utils.h"
 #include "minunit.h"
 #include "../cache.h"
 #include "../hashtable.h"
+#include "../chashtable.h"
+#include "../request.h"
+#include "../conn.h"
 
 char *test_cache_create()
 {
@@ -62,7 +70,7 @@ char *test_cache_put()
   mu_assert(cache->head->prev == NULL && cache->tail->next == NULL, "The head and tail of your cache should have NULL prev and next pointers when a new entry is put in an empty cache");
   mu_assert(check_cache_entries(cache->head, test_entry_1) == 0, "Your cache_put function did not put an entry into the head of the empty cache with the expected form");
   mu_assert(check_cache_entries(cache->tail, test_entry_1) == 0, "Your cache_put function did not put an entry into the tail of the empty cache with the expected form");
-  mu_assert(check_cache_entries(hashtable_get(cache->index, "/1"), test_entry_1) == 0, "Your cache_put function did not put the expected entry into the hashtable");
+  mu_assert(check_cache_entries(chashtable_get(cache->index, "/1"), test_entry_1) == 0, "Your cache_put function did not put the expected entry into the hashtable");
 
   // Add in a second entry to the cache
   cache_put(cache, test_entry_2->path, test_entry_2->content_type, test_entry_2->content, test_entry_2->content_length);
@@ -71,7 +79,7 @@ char *test_cache_put()
   mu_assert(check_cache_entries(cache->head, test_entry_2) == 0, "Your cache_put function did not put an entry into the head of the cache with the expected form");
   mu_assert(check_cache_entries(cache->tail, test_entry_1) == 0, "Your cache_put function did not move the oldest entry in the cache to the tail of the cache");
   mu_assert(check_cache_entries(cache->head->next, test_entry_1) == 0, "Your cache_put function did not correctly set the head->next pointer of the cache");
-  mu_assert(check_cache_entries(hashtable_get(cache->index, "/2"), test_entry_2) == 0, "Your cache_put function did not put the expected entry into the hashtable");
+  mu_assert(check_cache_entries(chashtable_get(cache->index, "/2"), test_entry_2) == 0, "Your cache_put function did not put the expected entry into the hashtable");
 
   // Add in a third entry to the cache
   cache_put(cache, test_entry_3->path, test_entry_3->content_type, test_entry_3->content, test_entry_3->content_length);
@@ -146,6 +154,889 @@ char *test_cache_get()
   return NULL;
 }
 
+char *test_cache_etag()
+{
+  struct cache_entry *a = alloc_entry("/a", "text/plain", "same", 4);
+  struct cache_entry *b = alloc_entry("/b", "text/html", "same", 4);
+  struct cache_entry *c = alloc_entry("/c", "text/plain", "diff", 4);
+
+  // The ETag depends only on the content
+  mu_assert(a->etag[0] == '"', "alloc_entry should give the entry a quoted ETag");
+  mu_assert(strcmp(a->etag, b->etag) == 0, "Entries with the same content should have the same ETag");
+  mu_assert(strcmp(a->etag, c->etag) != 0, "Entries with different content should have different ETags");
+
+  free_entry(a);
+  free_entry(b);
+  free_entry(c);
+
+  // Text that shrinks gets a gzip variant with its own ETag; images don't
+  char text[1000];
+  memset(text, 'a', sizeof text);
+  a = alloc_entry("/t", "text/html", text, sizeof text);
+  b = alloc_entry("/i", "image/png", text, sizeof text);
+  mu_assert(a->gzip_content != NULL && a->gzip_length < (int)sizeof text, "alloc_entry did not compress a text entry");
+  mu_assert(strcmp(a->etag, a->gzip_etag) != 0, "The gzip variant should have its own ETag");
+  mu_assert(b->gzip_content == NULL, "alloc_entry should not compress images");
+  free_entry(a);
+  free_entry(b);
+
+  // Deleting the only entry leaves an empty cache that can't find it
+  struct cache *cache = cache_create(2, 0);
+  cache_put_file(cache, "/1", "text/plain", "1", 2, 1234, NULL, 0);
+  struct cache_entry *entry = cache_get(cache, "/1");
+  mu_assert(entry->mtime == 1234, "cache_put_file did not record the mtime");
+  mu_assert(entry->headers != NULL && strncmp(entry->headers, "Content-Length: 2\r\n", 19) == 0, "cache_put_file did not prepare the entry's headers");
+  mu_assert(strstr(entry->headers, "Last-Modified: Thu, 01 Jan 1970 00:20:34 GMT\r\n") != NULL, "The prepared headers have the wrong Last-Modified");
+  mu_assert(entry->headers_length > 4 && strncmp(entry->headers + entry->headers_length - 4, "\r\n\r\n", 4) == 0, "The prepared headers should end the header block");
+  cache_delete(cache, entry);
+  mu_assert(cache->head == NULL && cache->tail == NULL && cache->cur_size == 0, "cache_delete did not empty the cache");
+  mu_assert(cache_get(cache, "/1") == NULL, "cache_delete did not remove the entry from the index");
+
+  // ...but whoever got it before it was deleted can still use it
+  mu_assert(entry->refcount == 1 && check_strings(entry->content, "1") == 0, "cache_delete freed an entry that was still pinned");
+  cache_release(entry);
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_budget()
+{
+  struct cache *cache = cache_create(0, 0);
+  char big[600], small[100];
+
+  memset(big, 'b', sizeof big);
+  memset(small, 's', sizeof small);
+  cache_set_budget(cache, 1000, 700);
+
+  // Bodies bigger than max_object are never stored
+  cache_put_file(cache, "/huge", "image/jpeg", big, 701, 0, NULL, 0);
+  mu_assert(cache->head == NULL && cache->cur_bytes == 0, "cache_put_file cached a body over max_object");
+
+  cache_put_file(cache, "/s1", "image/jpeg", small, sizeof small, 0, NULL, 0);
+  cache_put_file(cache, "/s2", "image/jpeg", small, sizeof small, 0, NULL, 0);
+  cache_put_file(cache, "/s3", "image/jpeg", small, sizeof small, 0, NULL, 0);
+  mu_assert(cache->cur_size == 3 && cache->cur_bytes == 300, "cache_put_file did not count the bytes it cached");
+
+  // Going over budget evicts least-recently-used entries until it fits
+  struct cache_entry *ce = cache_get(cache, "/s1");
+  cache_release(ce);
+  cache_put_file(cache, "/big", "image/jpeg", big, sizeof big, 0, NULL, 0);
+  cache_put_file(cache, "/s4", "image/jpeg", big, 200, 0, NULL, 0);
+  mu_assert(cache->cur_bytes <= 1000, "cache_put_file let the cache go over its memory budget");
+  mu_assert(cache->cur_bytes == 1000 && cache->cur_size == 4, "cache_put_file evicted more than it had to");
+  mu_assert(chashtable_get(cache->index, "/s2") == NULL, "cache_put_file did not evict the least-recently-used entry");
+  mu_assert(chashtable_get(cache->index, "/s1") != NULL, "cache_put_file evicted a recently-used entry");
+
+  // Deleting gives the bytes back
+  cache_delete(cache, chashtable_get(cache->index, "/big"));
+  mu_assert(cache->cur_bytes == 400, "cache_delete did not give back the entry's bytes");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_policies()
+{
+  char *names[] = { "arc", "tinylfu" }; // CLOCK, like LRU, isn't scan-resistant
+  char path[32];
+
+  mu_assert(cache_policy_find("lru") == &cache_lru_policy, "cache_policy_find did not find the LRU policy");
+  mu_assert(cache_policy_find("fifo") == NULL, "cache_policy_find found a policy that doesn't exist");
+
+  for (int i = 0; i < 2; i++) {
+    struct cache *cache = cache_create(10, 0);
+
+    mu_assert(cache_set_policy(cache, cache_policy_find(names[i])) == 0, "cache_set_policy failed on an empty cache");
+
+    // A few popular entries...
+    for (int j = 0; j < 5; j++) {
+      sprintf(path, "/hot%d", j);
+      cache_put(cache, path, "text/plain", "hot", 3);
+      for (int k = 0; k < 3; k++) {
+        cache_release(cache_get(cache, path));
+      }
+    }
+
+    // ...should survive a scan over lots of paths nobody asks for again
+    for (int j = 0; j < 100; j++) {
+      sprintf(path, "/scan%d", j);
+      cache_put(cache, path, "text/plain", "cold", 4);
+      mu_assert(cache->cur_size <= 10, "Eviction policy let the cache grow past max_size");
+    }
+
+    for (int j = 0; j < 5; j++) {
+      sprintf(path, "/hot%d", j);
+      mu_assert(chashtable_get(cache->index, path) != NULL, "Eviction policy let a scan push out a popular entry");
+    }
+
+    mu_assert(cache_set_policy(cache, &cache_lru_policy) == -1, "cache_set_policy switched policies on a cache with entries");
+
+    cache_free(cache);
+  }
+
+  return NULL;
+}
+
+char *test_cache_clock()
+{
+  struct cache *cache = cache_create(3, 0);
+
+  mu_assert(cache_set_policy(cache, &cache_clock_policy) == 0, "cache_set_policy failed on an empty cache");
+
+  cache_put(cache, "/a", "text/plain", "a", 1);
+  cache_put(cache, "/b", "text/plain", "b", 1);
+  cache_put(cache, "/c", "text/plain", "c", 1);
+
+  // A hit only sets the reference bit; the list stays as it was
+  struct cache_entry *ce = cache_get(cache, "/a");
+  mu_assert(ce->referenced && cache->tail == ce, "cache_get under CLOCK should mark the entry, not move it");
+  cache_release(ce);
+
+  // The oldest entry has been used, so the next one goes instead
+  cache_put(cache, "/d", "text/plain", "d", 1);
+  mu_assert(chashtable_get(cache->index, "/a") != NULL, "CLOCK evicted an entry whose reference bit was set");
+  mu_assert(chashtable_get(cache->index, "/b") == NULL, "CLOCK did not evict the oldest unreferenced entry");
+  mu_assert(cache->cur_size == 3, "CLOCK evicted more than it had to");
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+char *test_cache_mapped()
+{
+  struct cache *cache = cache_create(10, 0);
+  char *text = "mapped content";
+  int len = strlen(text) + 1;
+
+  // An anonymous mapping stands in for a mapped file
+  void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  mu_assert(map != MAP_FAILED, "Could not create a mapping to test with");
+  memcpy(map, text, len);
+
+  cache_put_mapped(cache, "/m", "text/plain", map, len, 0, NULL, 0);
+  struct cache_entry *ce = cache_get(cache, "/m");
+  mu_assert(ce != NULL && ce->mapped && ce->content == map, "cache_put_mapped copied the mapping instead of taking it over");
+  mu_assert(check_strings(ce->content, text) == 0, "cache_put_mapped did not keep the content");
+  cache_release(ce);
+
+  // A second copy of the same path isn't taken over; it's still the caller's
+  void *other = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  cache_put_mapped(cache, "/m", "text/plain", other, len, 0, NULL, 0);
+  mu_assert(((struct cache_entry *)chashtable_get(cache->index, "/m"))->content == map, "cache_put_mapped replaced an entry that was already cached");
+  munmap(other, len);
+
+  cache_free(cache);
+
+  return NULL;
+}
+
+// Hash a path for the sharded cache, inline
+struct cache_key *key_for(struct cache_key *key, char *path)
+{
+  cache_key_init(key, path);
+  return key;
+}
+
+char *test_sharded_cache()
+{
+  struct cache_key key;
+  struct sharded_cache *sc = sharded_cache_create(4, 0, 0, 0);
+  char *paths[] = { "/a.html", "/b.html", "/c.html", "/d.html", "/e.html" };
+
+  mu_assert(sc->num_shards == 4, "sharded_cache_create did not create the requested number of shards");
+
+  for (int i = 0; i < 5; i++) {
+    struct cache_entry *ce = sharded_cache_put_file(sc, key_for(&key, paths[i]), "text/html", paths[i], strlen(paths[i]) + 1, 0, NULL, 0, sharded_cache_generation(sc, key_for(&key, paths[i])));
+    mu_assert(ce != NULL && check_strings(ce->path, paths[i]) == 0, "sharded_cache_put_file did not return the stored entry");
+    cache_release(ce);
+  }
+
+  for (int i = 0; i < 5; i++) {
+    struct cache_entry *ce = sharded_cache_get(sc, key_for(&key, paths[i]), -1);
+    mu_assert(ce != NULL && check_strings(ce->content, paths[i]) == 0, "sharded_cache_get did not find an entry in its shard");
+    cache_release(ce);
+  }
+
+  // A second put of the same path hands back the entry already there
+  struct cache_entry *first = sharded_cache_get(sc, key_for(&key, "/a.html"), -1);
+  struct cache_entry *again = sharded_cache_put_file(sc, key_for(&key, "/a.html"), "text/plain", "other", 5, 0, NULL, 0, sharded_cache_generation(sc, key_for(&key, "/a.html")));
+  mu_assert(first == again, "sharded_cache_put_file replaced an entry that was already cached");
+  cache_release(first);
+  cache_release(again);
+
+  // Entries older than max_age are dropped on lookup
+  mu_assert(sharded_cache_get(sc, key_for(&key, "/b.html"), 0) == NULL, "sharded_cache_get returned a stale entry");
+  mu_assert(sharded_cache_get(sc, key_for(&key, "/b.html"), -1) == NULL, "sharded_cache_get did not drop a stale entry");
+
+  // Invalidating drops the path, and a fill loaded before that is refused
+  unsigned long generation = sharded_cache_generation(sc, key_for(&key, "/c.html"));
+  sharded_cache_invalidate(sc, "/c.html");
+  mu_assert(sharded_cache_get(sc, key_for(&key, "/c.html"), -1) == NULL, "sharded_cache_invalidate did not drop the entry");
+  mu_assert(sharded_cache_put_file(sc, key_for(&key, "/c.html"), "text/html", "old", 4, 0, NULL, 0, generation) == NULL, "sharded_cache_put_file cached a copy loaded before an invalidation");
+
+  struct cache_entry *ce = sharded_cache_put_file(sc, key_for(&key, "/dir/x"), "text/html", "x", 2, 0, NULL, 0, sharded_cache_generation(sc, key_for(&key, "/dir/x")));
+  cache_release(ce);
+  ce = sharded_cache_put_file(sc, key_for(&key, "/dirt"), "text/html", "y", 2, 0, NULL, 0, sharded_cache_generation(sc, key_for(&key, "/dirt")));
+  cache_release(ce);
+  sharded_cache_invalidate_tree(sc, "/dir");
+  mu_assert(sharded_cache_get(sc, key_for(&key, "/dir/x"), -1) == NULL, "sharded_cache_invalidate_tree did not drop a path under the directory");
+  ce = sharded_cache_get(sc, key_for(&key, "/dirt"), -1);
+  mu_assert(ce != NULL, "sharded_cache_invalidate_tree dropped a path outside the directory");
+  cache_release(ce);
+
+  sharded_cache_free(sc);
+
+  // Lookups don't take the shard's lock, but their LRU hits still count:
+  // they're applied before the next put picks what to evict
+  char body[100];
+  memset(body, 'b', sizeof body);
+  sc = sharded_cache_create(1, 200, 0, 0);
+  char *lru_paths[] = { "/x", "/y", "/z" };
+  for (int i = 0; i < 3; i++) {
+    if (i == 2) {
+      ce = sharded_cache_get(sc, key_for(&key, "/x"), -1);
+      mu_assert(ce != NULL, "sharded_cache_get did not find an entry");
+      cache_release(ce);
+    }
+    ce = sharded_cache_put_file(sc, key_for(&key, lru_paths[i]), "image/png", body, sizeof body, 0, NULL, 0, sharded_cache_generation(sc, key_for(&key, lru_paths[i])));
+    mu_assert(ce != NULL, "sharded_cache_put_file did not store an entry");
+    cache_release(ce);
+  }
+  ce = sharded_cache_get(sc, key_for(&key, "/x"), -1);
+  mu_assert(ce != NULL, "A hit made without the shard's lock was lost");
+  cache_release(ce);
+  mu_assert(sharded_cache_get(sc, key_for(&key, "/y"), -1) == NULL, "The sharded cache did not evict the least-recently-used entry");
+  sharded_cache_free(sc);
+
+  return NULL;
+}
+
+void count_entry(void *data, void *arg)
+{
+  (void)data;
+  (*(int *)arg)++;
+}
+
+char *test_hashtable()
+{
+  // Starting with one slot, so it has to grow all the way
+  struct hashtable *ht = hashtable_create(1, NULL);
+  static int values[1000];
+  char key[16];
+  int count = 0;
+
+  for (int i = 0; i < 1000; i++) {
+    values[i] = i;
+    snprintf(key, sizeof key, "/k%d", i);
+    mu_assert(hashtable_put(ht, key, &values[i]) == &values[i], "hashtable_put failed");
+  }
+  mu_assert(ht->num_entries == 1000 && ht->size > 1000 && ht->load < 1, "The hashtable did not grow as it filled");
+  mu_assert((ht->size & (ht->size - 1)) == 0, "The hashtable's size should stay a power of two");
+
+  // A hash computed up front finds the same entry
+  mu_assert(hashtable_get_hashed(ht, "/k42", 4, hashtable_hash("/k42", 4)) == &values[42], "hashtable_get_hashed did not find an entry");
+  mu_assert(hashtable_hash("/k42", 4) != hashtable_hash("/k43", 4), "hashtable_hash gave two keys the same hash");
+
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof key, "/k%d", i);
+    mu_assert(hashtable_get(ht, key) == &values[i], "hashtable_get lost an entry when the table grew");
+  }
+
+  // Putting an existing key replaces its data
+  hashtable_put(ht, "/k7", &values[8]);
+  mu_assert(hashtable_get(ht, "/k7") == &values[8] && ht->num_entries == 1000, "hashtable_put did not replace an existing key");
+
+  // Deleting shifts later entries back without losing any
+  for (int i = 0; i < 1000; i += 2) {
+    snprintf(key, sizeof key, "/k%d", i);
+    mu_assert(hashtable_delete(ht, key) != NULL, "hashtable_delete did not find an entry");
+  }
+  for (int i = 0; i < 1000; i++) {
+    snprintf(key, sizeof key, "/k%d", i);
+    mu_assert((hashtable_get(ht, key) != NULL) == (i % 2 == 1), "hashtable_delete removed the wrong entries");
+  }
+  mu_assert(hashtable_delete(ht, "/k0") == NULL, "hashtable_delete found an entry that was already gone");
+
+  hashtable_foreach(ht, count_entry, &count);
+  mu_assert(count == 500 && ht->num_entries == 500, "hashtable_foreach did not visit every entry once");
+
+  hashtable_destroy(ht);
+
+  return NULL;
+}
+
+static int chashtable_value; // What every key in the test maps to
+static int chashtable_released; // Calls to count_release()
+
+void count_release(void *data)
+{
+  (void)data;
+  chashtable_released++;
+}
+
+struct chashtable_worker {
+  struct chashtable *ht;
+  int id;
+  int errors;
+};
+
+// Put, find and delete keys of our own while other threads do the same
+void *chashtable_work(void *arg)
+{
+  struct chashtable_worker *w = arg;
+  int *value = &chashtable_value;
+  char key[32];
+
+  for (int round = 0; round < 20; round++) {
+    for (int i = 0; i < 200; i++) {
+      snprintf(key, sizeof key, "/w%d/%d", w->id, i);
+      chashtable_put(w->ht, key, value);
+    }
+    for (int i = 0; i < 200; i++) {
+      snprintf(key, sizeof key, "/w%d/%d", w->id, i);
+      if (chashtable_get(w->ht, key) != value) w->errors++;
+      if (chashtable_get(w->ht, "/shared") != value) w->errors++;
+    }
+    for (int i = 0; i < 200; i++) {
+      snprintf(key, sizeof key, "/w%d/%d", w->id, i);
+      if (chashtable_delete(w->ht, key) != value) w->errors++;
+    }
+  }
+
+  return NULL;
+}
+
+char *test_chashtable()
+{
+  struct chashtable *ht = chashtable_create(0, 3, NULL);
+  struct chashtable_worker workers[4];
+  pthread_t threads[4];
+  int count = 0;
+
+  mu_assert(ht != NULL && ht->num_stripes == 4, "chashtable_create should round the stripes up to a power of two");
+
+  chashtable_put(ht, "/shared", &chashtable_value);
+
+  for (int i = 0; i < 4; i++) {
+    workers[i].ht = ht;
+    workers[i].id = i;
+    workers[i].errors = 0;
+    pthread_create(&threads[i], NULL, chashtable_work, &workers[i]);
+  }
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    mu_assert(workers[i].errors == 0, "A thread lost track of its entries in the concurrent hashtable");
+  }
+
+  mu_assert(chashtable_count(ht) == 1, "The concurrent hashtable kept entries that were deleted");
+  chashtable_foreach(ht, count_entry, &count);
+  mu_assert(count == 1 && chashtable_get(ht, "/shared") == &chashtable_value, "chashtable_foreach did not visit the entry left");
+
+  chashtable_destroy(ht);
+
+  // Replaced and deleted data is released once no lookup can be on it,
+  // which with nobody else looking is straight away
+  int values[2];
+  ht = chashtable_create(0, 0, NULL);
+  chashtable_set_release(ht, count_release);
+  chashtable_released = 0;
+  chashtable_put(ht, "/r", &values[0]);
+  chashtable_put(ht, "/r", &values[1]);
+  mu_assert(chashtable_released == 1, "chashtable_put did not release the data it replaced");
+  chashtable_delete(ht, "/r");
+  mu_assert(chashtable_released == 2, "chashtable_delete did not release the data it removed");
+  chashtable_put(ht, "/kept", &values[0]);
+  chashtable_destroy(ht);
+  mu_assert(chashtable_released == 2, "chashtable_destroy released data still in the table");
+
+  return NULL;
+}
+
+#define STABLE_KEYS 100
+#define CHURN_KEYS 500
+
+static int stable_values[STABLE_KEYS];
+static int churn_values[2][CHURN_KEYS];
+static int churn_done;
+
+struct chashtable_reader {
+  struct chashtable *ht;
+  int lookups;
+  int errors;
+};
+
+// Look keys up without pause while writers change the table around them
+void *chashtable_read(void *arg)
+{
+  struct chashtable_reader *r = arg;
+  char key[32];
+
+  while (!__atomic_load_n(&churn_done, __ATOMIC_ACQUIRE)) {
+    for (int i = 0; i < STABLE_KEYS; i++) {
+      snprintf(key, sizeof key, "/s%d", i);
+      if (chashtable_get(r->ht, key) != &stable_values[i]) r->errors++;
+    }
+    for (int i = 0; i < CHURN_KEYS; i++) {
+      snprintf(key, sizeof key, "/c%d", i);
+      int *v = chashtable_get(r->ht, key);
+      if (v != NULL && v != &churn_values[0][i] && v != &churn_values[1][i]) r->errors++;
+    }
+    r->lookups++;
+  }
+
+  return NULL;
+}
+
+// Insert, replace and delete keys, growing the stripes as they go
+void *chashtable_churn(void *arg)
+{
+  struct chashtable *ht = arg;
+  char key[32];
+
+  for (int round = 0; round < 50; round++) {
+    for (int i = 0; i < CHURN_KEYS; i++) {
+      snprintf(key, sizeof key, "/c%d", i);
+      chashtable_put(ht, key, &churn_values[round % 2][i]);
+    }
+    for (int i = 0; i < CHURN_KEYS; i += 2) {
+      snprintf(key, sizeof key, "/c%d", i);
+      chashtable_delete(ht, key);
+    }
+  }
+
+  return NULL;
+}
+
+char *test_chashtable_readers()
+{
+  struct chashtable *ht = chashtable_create(8, 2, NULL);
+  struct chashtable_reader readers[4];
+  pthread_t reader_threads[4], writer_threads[2];
+  char key[32];
+
+  for (int i = 0; i < STABLE_KEYS; i++) {
+    snprintf(key, sizeof key, "/s%d", i);
+    chashtable_put(ht, key, &stable_values[i]);
+  }
+
+  churn_done = 0;
+  for (int i = 0; i < 4; i++) {
+    readers[i].ht = ht;
+    readers[i].lookups = 0;
+    readers[i].errors = 0;
+    pthread_create(&reader_threads[i], NULL, chashtable_read, &readers[i]);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_create(&writer_threads[i], NULL, chashtable_churn, ht);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_join(writer_threads[i], NULL);
+  }
+  __atomic_store_n(&churn_done, 1, __ATOMIC_RELEASE);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(reader_threads[i], NULL);
+    mu_assert(readers[i].errors == 0, "A lock-free lookup missed a key or found another key's data");
+    mu_assert(readers[i].lookups > 0, "A reader never got to look anything up");
+  }
+
+  mu_assert(chashtable_count(ht) == STABLE_KEYS + CHURN_KEYS / 2, "The concurrent hashtable miscounted after inserts, replaces and deletes");
+
+  chashtable_destroy(ht);
+
+  return NULL;
+}
+
+// Does a view hold exactly s?
+static int view_is(struct strview v, char *s)
+{
+  return v.len == (int)strlen(s) && memcmp(v.p, s, v.len) == 0;
+}
+
+// Parse buf as if it arrived one byte per read; the result of the last call
+static int parse_bytewise(struct http_request *req, char *buf, int len)
+{
+  int rv = 0;
+
+  http_request_init(req);
+  for (int i = 1; i <= len; i++) {
+    rv = http_parse(req, buf, i);
+    if (rv != 0) break;
+  }
+
+  return rv;
+}
+
+char *test_parse_split()
+{
+  char buf[] = "POST /up/x.txt HTTP/1.1\r\nHost: localhost\r\nX-Empty:\r\nContent-Length: 5\r\n\r\nhello";
+  int len = strlen(buf);
+  struct http_request req;
+
+  // Every prefix short of the whole request needs more input
+  http_request_init(&req);
+  for (int i = 1; i < len; i++) {
+    mu_assert(http_parse(&req, buf, i) == 0, "http_parse finished a request before all of it had arrived");
+  }
+  mu_assert(http_parse(&req, buf, len) == len, "http_parse did not finish a request fed a byte at a time");
+
+  mu_assert(view_is(req.method, "POST") && view_is(req.path, "/up/x.txt") && view_is(req.version, "HTTP/1.1"), "http_parse split the request line wrongly");
+  mu_assert(req.num_headers == 3 && req.content_length == 5, "http_parse lost headers across reads");
+  mu_assert(http_get_header(&req, "host") != NULL && view_is(*http_get_header(&req, "host"), "localhost"), "http_get_header should ignore case");
+  mu_assert(http_get_header(&req, "X-Empty") != NULL && http_get_header(&req, "X-Empty")->len == 0, "An empty header value was not kept");
+  mu_assert(view_is(req.body, "hello"), "http_parse did not collect the body");
+
+  // Stray blank lines before a request are skipped
+  char blank[] = "\r\n\r\nGET / HTTP/1.0\r\n\r\n";
+  mu_assert(parse_bytewise(&req, blank, strlen(blank)) == (int)strlen(blank) && view_is(req.path, "/"), "http_parse choked on blank lines before a request");
+
+  char *bad[] = {
+    "GET\r\n\r\n",
+    "GET /\r\n\r\n",
+    "GET / FTP/1.0\r\n\r\n",
+    "GET / HTTP/1.1\r\nNo colon here\r\n\r\n",
+    "GET / HTTP/1.1\r\n: no name\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 12x\r\n\r\n",
+    "POST / HTTP/1.1\r\nContent-Length: 99999999999\r\n\r\n",
+  };
+  for (int i = 0; i < (int)(sizeof bad / sizeof bad[0]); i++) {
+    char copy[128];
+    strcpy(copy, bad[i]);
+    mu_assert(parse_bytewise(&req, copy, strlen(copy)) == -1 && req.state == PARSE_ERROR, "http_parse accepted a malformed request");
+  }
+
+  return NULL;
+}
+
+char *test_parse_pipelined()
+{
+  char buf[] = "GET /a HTTP/1.1\r\nHost: x\r\n\r\nPOST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabcGET /c HTTP/1.1\r\n";
+  int len = strlen(buf);
+  struct http_request req;
+
+  http_request_init(&req);
+  int first = http_parse(&req, buf, len);
+  mu_assert(first == (int)strlen("GET /a HTTP/1.1\r\nHost: x\r\n\r\n"), "http_parse did not stop at the end of the first request");
+  mu_assert(view_is(req.path, "/a") && req.body.len == 0, "The first pipelined request was parsed wrongly");
+
+  // Parsing again without a reset changes nothing
+  mu_assert(http_parse(&req, buf, len) == first, "http_parse did not stay finished");
+
+  http_request_init(&req);
+  int second = http_parse(&req, buf + first, len - first);
+  mu_assert(second == (int)strlen("POST /b HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"), "http_parse did not stop at the end of a body");
+  mu_assert(view_is(req.path, "/b") && view_is(req.body, "abc"), "The second pipelined request was parsed wrongly");
+
+  // The third is incomplete
+  http_request_init(&req);
+  mu_assert(http_parse(&req, buf + first + second, len - first - second) == 0, "http_parse finished a request missing its blank line");
+
+  return NULL;
+}
+
+// Body sink collecting what it's handed
+struct sink_buf {
+  char data[64];
+  int len;
+  int fail;
+};
+
+int collect_sink(void *arg, char *data, int len)
+{
+  struct sink_buf *b = arg;
+
+  if (b->fail || b->len + len > (int)sizeof b->data) return -1;
+  memcpy(b->data + b->len, data, len);
+  b->len += len;
+  return 0;
+}
+
+char *test_parse_chunked()
+{
+  char chunked[] = "POST /up HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5;name=value\r\nhello\r\n"
+    "6 ; ext\r\n world\r\n"
+    "A\r\n, chunked!\r\n"
+    "0\r\nX-Trailer: yes\r\nX-Other: too\r\n\r\n"
+    "GET /next HTTP/1.1\r\n\r\n";
+  int total = strlen(chunked) - strlen("GET /next HTTP/1.1\r\n\r\n");
+  char buf[256];
+  struct http_request req;
+
+  // Whole, then a byte at a time: the body is decoded in place either way
+  strcpy(buf, chunked);
+  http_request_init(&req);
+  mu_assert(http_parse(&req, buf, strlen(buf)) == total, "http_parse did not stop after the trailers");
+  mu_assert(req.chunked && view_is(req.body, "hello world, chunked!"), "A chunked body was not decoded");
+
+  strcpy(buf, chunked);
+  mu_assert(parse_bytewise(&req, buf, strlen(buf)) == total, "A chunked body fed a byte at a time did not finish");
+  mu_assert(view_is(req.body, "hello world, chunked!"), "A chunked body fed a byte at a time was not decoded");
+  mu_assert(memcmp(buf + total, "GET /next", 9) == 0, "Decoding a chunked body disturbed the request behind it");
+
+  // Streamed to a sink instead, compacting after every read as conn does
+  struct sink_buf sink = { .len = 0, .fail = 0 };
+  int len = 0;
+  int rv = 0;
+  strcpy(buf, chunked);
+  http_request_init(&req);
+  req.body_sink = collect_sink;
+  req.body_sink_arg = &sink;
+  for (int i = 0; i < total && rv == 0; i++) {
+    buf[len++] = chunked[i];
+    rv = http_parse(&req, buf, len);
+    len = http_compact(&req, buf, len);
+  }
+  mu_assert(rv > 0 && sink.len == 21 && memcmp(sink.data, "hello world, chunked!", 21) == 0, "A streamed chunked body did not reach the sink");
+  mu_assert(len < 80, "http_compact kept streamed body bytes in the buffer");
+
+  // A sink that fails is told apart from a bad request
+  sink.len = 0;
+  sink.fail = 1;
+  strcpy(buf, chunked);
+  http_request_init(&req);
+  req.body_sink = collect_sink;
+  req.body_sink_arg = &sink;
+  mu_assert(http_parse(&req, buf, strlen(buf)) == -1 && req.body_sink_failed, "A failing body sink was not reported");
+
+  char *bad[] = {
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5x\r\nhello\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhelloXX\r\n",
+    "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\nfffffffff\r\n",
+  };
+  for (int i = 0; i < (int)(sizeof bad / sizeof bad[0]); i++) {
+    strcpy(buf, bad[i]);
+    mu_assert(parse_bytewise(&req, buf, strlen(buf)) == -1 && !req.body_sink_failed, "http_parse accepted a malformed chunked body");
+  }
+
+  return NULL;
+}
+
+char *test_parse_limits()
+{
+  static char buf[CONN_MAX_REQUEST * 2];
+  struct http_request req;
+  int len;
+
+  // MX_HEADERS headers are fine, one more isn't
+  for (int extra = 0; extra <= 1; extra++) {
+    len = sprintf(buf, "GET / HTTP/1.1\r\n");
+    for (int i = 0; i < MX_HEADERS + extra; i++) {
+      len += sprintf(buf + len, "X-Header-%d: %d\r\n", i, i);
+    }
+    len += sprintf(buf + len, "\r\n");
+    http_request_init(&req);
+    mu_assert(http_parse(&req, buf, len) == (extra ? -1 : len), "http_parse did not hold the line at MX_HEADERS headers");
+  }
+
+  // Bodies whose length could be read two ways
+  struct {
+    char *headers;
+    int ok;
+  } framing[] = {
+    { "Content-Length: 5\r\nContent-Length: 5\r\n", 1 },
+    { "Content-Length: 5\r\nContent-Length: 6\r\n", 0 },
+    { "Content-Length: 5\r\nTransfer-Encoding: chunked\r\n", 0 },
+    { "Transfer-Encoding: chunked\r\nContent-Length: 5\r\n", 0 },
+  };
+  for (int i = 0; i < (int)(sizeof framing / sizeof framing[0]); i++) {
+    len = sprintf(buf, "POST /up HTTP/1.1\r\n%s\r\nhello", framing[i].headers);
+    http_request_init(&req);
+    mu_assert(http_parse(&req, buf, len) == (framing[i].ok ? len : -1), "http_parse accepted an ambiguous body length");
+  }
+
+  // A header line that never ends is cut off at CONN_MAX_REQUEST, and
+  // handed over as a request too large to answer
+  int sv[2];
+  mu_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+  len = sprintf(buf, "GET / HTTP/1.1\r\nX-Padding: ");
+  memset(buf + len, 'x', CONN_MAX_REQUEST);
+  len += CONN_MAX_REQUEST;
+  struct conn *c = conn_open(sv[0], 0);
+  mu_assert(c != NULL, "conn_open failed");
+
+  int sent = 0, rejected = 0;
+  while (!rejected) {
+    while (sent < len) {
+      int n = send(sv[1], buf + sent, len - sent, MSG_DONTWAIT);
+      if (n <= 0) break;
+      sent += n;
+    }
+    if (conn_next_request(c) != 0) {
+      rejected = c->req.state == PARSE_ERROR && c->req.too_large;
+      break;
+    }
+    if (conn_reserve(c) < 0) break;
+    int n = recv(c->fd, c->inbuf + c->inlen, c->incap - 1 - c->inlen, 0);
+    if (n <= 0) break;
+    c->inlen += n;
+    c->inbuf[c->inlen] = '\0';
+  }
+  mu_assert(rejected && c->inlen <= CONN_MAX_REQUEST && c->req.header_len == 0, "Oversized headers were not refused at CONN_MAX_REQUEST");
+
+  conn_close(c);
+  close(sv[1]);
+
+  return NULL;
+}
+
+// A Range header, the body size it's parsed against, and what should come of it
+struct range_case {
+  char *header;
+  long size;
+  int expect; // Ranges kept, 0 for 416, -1 for ignored
+  struct byte_range ranges[2]; // The first of them
+};
+
+char *test_parse_range()
+{
+  struct range_case cases[] = {
+    { "bytes=0-9", 100, 1, {{0, 9}} },
+    { "bytes=90-", 100, 1, {{90, 99}} },
+    { "bytes=-10", 100, 1, {{90, 99}} },
+    { "bytes=-200", 100, 1, {{0, 99}} },
+    { "bytes=50-500", 100, 1, {{50, 99}} },
+    { "BYTES=0-0", 100, 1, {{0, 0}} },
+    { "bytes=99-99", 100, 1, {{99, 99}} },
+    { "bytes=-0", 100, 0, {{0, 0}} },
+    { "bytes=100-", 100, 0, {{0, 0}} },
+    { "bytes=100-200", 100, 0, {{0, 0}} },
+    { "bytes=0-", 0, 0, {{0, 0}} },
+    { "bytes=-5", 0, 0, {{0, 0}} },
+    { "bytes=0-9,5-14", 100, 2, {{0, 9}, {5, 14}} },
+    { "bytes=0-0, -1", 100, 2, {{0, 0}, {99, 99}} },
+    { "bytes=200-300,0-1", 100, 1, {{0, 1}} },
+    { "bytes=5-2", 100, -1, {{0, 0}} },
+    { "bytes=0-9,5-2", 100, -1, {{0, 0}} },
+    { "items=0-9", 100, -1, {{0, 0}} },
+    { "bytes=", 100, -1, {{0, 0}} },
+    { "bytes=a-b", 100, -1, {{0, 0}} },
+    { "bytes=-", 100, -1, {{0, 0}} },
+    { "bytes=1-2;", 100, -1, {{0, 0}} },
+    { "bytes=0-1,,2-3", 100, -1, {{0, 0}} },
+  };
+  struct byte_range ranges[MX_RANGES];
+
+  for (int i = 0; i < (int)(sizeof cases / sizeof cases[0]); i++) {
+    struct range_case *c = &cases[i];
+    struct strview v = { c->header, strlen(c->header) };
+    int n = http_parse_range(v, c->size, ranges, MX_RANGES);
+
+    if (n != c->expect) {
+      debug("%s against %ld bytes: got %d, expected %d", c->header, c->size, n, c->expect);
+    }
+    mu_assert(n == c->expect, "http_parse_range kept the wrong number of ranges");
+    for (int j = 0; j < n && j < 2; j++) {
+      mu_assert(ranges[j].start == c->ranges[j].start && ranges[j].end == c->ranges[j].end, "http_parse_range got a range's bounds wrong");
+    }
+  }
+
+  // Up to MX_RANGES ranges are kept; any more and the header is ignored
+  char header[MX_RANGES * 16 + 16];
+  for (int extra = 0; extra <= 1; extra++) {
+    int len = sprintf(header, "bytes=");
+    for (int i = 0; i < MX_RANGES + extra; i++) {
+      len += sprintf(header + len, "%s%d-%d", i ? "," : "", i * 2, i * 2);
+    }
+    struct strview v = { header, len };
+    mu_assert(http_parse_range(v, 1000, ranges, MX_RANGES) == (extra ? -1 : MX_RANGES), "http_parse_range did not hold the line at MX_RANGES ranges");
+  }
+  mu_assert(ranges[MX_RANGES - 1].start == (MX_RANGES - 1) * 2, "http_parse_range lost the last of MX_RANGES ranges");
+
+  return NULL;
+}
+
+char *test_if_range()
+{
+  time_t mtime = 1000000000;
+  char date[HTTP_DATE_LEN + 1], earlier[HTTP_DATE_LEN + 1], later[HTTP_DATE_LEN + 1];
+  char *etag = "\"abc-1\"";
+
+  http_format_date(mtime, date, sizeof date);
+  http_format_date(mtime - 60, earlier, sizeof earlier);
+  http_format_date(mtime + 60, later, sizeof later);
+
+  struct {
+    char *if_range; // NULL for no If-Range header
+    int expect;
+  } cases[] = {
+    { NULL, 1 },
+    { "\"abc-1\"", 1 },
+    { "\"abc-2\"", 0 },
+    { "W/\"abc-1\"", 0 }, // If-Range only compares strongly
+    { date, 1 },
+    { earlier, 0 },
+    { later, 0 }, // Only an exact Last-Modified counts
+    { "yesterday", 0 },
+  };
+
+  for (int i = 0; i < (int)(sizeof cases / sizeof cases[0]); i++) {
+    char buf[256];
+    struct http_request req;
+    int len;
+
+    if (cases[i].if_range != NULL) {
+      len = sprintf(buf, "GET / HTTP/1.1\r\nRange: bytes=0-1\r\nIf-Range: %s\r\n\r\n", cases[i].if_range);
+    }
+    else {
+      len = sprintf(buf, "GET / HTTP/1.1\r\nRange: bytes=0-1\r\n\r\n");
+    }
+    http_request_init(&req);
+    mu_assert(http_parse(&req, buf, len) == len, "A request with If-Range did not parse");
+    mu_assert(http_range_applies(&req, etag, mtime) == cases[i].expect, "http_range_applies judged If-Range wrongly");
+  }
+
+  return NULL;
+}
+
+char *test_conn_write_order()
+{
+  int sv[2];
+  mu_assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0, "socketpair failed");
+  fcntl(sv[0], F_SETFL, O_NONBLOCK);
+  struct conn *c = conn_open(sv[0], 1);
+  mu_assert(c != NULL, "conn_open failed");
+
+  char path[] = "/tmp/conn_testXXXXXX";
+  int file_fd = mkstemp(path);
+  mu_assert(file_fd >= 0, "mkstemp failed");
+  unlink(path);
+  mu_assert(write(file_fd, "BODY", 4) == 4, "write failed");
+
+  // More than the socket takes at once, so the file has to wait its turn
+  int head_len = 1 << 20;
+  char *head = malloc(head_len);
+  memset(head, 'h', head_len);
+
+  mu_assert(conn_write(c->fd, head, head_len) == head_len, "conn_write failed");
+  mu_assert(conn_sendfile(c->fd, file_fd, 0, 4) == 0, "conn_sendfile failed");
+  mu_assert(c->file_fd >= 0, "The file segment should still be pending");
+  mu_assert(conn_write(c->fd, "TAIL", 4) == 4, "conn_write after the file failed");
+  close(file_fd);
+
+  char *got = malloc(head_len + 8);
+  int got_len = 0, rv = 1;
+  while (got_len < head_len + 8) {
+    rv = conn_flush(c);
+    mu_assert(rv >= 0, "conn_flush failed");
+    int n = recv(sv[1], got + got_len, head_len + 8 - got_len, MSG_DONTWAIT);
+    if (n > 0) got_len += n;
+    else if (rv == 0) break;
+  }
+  mu_assert(got_len == head_len + 8 && memcmp(got + head_len, "BODYTAIL", 8) == 0, "Bytes written after a pending file were sent ahead of it");
+
+  free(head);
+  free(got);
+  conn_close(c);
+  close(sv[1]);
+
+  return NULL;
+}
+
 char *all_tests()
 {
   mu_suite_start();
@@ -154,6 +1045,22 @@ char *all_tests()
   mu_run_test(test_cache_alloc_entry);
   mu_run_test(test_cache_put);
   mu_run_test(test_cache_get);
+  mu_run_test(test_cache_etag);
+  mu_run_test(test_cache_budget);
+  mu_run_test(test_cache_policies);
+  mu_run_test(test_cache_clock);
+  mu_run_test(test_cache_mapped);
+  mu_run_test(test_sharded_cache);
+  mu_run_test(test_hashtable);
+  mu_run_test(test_chashtable);
+  mu_run_test(test_chashtable_readers);
+  mu_run_test(test_parse_split);
+  mu_run_test(test_parse_pipelined);
+  mu_run_test(test_parse_chunked);
+  mu_run_test(test_parse_limits);
+  mu_run_test(test_parse_range);
+  mu_run_test(test_if_range);
+  mu_run_test(test_conn_write_order);
 
   return NULL;
 }
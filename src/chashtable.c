@@ -0,0 +1,642 @@
+/**
+ * chashtable.c -- a hashtable safe to share between threads
+ *
+ * Example:
+ *
+ * struct chashtable *ht = chashtable_create(0, 0, NULL);
+ *
+ * chashtable_put(ht, "some data", &data1);  // from any thread
+ * int *result = chashtable_get(ht, "some data");
+ *
+ * Keys are hashed once, and the hash picks both the stripe (its high bits)
+ * and, inside the stripe, the chain (its low bits).
+ *
+ * Lookups take no lock. Each stripe is an array of chains whose nodes never
+ * change once they're linked in: a put of a key that's already there links
+ * a new node in place of the old one, and a stripe that grows gets a new
+ * array of copied nodes. Every change is a single pointer store, so a
+ * reader walking a chain always sees it either before or after the change.
+ *
+ * What's unlinked can't be freed straight away, because a reader may still
+ * be on it. Readers say which epoch they started reading in; unlinked nodes
+ * and arrays wait on their stripe's garbage list until the global epoch has
+ * moved on twice, which can only happen once every reader that might have
+ * seen them is done (epoch-based reclamation). Writers advance the epoch
+ * and free what's ready every GARBAGE_BATCH unlinks.
+ *
+ * The table only stores data pointers. Whatever they point to has to stay
+ * valid for as long as another thread might have just looked it up. A
+ * table given a release function (chashtable_set_release()) takes care of
+ * that itself: data that's deleted or replaced is only released once no
+ * lookup can still be on it, and chashtable_get_pinned() lets a lookup take
+ * a reference of its own before then.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "hashtable.h"
+#include "chashtable.h"
+
+#define DEFAULT_STRIPES 16
+#define DEFAULT_SIZE 128
+#define MIN_BUCKETS 8
+#define GARBAGE_BATCH 64 // Unlinks on a stripe between attempts to free them
+
+// A thread that does lookups
+//
+// Each has its own cache line, so lookups on different threads don't
+// write to the same memory.
+struct reader {
+    unsigned long epoch; // Epoch its lookup started in, 0 when not in one
+    int in_use;          // Cleared when its thread exits, for reuse
+    struct reader *next;
+} __attribute__((aligned(64)));
+
+static struct reader *readers; // Every record ever made; never freed
+static unsigned long global_epoch = 1;
+static pthread_key_t reader_key;
+static pthread_once_t reader_once = PTHREAD_ONCE_INIT;
+static __thread struct reader *self;
+
+/**
+ * Thread exit: give the thread's reader record up for reuse
+ */
+static void reader_release(void *r)
+{
+    __atomic_store_n(&((struct reader *)r)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void reader_key_create(void)
+{
+    pthread_key_create(&reader_key, reader_release);
+}
+
+/**
+ * Find this thread a reader record, reusing one an exited thread left
+ *
+ * Returns NULL if there's no memory for a new one.
+ */
+static struct reader *reader_register(void)
+{
+    struct reader *r;
+
+    pthread_once(&reader_once, reader_key_create);
+
+    for (r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        int unused = 0;
+
+        if (__atomic_compare_exchange_n(&r->in_use, &unused, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    if (r == NULL) {
+        if (posix_memalign((void **)&r, sizeof *r, sizeof *r) != 0) return NULL;
+
+        r->epoch = 0;
+        r->in_use = 1;
+        r->next = __atomic_load_n(&readers, __ATOMIC_RELAXED);
+
+        while (!__atomic_compare_exchange_n(&readers, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+    }
+
+    pthread_setspecific(reader_key, r);
+
+    return r;
+}
+
+/**
+ * Start a lookup: nothing reachable from here on is freed until read_end()
+ *
+ * Returns 0, or -1 if the thread couldn't be registered as a reader.
+ */
+static int read_begin(void)
+{
+    if (self == NULL && (self = reader_register()) == NULL) {
+        return -1;
+    }
+
+    __atomic_store_n(&self->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+    // Pairs with the fence in retire(): either the writer sees we're
+    // reading, or we see what it unlinked as already gone
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return 0;
+}
+
+static void read_end(void)
+{
+    __atomic_store_n(&self->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Move the global epoch on if every reader has caught up with it
+ *
+ * Returns the epoch as it now stands.
+ */
+static unsigned long epoch_advance(void)
+{
+    unsigned long epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+    for (struct reader *r = __atomic_load_n(&readers, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        unsigned long e = __atomic_load_n(&r->epoch, __ATOMIC_SEQ_CST);
+
+        if (e != 0 && e != epoch) return epoch;
+    }
+
+    if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        return epoch + 1;
+    }
+
+    return epoch; // Someone else moved it on; the failed exchange loaded it
+}
+
+/**
+ * Free whatever a stripe has unlinked that no reader can still be on
+ *
+ * Something unlinked in epoch e is safe once the epoch reaches e + 2:
+ * getting there took every reader to start a lookup after it was unlinked.
+ */
+static void collect(struct chashtable *ht, struct chashtable_stripe *stripe)
+{
+    // Twice, since that's as far as what was just unlinked has to wait for,
+    // if no reader is in the way
+    epoch_advance();
+    unsigned long epoch = epoch_advance();
+    struct chashtable_garbage **link = &stripe->garbage;
+
+    while (*link != NULL) {
+        struct chashtable_garbage *g = *link;
+
+        if (g->epoch + 2 <= epoch) {
+            *link = g->next;
+            if (g->data != NULL) {
+                ht->release(g->data);
+                stripe->garbage_data--;
+            }
+            free(g);
+            stripe->garbage_count--;
+        }
+        else {
+            link = &g->next;
+        }
+    }
+}
+
+/**
+ * Hand something just unlinked from a stripe over to be freed later
+ *
+ * data is what left the table with it, to be released at the same time
+ * (NULL for nothing). Garbage holding data is collected straight away, and
+ * on every later write until it's gone, since data can be much bigger than
+ * a node. Called with the stripe locked.
+ */
+static void retire(struct chashtable *ht, struct chashtable_stripe *stripe, struct chashtable_garbage *g, void *data)
+{
+    // Pairs with the fence in read_begin()
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    g->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+    g->data = ht->release != NULL ? data : NULL;
+    g->next = stripe->garbage;
+    stripe->garbage = g;
+
+    if (g->data != NULL) {
+        stripe->garbage_data++;
+    }
+
+    if (++stripe->garbage_count % GARBAGE_BATCH == 0 || g->data != NULL) {
+        collect(ht, stripe);
+    }
+}
+
+/**
+ * Pick the stripe a hash lives in
+ */
+static struct chashtable_stripe *stripe_for(struct chashtable *ht, unsigned long long hash)
+{
+    return &ht->stripes[(hash >> 32) & (ht->num_stripes - 1)];
+}
+
+static struct chashtable_buckets *buckets_create(int size)
+{
+    struct chashtable_buckets *b = calloc(1, sizeof *b + size * sizeof b->chains[0]);
+
+    if (b == NULL) return NULL;
+
+    b->size = size;
+
+    return b;
+}
+
+static struct chashtable_node *node_create(void *key, int key_size, unsigned long long hash, void *data)
+{
+    struct chashtable_node *node = malloc(sizeof *node + key_size);
+
+    if (node == NULL) return NULL;
+
+    node->next = NULL;
+    node->hash = hash;
+    node->data = data;
+    node->key_size = key_size;
+    memcpy(node->key, key, key_size);
+
+    return node;
+}
+
+static int node_matches(struct chashtable_node *node, void *key, int key_size, unsigned long long hash)
+{
+    return node->hash == hash && node->key_size == key_size && memcmp(node->key, key, key_size) == 0;
+}
+
+/**
+ * Find the link pointing at a key's node, or at the end of its chain if
+ * it isn't there
+ *
+ * Writers only, with the stripe locked.
+ */
+static struct chashtable_node **chain_find(struct chashtable_buckets *b, void *key, int key_size, unsigned long long hash)
+{
+    struct chashtable_node **link = &b->chains[hash & (b->size - 1)];
+
+    while (*link != NULL && !node_matches(*link, key, key_size, hash)) {
+        link = &(*link)->next;
+    }
+
+    return link;
+}
+
+/**
+ * Double a stripe's chains
+ *
+ * Readers may be walking the old chains, so the nodes are copied rather
+ * than relinked. If there's no memory for that the chains just get longer.
+ */
+static void stripe_grow(struct chashtable *ht, struct chashtable_stripe *stripe)
+{
+    struct chashtable_buckets *old = stripe->buckets;
+    struct chashtable_buckets *b = buckets_create(old->size * 2);
+
+    if (b == NULL) return;
+
+    for (int i = 0; i < old->size; i++) {
+        for (struct chashtable_node *n = old->chains[i]; n != NULL; n = n->next) {
+            struct chashtable_node *copy = node_create(n->key, n->key_size, n->hash, n->data);
+
+            if (copy == NULL) {
+                for (int j = 0; j < b->size; j++) {
+                    while (b->chains[j] != NULL) {
+                        struct chashtable_node *next = b->chains[j]->next;
+                        free(b->chains[j]);
+                        b->chains[j] = next;
+                    }
+                }
+                free(b);
+                return;
+            }
+
+            struct chashtable_node **chain = &b->chains[n->hash & (b->size - 1)];
+            copy->next = *chain;
+            *chain = copy;
+        }
+    }
+
+    __atomic_store_n(&stripe->buckets, b, __ATOMIC_RELEASE);
+
+    // Their data lives on in the copies
+    for (int i = 0; i < old->size; i++) {
+        struct chashtable_node *n = old->chains[i];
+
+        while (n != NULL) {
+            struct chashtable_node *next = n->next;
+            retire(ht, stripe, &n->gc, NULL);
+            n = next;
+        }
+    }
+    retire(ht, stripe, &old->gc, NULL);
+}
+
+/**
+ * Create a new concurrent hashtable
+ *
+ * size:        starting number of chains overall (0 for the default)
+ * num_stripes: independently written parts, rounded up to a power of two
+ *              (0 for the default)
+ * hashf:       hash function, or NULL for hashtable_hash()
+ */
+struct chashtable *chashtable_create(int size, int num_stripes, unsigned long long (*hashf)(void *, int))
+{
+    if (num_stripes < 1) {
+        num_stripes = DEFAULT_STRIPES;
+    }
+
+    if (size < 1) {
+        size = DEFAULT_SIZE;
+    }
+
+    if (hashf == NULL) {
+        hashf = hashtable_hash;
+    }
+
+    struct chashtable *ht = malloc(sizeof *ht);
+
+    if (ht == NULL) return NULL;
+
+    ht->num_stripes = 1;
+    while (ht->num_stripes < num_stripes) ht->num_stripes *= 2;
+    ht->hashf = hashf;
+    ht->release = NULL;
+
+    if (posix_memalign((void **)&ht->stripes, sizeof *ht->stripes, ht->num_stripes * sizeof *ht->stripes) != 0) {
+        free(ht);
+        return NULL;
+    }
+    memset(ht->stripes, 0, ht->num_stripes * sizeof *ht->stripes);
+
+    int buckets = MIN_BUCKETS;
+    while (buckets * ht->num_stripes < size) buckets *= 2;
+
+    for (int i = 0; i < ht->num_stripes; i++) {
+        ht->stripes[i].buckets = buckets_create(buckets);
+
+        if (ht->stripes[i].buckets == NULL) {
+            ht->num_stripes = i;
+            chashtable_destroy(ht);
+            return NULL;
+        }
+
+        pthread_mutex_init(&ht->stripes[i].lock, NULL);
+    }
+
+    return ht;
+}
+
+/**
+ * Destroy a concurrent hashtable
+ *
+ * No other thread may be using it. Data still waiting to be released is
+ * released now. NOTE: does *not* free the data pointers still in the table
+ */
+void chashtable_destroy(struct chashtable *ht)
+{
+    for (int i = 0; i < ht->num_stripes; i++) {
+        struct chashtable_stripe *stripe = &ht->stripes[i];
+        struct chashtable_buckets *b = stripe->buckets;
+
+        for (int j = 0; j < b->size; j++) {
+            struct chashtable_node *n = b->chains[j];
+
+            while (n != NULL) {
+                struct chashtable_node *next = n->next;
+                free(n);
+                n = next;
+            }
+        }
+        free(b);
+
+        while (stripe->garbage != NULL) {
+            struct chashtable_garbage *next = stripe->garbage->next;
+            if (stripe->garbage->data != NULL) {
+                ht->release(stripe->garbage->data);
+            }
+            free(stripe->garbage);
+            stripe->garbage = next;
+        }
+
+        pthread_mutex_destroy(&stripe->lock);
+    }
+
+    free(ht->stripes);
+    free(ht);
+}
+
+/**
+ * Have data that's deleted or replaced released once no lookup can still
+ * be using it
+ *
+ * release is called from whichever writer finds it safe, with that
+ * writer's stripe locked. Set it before the table is shared.
+ */
+void chashtable_set_release(struct chashtable *ht, void (*release)(void *))
+{
+    ht->release = release;
+}
+
+/**
+ * Release whatever a stripe is still holding on to for readers
+ *
+ * Called by writers with the stripe locked.
+ */
+static void stripe_tidy(struct chashtable *ht, struct chashtable_stripe *stripe)
+{
+    if (stripe->garbage_data > 0) {
+        collect(ht, stripe);
+    }
+}
+
+/**
+ * Put with a string key
+ */
+void *chashtable_put(struct chashtable *ht, char *key, void *data)
+{
+    return chashtable_put_bin(ht, key, strlen(key), data);
+}
+
+/**
+ * Put with a binary key
+ */
+void *chashtable_put_bin(struct chashtable *ht, void *key, int key_size, void *data)
+{
+    return chashtable_put_hashed(ht, key, key_size, ht->hashf(key, key_size), data);
+}
+
+/**
+ * Put with a binary key whose hash (by ht->hashf) is known
+ *
+ * Replaces whatever was stored under the same key (released, if the table
+ * has a release function). Returns data, or NULL if there's no memory for
+ * it.
+ */
+void *chashtable_put_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash, void *data)
+{
+    struct chashtable_stripe *stripe = stripe_for(ht, hash);
+    struct chashtable_node *node = node_create(key, key_size, hash, data);
+
+    if (node == NULL) return NULL;
+
+    pthread_mutex_lock(&stripe->lock);
+    stripe_tidy(ht, stripe);
+
+    struct chashtable_node **link = chain_find(stripe->buckets, key, key_size, hash);
+    struct chashtable_node *old = *link;
+
+    if (old != NULL) {
+        node->next = old->next;
+        __atomic_store_n(link, node, __ATOMIC_RELEASE);
+        retire(ht, stripe, &old->gc, old->data);
+    }
+    else {
+        __atomic_store_n(link, node, __ATOMIC_RELEASE);
+
+        int n = __atomic_add_fetch(&stripe->num_entries, 1, __ATOMIC_RELAXED);
+
+        if (n > stripe->buckets->size) {
+            stripe_grow(ht, stripe);
+        }
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return data;
+}
+
+/**
+ * Get with a string key
+ */
+void *chashtable_get(struct chashtable *ht, char *key)
+{
+    return chashtable_get_bin(ht, key, strlen(key));
+}
+
+/**
+ * Get with a binary key
+ */
+void *chashtable_get_bin(struct chashtable *ht, void *key, int key_size)
+{
+    return chashtable_get_hashed(ht, key, key_size, ht->hashf(key, key_size));
+}
+
+/**
+ * Get with a binary key whose hash is known
+ *
+ * Takes no lock, so it never waits for a writer, even on the same stripe.
+ */
+void *chashtable_get_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash)
+{
+    return chashtable_get_pinned(ht, key, key_size, hash, NULL);
+}
+
+/**
+ * Get with a binary key whose hash is known, and pin what's found
+ *
+ * pin(data) is called (unless pin is NULL) while the data can't yet have
+ * been released, so it can take a reference that keeps it valid after
+ * it's deleted. Only useful for a table with a release function.
+ */
+void *chashtable_get_pinned(struct chashtable *ht, void *key, int key_size, unsigned long long hash, void (*pin)(void *))
+{
+    struct chashtable_stripe *stripe = stripe_for(ht, hash);
+    void *data = NULL;
+
+    if (read_begin() < 0) {
+        // Can't be tracked as a reader; be a writer instead
+        pthread_mutex_lock(&stripe->lock);
+        struct chashtable_node *node = *chain_find(stripe->buckets, key, key_size, hash);
+        data = node != NULL ? node->data : NULL;
+        if (data != NULL && pin != NULL) pin(data);
+        pthread_mutex_unlock(&stripe->lock);
+        return data;
+    }
+
+    struct chashtable_buckets *b = __atomic_load_n(&stripe->buckets, __ATOMIC_ACQUIRE);
+    struct chashtable_node *node = __atomic_load_n(&b->chains[hash & (b->size - 1)], __ATOMIC_ACQUIRE);
+
+    while (node != NULL) {
+        if (node_matches(node, key, key_size, hash)) {
+            data = node->data;
+            if (pin != NULL) pin(data);
+            break;
+        }
+        node = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    }
+
+    read_end();
+
+    return data;
+}
+
+/**
+ * Delete by string key
+ */
+void *chashtable_delete(struct chashtable *ht, char *key)
+{
+    return chashtable_delete_bin(ht, key, strlen(key));
+}
+
+/**
+ * Delete by binary key
+ */
+void *chashtable_delete_bin(struct chashtable *ht, void *key, int key_size)
+{
+    return chashtable_delete_hashed(ht, key, key_size, ht->hashf(key, key_size));
+}
+
+/**
+ * Delete by binary key whose hash is known
+ *
+ * Returns the data that was stored, or NULL if the key wasn't there.
+ * NOTE: does *not* free the data. A table with a release function
+ * releases it later, so the caller can only go on using it if it holds a
+ * reference of its own.
+ */
+void *chashtable_delete_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash)
+{
+    struct chashtable_stripe *stripe = stripe_for(ht, hash);
+    void *data = NULL;
+
+    pthread_mutex_lock(&stripe->lock);
+    stripe_tidy(ht, stripe);
+
+    struct chashtable_node **link = chain_find(stripe->buckets, key, key_size, hash);
+    struct chashtable_node *node = *link;
+
+    if (node != NULL) {
+        data = node->data;
+        __atomic_store_n(link, node->next, __ATOMIC_RELEASE);
+        __atomic_sub_fetch(&stripe->num_entries, 1, __ATOMIC_RELAXED);
+        retire(ht, stripe, &node->gc, data);
+    }
+
+    pthread_mutex_unlock(&stripe->lock);
+
+    return data;
+}
+
+/**
+ * For-each element in the table
+ *
+ * Each stripe is visited with its writers locked out, so f sees every
+ * stripe as it was at some moment, but not the whole table at one moment.
+ * f must not change the table.
+ */
+void chashtable_foreach(struct chashtable *ht, void (*f)(void *, void *), void *arg)
+{
+    for (int i = 0; i < ht->num_stripes; i++) {
+        struct chashtable_stripe *stripe = &ht->stripes[i];
+
+        pthread_mutex_lock(&stripe->lock);
+        struct chashtable_buckets *b = stripe->buckets;
+        for (int j = 0; j < b->size; j++) {
+            for (struct chashtable_node *n = b->chains[j]; n != NULL; n = n->next) {
+                f(n->data, arg);
+            }
+        }
+        pthread_mutex_unlock(&stripe->lock);
+    }
+}
+
+/**
+ * Number of entries, as near as concurrent changes allow
+ */
+int chashtable_count(struct chashtable *ht)
+{
+    int count = 0;
+
+    for (int i = 0; i < ht->num_stripes; i++) {
+        count += __atomic_load_n(&ht->stripes[i].num_entries, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
@@ -0,0 +1,68 @@
+#ifndef _CHASHTABLE_H_
+#define _CHASHTABLE_H_
+#include <pthread.h>
+
+// Something a writer has unlinked but readers may still be looking at
+struct chashtable_garbage {
+    struct chashtable_garbage *next;
+    unsigned long epoch; // Global epoch when it was unlinked
+    void *data; // Handed to the table's release function once freed, or NULL
+};
+
+// One key and its data. Never changed once readers can reach it, apart
+// from its next link
+struct chashtable_node {
+    struct chashtable_garbage gc;
+    struct chashtable_node *next;
+    unsigned long long hash;
+    void *data;
+    int key_size;
+    char key[];
+};
+
+// A stripe's array of chains, replaced whole when the stripe grows
+struct chashtable_buckets {
+    struct chashtable_garbage gc;
+    int size; // A power of two
+    struct chashtable_node *chains[];
+};
+
+// One independently written part of a concurrent hashtable
+struct chashtable_stripe {
+    pthread_mutex_t lock; // Held by writers only
+    struct chashtable_buckets *buckets;
+    int num_entries;
+    struct chashtable_garbage *garbage; // Unlinked, waiting for readers to move on
+    int garbage_count;
+    int garbage_data; // How many of them still have data to release
+} __attribute__((aligned(64)));
+
+// A hashtable many threads can use at once
+//
+// Keys are split by hash into stripes. Writers to a stripe take its lock;
+// readers take no lock at all, so lookups never wait and never write to
+// memory another thread is reading.
+struct chashtable {
+    int num_stripes; // A power of two. Read-only
+    struct chashtable_stripe *stripes;
+    unsigned long long (*hashf)(void *data, int data_size);
+    void (*release)(void *data); // Called for data that's left the table, or NULL
+};
+
+extern struct chashtable *chashtable_create(int size, int num_stripes, unsigned long long (*hashf)(void *, int));
+extern void chashtable_destroy(struct chashtable *ht);
+extern void chashtable_set_release(struct chashtable *ht, void (*release)(void *));
+extern void *chashtable_put(struct chashtable *ht, char *key, void *data);
+extern void *chashtable_put_bin(struct chashtable *ht, void *key, int key_size, void *data);
+extern void *chashtable_put_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash, void *data);
+extern void *chashtable_get(struct chashtable *ht, char *key);
+extern void *chashtable_get_bin(struct chashtable *ht, void *key, int key_size);
+extern void *chashtable_get_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash);
+extern void *chashtable_get_pinned(struct chashtable *ht, void *key, int key_size, unsigned long long hash, void (*pin)(void *));
+extern void *chashtable_delete(struct chashtable *ht, char *key);
+extern void *chashtable_delete_bin(struct chashtable *ht, void *key, int key_size);
+extern void *chashtable_delete_hashed(struct chashtable *ht, void *key, int key_size, unsigned long long hash);
+extern void chashtable_foreach(struct chashtable *ht, void (*f)(void *, void *), void *arg);
+extern int chashtable_count(struct chashtable *ht);
+
+#endif
@@ -0,0 +1,710 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include "file.h"
+#include "conn.h"
+
+#define CONN_INBUF_SIZE 4096
+#define CONN_MAX_QUEUED 262144 // Output a producer may queue for a slow client before it waits
+
+// Connection state, indexed by fd
+static struct conn *conn_table[MX_CONNS];
+
+int conn_max_requests = 100;
+int conn_idle_timeout = 5;
+
+void (*conn_body_hook)(struct conn *c) = NULL;
+
+/**
+ * Parser callback: headers are in, let the body hook have a look
+ */
+static void conn_headers_done(struct http_request *req, void *arg)
+{
+    (void)req;
+
+    if (conn_body_hook != NULL) {
+        conn_body_hook(arg);
+    }
+}
+
+/**
+ * Get the parser ready for the next request on a connection
+ */
+static void conn_request_init(struct conn *c)
+{
+    http_request_init(&c->req);
+
+    c->req.on_headers = conn_headers_done;
+    c->req.on_headers_arg = c;
+}
+
+/**
+ * Allocate state for a newly accepted socket
+ *
+ * nonblocking: 1 if the socket is O_NONBLOCK and writes should be
+ *              queued instead of retried
+ */
+struct conn *conn_open(int fd, int nonblocking)
+{
+    if (fd < 0 || fd >= MX_CONNS) {
+        return NULL;
+    }
+
+    struct conn *c = malloc(sizeof *c);
+
+    if (c == NULL) return NULL;
+
+    c->fd = fd;
+    c->nonblocking = nonblocking;
+    c->queue_only = 0;
+    c->state = CONN_READING;
+
+    c->inbuf = malloc(CONN_INBUF_SIZE);
+    c->inlen = 0;
+    c->incap = CONN_INBUF_SIZE;
+
+    c->outbuf = NULL;
+    c->outoff = 0;
+    c->outlen = 0;
+    c->outcap = 0;
+
+    c->file_fd = -1;
+    c->file_off = 0;
+    c->file_remaining = 0;
+
+    c->tailbuf = NULL;
+    c->taillen = 0;
+    c->tailcap = 0;
+
+    c->producer = NULL;
+    c->producer_state = NULL;
+    c->producer_done = NULL;
+    c->producing = 0;
+
+    c->keep_alive = 0;
+    c->requests = 0;
+    c->reqlen = 0;
+    conn_request_init(c);
+    c->upload = NULL;
+
+    c->last_active = time(NULL);
+    c->idle_prev = c->idle_next = NULL;
+
+    if (c->inbuf == NULL) {
+        free(c);
+        return NULL;
+    }
+
+    c->inbuf[0] = '\0';
+
+    conn_table[fd] = c;
+
+    return c;
+}
+
+/**
+ * Look up the state for a socket
+ *
+ * Returns NULL if the fd is not tracked
+ */
+struct conn *conn_get(int fd)
+{
+    if (fd < 0 || fd >= MX_CONNS) {
+        return NULL;
+    }
+
+    return conn_table[fd];
+}
+
+/**
+ * Forget a file that was still being sent, and whatever was written
+ * behind it
+ */
+static void conn_drop_file(struct conn *c)
+{
+    if (c->file_fd >= 0) {
+        close(c->file_fd);
+    }
+
+    c->file_fd = -1;
+    c->file_off = 0;
+    c->file_remaining = 0;
+    c->taillen = 0;
+}
+
+/**
+ * Stop producing a response and let its producer clean up
+ */
+static void conn_end_producer(struct conn *c, int completed)
+{
+    conn_producer_done done = c->producer_done;
+    void *state = c->producer_state;
+
+    c->producer = NULL;
+    c->producer_state = NULL;
+    c->producer_done = NULL;
+
+    done(state, completed);
+}
+
+/**
+ * Close the socket and free its state
+ */
+void conn_close(struct conn *c)
+{
+    conn_table[c->fd] = NULL;
+    close(c->fd);
+    conn_drop_file(c);
+
+    // Client went away mid-response
+    if (c->producer != NULL) {
+        conn_end_producer(c, 0);
+    }
+
+    // Client went away mid-upload
+    if (c->upload != NULL) {
+        file_upload_abort(c->upload);
+    }
+
+    free(c->inbuf);
+    free(c->outbuf);
+    free(c->tailbuf);
+    free(c);
+}
+
+/**
+ * Append bytes behind a file segment that's still being sent
+ */
+static int conn_queue_tail(struct conn *c, char *buf, int len)
+{
+    if (c->taillen + len > c->tailcap) {
+        int newcap = c->tailcap ? c->tailcap : CONN_INBUF_SIZE;
+
+        while (newcap < c->taillen + len) {
+            newcap *= 2;
+        }
+
+        char *p = realloc(c->tailbuf, newcap);
+
+        if (p == NULL) return -1;
+
+        c->tailbuf = p;
+        c->tailcap = newcap;
+    }
+
+    memcpy(c->tailbuf + c->taillen, buf, len);
+    c->taillen += len;
+
+    return len;
+}
+
+/**
+ * Append bytes to the output queue
+ *
+ * While a file segment is pending they wait behind it, since outbuf is
+ * always sent ahead of the file.
+ */
+static int conn_queue(struct conn *c, char *buf, int len)
+{
+    if (c->file_fd >= 0) {
+        return conn_queue_tail(c, buf, len);
+    }
+
+    // Reclaim what's been sent. Nothing is in flight while we're called:
+    // io_uring sends are only queued from the loop once handlers are done.
+    if (c->outoff == c->outlen) {
+        c->outoff = c->outlen = 0;
+    }
+    else if (c->outoff > 0 && c->outlen + len > c->outcap) {
+        memmove(c->outbuf, c->outbuf + c->outoff, c->outlen - c->outoff);
+        c->outlen -= c->outoff;
+        c->outoff = 0;
+    }
+
+    if (c->outlen + len > c->outcap) {
+        int newcap = c->outcap ? c->outcap : CONN_INBUF_SIZE;
+
+        while (newcap < c->outlen + len) {
+            newcap *= 2;
+        }
+
+        char *p = realloc(c->outbuf, newcap);
+
+        if (p == NULL) return -1;
+
+        c->outbuf = p;
+        c->outcap = newcap;
+    }
+
+    memcpy(c->outbuf + c->outlen, buf, len);
+    c->outlen += len;
+
+    return len;
+}
+
+/**
+ * Whether earlier output is still waiting, so new bytes must be queued
+ * behind it rather than sent straight away
+ *
+ * That's anything in outbuf, a pending file segment, or a producer that
+ * hasn't finished (unless it's the producer itself writing).
+ */
+static int conn_pending(struct conn *c)
+{
+    return c->outoff < c->outlen || c->file_fd >= 0 || (c->producer != NULL && !c->producing);
+}
+
+/**
+ * Write a response made of several pieces to a client socket
+ *
+ * The pieces go out in one sendmsg() where possible, so a body can be sent
+ * straight from wherever it lives (e.g. the cache) without first being
+ * copied behind its headers. Short writes pick up where they stopped;
+ * iov is updated in place as it's consumed.
+ *
+ * Blocking sockets are written until everything is sent. Event loop sockets
+ * get as much as the kernel will take right now, and the rest is queued to
+ * be sent by conn_flush() once the socket is writable again. io_uring
+ * sockets never write here; everything is queued for the ring to send.
+ * Nothing here waits for a slow client; responses big enough for that to
+ * matter are produced a piece at a time with conn_produce().
+ *
+ * Returns the total length, or -1 on error.
+ */
+int conn_writev(int fd, struct iovec *iov, int iovcnt)
+{
+    struct conn *c = conn_get(fd);
+    struct msghdr msg;
+    int total = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iovcnt;
+
+    // Don't jump the queue if earlier bytes are still waiting
+    int queue = c != NULL && (c->queue_only || (c->nonblocking && conn_pending(c)));
+
+    while (msg.msg_iovlen > 0 && !queue) {
+        ssize_t rv = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+
+            if (c != NULL && c->nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                queue = 1;
+                break;
+            }
+
+            perror("send");
+            return -1;
+        }
+
+        // Skip past whatever made it out
+        while (msg.msg_iovlen > 0 && (size_t)rv >= msg.msg_iov->iov_len) {
+            rv -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rv;
+            msg.msg_iov->iov_len -= rv;
+        }
+    }
+
+    for (size_t i = 0; queue && i < msg.msg_iovlen; i++) {
+        if (conn_queue(c, msg.msg_iov[i].iov_base, msg.msg_iov[i].iov_len) < 0) return -1;
+    }
+
+    return total;
+}
+
+/**
+ * Write bytes to a client socket
+ *
+ * Same as conn_writev() with a single piece.
+ *
+ * Returns len, or -1 on error.
+ */
+int conn_write(int fd, void *buf, int len)
+{
+    struct iovec iov;
+
+    iov.iov_base = buf;
+    iov.iov_len = len;
+
+    return conn_writev(fd, &iov, 1);
+}
+
+/**
+ * Copy part of a file to a socket through user space
+ *
+ * For when sendfile() can't be used: the fds don't support it, or the file
+ * is sent in several pieces with other bytes between them (only one
+ * conn_sendfile() segment can be pending at a time). Goes through
+ * conn_write(), so it works on any kind of connection.
+ *
+ * Returns 0, or -1 on error.
+ */
+int conn_copy_file(int fd, int file_fd, off_t offset, off_t count)
+{
+    char buf[16384];
+
+    while (count > 0) {
+        ssize_t n = pread(file_fd, buf, count < (off_t)sizeof buf ? count : (off_t)sizeof buf, offset);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("pread");
+            return -1;
+        }
+
+        // Truncated under us; the client will see a short body
+        if (n == 0) return -1;
+
+        if (conn_write(fd, buf, n) < 0) return -1;
+
+        offset += n;
+        count -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * Send a pending file segment with sendfile()
+ *
+ * Returns 0 once it has all been sent, 1 if the socket would block, or -1
+ * on error.
+ */
+static int conn_send_file(struct conn *c)
+{
+    while (c->file_remaining > 0) {
+        ssize_t rv = sendfile(c->fd, c->file_fd, &c->file_off, c->file_remaining);
+
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+
+            perror("sendfile");
+            return -1;
+        }
+
+        // Truncated under us; the client will see a short body
+        if (rv == 0) return -1;
+
+        c->file_remaining -= rv;
+    }
+
+    conn_file_done(c);
+
+    return 0;
+}
+
+/**
+ * Finish with a file segment that has all been sent
+ *
+ * Whatever was written behind it moves up into the output queue.
+ */
+void conn_file_done(struct conn *c)
+{
+    int taillen = c->taillen;
+
+    conn_drop_file(c);
+
+    if (taillen == 0) {
+        return;
+    }
+
+    if (c->outoff == c->outlen) {
+        char *buf = c->outbuf;
+        int cap = c->outcap;
+
+        c->outbuf = c->tailbuf;
+        c->outcap = c->tailcap;
+        c->outoff = 0;
+        c->outlen = taillen;
+
+        c->tailbuf = buf;
+        c->tailcap = cap;
+    }
+    else {
+        conn_queue(c, c->tailbuf, taillen);
+    }
+}
+
+/**
+ * Send part of a file to a client socket without copying it through
+ * user space
+ *
+ * Blocking sockets are written until it's all sent. For event loop and
+ * io_uring sockets the file is dup()ed and sent (or read in pieces, for
+ * io_uring) as the socket drains, so the caller can close file_fd straight
+ * away either way. Anything written after it is held back until it has
+ * gone out. Only one file can be pending at a time, so a second one is
+ * copied in behind the first with conn_copy_file().
+ *
+ * Returns 0, or -1 on error.
+ */
+int conn_sendfile(int fd, int file_fd, off_t offset, off_t count)
+{
+    struct conn *c = conn_get(fd);
+
+    if (count <= 0) {
+        return 0;
+    }
+
+    if (c == NULL || (!c->nonblocking && !c->queue_only)) {
+        while (count > 0) {
+            ssize_t rv = sendfile(fd, file_fd, &offset, count);
+
+            if (rv < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL || errno == ENOSYS) return conn_copy_file(fd, file_fd, offset, count);
+
+                perror("sendfile");
+                return -1;
+            }
+
+            if (rv == 0) return -1;
+
+            count -= rv;
+        }
+
+        return 0;
+    }
+
+    if (c->file_fd >= 0) {
+        return conn_copy_file(fd, file_fd, offset, count);
+    }
+
+    c->file_fd = dup(file_fd);
+
+    if (c->file_fd < 0) {
+        perror("dup");
+        return -1;
+    }
+
+    c->file_off = offset;
+    c->file_remaining = count;
+
+    // Anything already queued goes first; conn_flush() gets to the file after
+    if (c->queue_only || conn_pending(c)) {
+        return 0;
+    }
+
+    return conn_send_file(c) < 0 ? -1 : 0;
+}
+
+/**
+ * Send a response that's produced a piece at a time
+ *
+ * produce() writes the next piece with conn_write() and friends. done() is
+ * called once it's finished, failed, or the connection is closed, to clean
+ * up state.
+ *
+ * Blocking sockets are produced in full right here, each write waiting for
+ * the client. Event loop and io_uring sockets are only produced until
+ * CONN_MAX_QUEUED bytes are waiting; the loop calls conn_resume() for more
+ * once the client has taken them. So a slow reader never holds up the loop,
+ * and never makes us buffer more than that for it.
+ *
+ * Returns 0, or -1 if the response failed.
+ */
+int conn_produce(int fd, conn_producer produce, void *state, conn_producer_done done)
+{
+    struct conn *c = conn_get(fd);
+
+    if (c == NULL || (!c->nonblocking && !c->queue_only)) {
+        int rv;
+
+        while ((rv = produce(fd, state)) == 1) {
+        }
+
+        done(state, rv == 0);
+
+        return rv < 0 ? -1 : 0;
+    }
+
+    c->producer = produce;
+    c->producer_state = state;
+    c->producer_done = done;
+
+    return conn_resume(c);
+}
+
+/**
+ * Produce more of a response, until its output queue fills up again
+ *
+ * The event loops call this when a connection's output has drained and it
+ * still has a producer. If the response fails, whatever it queued is still
+ * sent, and then the connection is closed.
+ *
+ * Returns 0, or -1 if the response failed.
+ */
+int conn_resume(struct conn *c)
+{
+    int rv = 1;
+
+    // A pending file goes first; the loop calls back once it's sent
+    while (c->producer != NULL && c->file_fd < 0 && c->outlen - c->outoff < CONN_MAX_QUEUED) {
+        c->producing = 1;
+        rv = c->producer(c->fd, c->producer_state);
+        c->producing = 0;
+
+        if (rv != 1) {
+            conn_end_producer(c, rv == 0);
+            break;
+        }
+    }
+
+    if (rv < 0) {
+        c->keep_alive = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Send queued output on a nonblocking socket
+ *
+ * The output queue goes first, then any file segment behind it, then
+ * whatever was written after the file.
+ *
+ * Returns 0 when everything has been sent, 1 if the socket would block, or
+ * -1 on error.
+ */
+int conn_flush(struct conn *c)
+{
+    while (1) {
+        while (c->outoff < c->outlen) {
+            int rv = send(c->fd, c->outbuf + c->outoff, c->outlen - c->outoff, MSG_NOSIGNAL);
+
+            if (rv < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+
+                perror("send");
+                return -1;
+            }
+
+            c->outoff += rv;
+        }
+
+        c->outoff = c->outlen = 0;
+
+        if (c->file_fd < 0) {
+            return 0;
+        }
+
+        // Sending the file may move bytes written behind it into outbuf
+        int rv = conn_send_file(c);
+
+        if (rv != 0) return rv;
+    }
+}
+
+/**
+ * Make sure there is room in inbuf for another read
+ *
+ * Returns -1 if the buffered request has grown past CONN_MAX_REQUEST.
+ */
+int conn_reserve(struct conn *c)
+{
+    if (c->inlen < c->incap - 1) {
+        return 0;
+    }
+
+    if (c->incap >= CONN_MAX_REQUEST) {
+        fprintf(stderr, "conn: request on fd %d too large\n", c->fd);
+        return -1;
+    }
+
+    uintptr_t old_base = (uintptr_t)c->inbuf;
+    char *p = realloc(c->inbuf, c->incap * 2);
+
+    if (p == NULL) return -1;
+
+    c->inbuf = p;
+    c->incap *= 2;
+
+    // The parser's views pointed into the old buffer
+    http_request_rebase(&c->req, old_base, (uintptr_t)p);
+
+    return 0;
+}
+
+/**
+ * Parse whatever is buffered on a connection
+ *
+ * Returns the length of the request at the front of inbuf once it is
+ * complete, or 0 if more bytes are needed. A malformed request counts as
+ * complete and takes the whole buffer with it; the handler sees
+ * PARSE_ERROR, answers 400, and the connection is closed. So does one that
+ * fills CONN_MAX_REQUEST without being complete, with req.too_large set so
+ * it can be answered as such.
+ *
+ * If the body hook attaches a sink, body bytes are passed on and dropped
+ * from inbuf as they arrive, so a body of any size fits.
+ */
+int conn_next_request(struct conn *c)
+{
+    int len = http_parse(&c->req, c->inbuf, c->inlen);
+
+    if (len < 0) {
+        return c->inlen;
+    }
+
+    if (c->req.body_sink != NULL) {
+        c->inlen = http_compact(&c->req, c->inbuf, c->inlen);
+        c->inbuf[c->inlen] = '\0';
+
+        if (len > 0) {
+            len = c->req.pos;
+        }
+    }
+
+    if (len == 0 && c->inlen >= c->incap - 1 && c->incap >= CONN_MAX_REQUEST) {
+        c->req.state = PARSE_ERROR;
+        c->req.too_large = 1;
+        return c->inlen;
+    }
+
+    return len;
+}
+
+/**
+ * Get ready for the next request on a kept-alive connection
+ *
+ * Drops the request that was just answered from the front of inbuf. Anything
+ * after it (a pipelined request) stays buffered.
+ */
+void conn_reset(struct conn *c)
+{
+    c->inlen -= c->reqlen;
+    memmove(c->inbuf, c->inbuf + c->reqlen, c->inlen);
+    c->inbuf[c->inlen] = '\0';
+    c->reqlen = 0;
+    conn_request_init(c);
+
+    if (c->upload != NULL) {
+        file_upload_abort(c->upload);
+        c->upload = NULL;
+    }
+
+    c->outoff = c->outlen = 0;
+    conn_drop_file(c);
+    c->state = CONN_READING;
+}
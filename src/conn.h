@@ -0,0 +1,88 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+#include <time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "request.h"
+
+#define MX_CONNS 65536 // highest fd number we will track state for
+#define CONN_MAX_REQUEST 65536 // 64K, largest request we will buffer
+
+enum conn_state {
+    CONN_READING,
+    CONN_WRITING,
+    CONN_HANDLING, // Being answered on another thread; hands off
+    CONN_CLOSING
+};
+
+struct file_upload;
+
+// Writes the next piece of a response that's produced as it's sent.
+// Returns 1 while there's more to come, 0 once it's complete, -1 on error.
+typedef int (*conn_producer)(int fd, void *state);
+// Cleans up after a producer; completed is 1 if the whole response was
+// produced
+typedef void (*conn_producer_done)(void *state, int completed);
+
+// Per-connection state
+struct conn {
+    int fd;
+    int nonblocking; // 1 if owned by an event loop
+    int queue_only;  // 1 if every write is queued for an io_uring send
+    enum conn_state state;
+
+    char *inbuf; // Bytes received but not yet handled
+    int inlen;
+    int incap;
+
+    char *outbuf; // Bytes queued for the socket but not yet sent
+    int outoff;
+    int outlen;
+    int outcap;
+
+    int file_fd;         // File still being sent after outbuf, or -1
+    off_t file_off;      // Where the unsent part of it starts
+    off_t file_remaining;
+
+    char *tailbuf; // Bytes written behind the file; queued once it's sent
+    int taillen;
+    int tailcap;
+
+    conn_producer producer; // Rest of the response, once outbuf drains, or NULL
+    void *producer_state;
+    conn_producer_done producer_done;
+    int producing; // 1 while the producer itself is writing
+
+    int keep_alive; // 1 if the connection stays open after this response
+    int requests;   // Requests handled on this connection so far
+    int reqlen;     // Length of the request being answered, in inbuf
+    struct http_request req; // Parser state for the request at the front of inbuf
+    struct file_upload *upload; // Request body being streamed to disk
+
+    time_t last_active;
+    struct conn *idle_prev, *idle_next; // Event loop or poller idle list, oldest first
+};
+
+extern int conn_max_requests; // Requests per connection before we close it
+extern int conn_idle_timeout; // Seconds a connection may wait for a request
+
+// Called once a request's headers are in, before its body. May set
+// c->req.body_sink to stream the body somewhere instead of buffering it.
+extern void (*conn_body_hook)(struct conn *c);
+
+extern struct conn *conn_open(int fd, int nonblocking);
+extern struct conn *conn_get(int fd);
+extern void conn_close(struct conn *c);
+extern int conn_write(int fd, void *buf, int len);
+extern int conn_writev(int fd, struct iovec *iov, int iovcnt);
+extern int conn_copy_file(int fd, int file_fd, off_t offset, off_t count);
+extern int conn_sendfile(int fd, int file_fd, off_t offset, off_t count);
+extern int conn_produce(int fd, conn_producer produce, void *state, conn_producer_done done);
+extern int conn_resume(struct conn *c);
+extern int conn_flush(struct conn *c);
+extern void conn_file_done(struct conn *c);
+extern int conn_reserve(struct conn *c);
+extern int conn_next_request(struct conn *c);
+extern void conn_reset(struct conn *c);
+
+#endif
@@ -8,6 +8,7 @@
 #include <nl_types.h>
 #include <langinfo.h>
 #include <string.h>
+#include <stdlib.h>
 
 int isdirectory(const char *path){
 	struct stat statbuf;
@@ -25,14 +26,18 @@ long long getfilesize(char* filename){
 	return buf.st_size;
 }
 
-struct tm *getmoddate(char* filename){
-	struct stat buf;	
-	struct tm *tm;
-	char datestring[256];
+/**
+ * Fill in result with a file's modification time, in local time
+ *
+ * Returns result, or NULL if the file can't be stat'd. Uses localtime_r()
+ * since listings are drawn on many threads at once.
+ */
+struct tm *getmoddate(char* filename, struct tm *result){
+	struct stat buf;
 	if(stat(filename, &buf) == -1){
 	 return NULL;
  	}
-	return localtime(&buf.st_mtime);
+	return localtime_r(&buf.st_mtime, result);
 }
 
 void gettablerow(char* filename, char* directoryPath, short isfile, char* resultstr){
@@ -40,28 +45,23 @@ void gettablerow(char* filename, char* directoryPath, short isfile, char* result
 	char type[10];
 	char modifieddate[50];
 	int filesize;
-	struct tm *tm;
+	struct tm tmbuf, *tm;
 	memset(resultstr, 0, sizeof(resultstr));
 	memset(filepath, 0, sizeof(filepath));
 	strncpy(filepath, directoryPath, strlen(directoryPath));
 	strcat(filepath, filename); 
-	printf("filename: %s   filepath: %s  type: ", filename, filepath);
 	   switch(isfile){
 			case 1:
-				printf("directory");
-				printf("size: - \n");
 				filesize = -1;
 				strncpy(type, "directory", 10);
 				break;
 			case 0:
-				printf("file  ");
 				filesize = getfilesize(filepath);
-				printf("size: %d \n",filesize);
 				strncpy(type, "file", 10);
 				break;
 	   }
 
-		tm = getmoddate(filepath);
+		tm = getmoddate(filepath, &tmbuf);
 	if(tm==NULL){
 		return;
 	}
@@ -71,8 +71,6 @@ void gettablerow(char* filename, char* directoryPath, short isfile, char* result
 	day = tm->tm_mday;
 	hour = tm->tm_hour;
 	min = tm->tm_min;
-	printf("modified date: %d-%02d-%02d %02d:%02d  \n", year, month, day, hour, min);
-	printf("\n");	  
 	sprintf(modifieddate, "%d-%02d-%02d %02d:%02d", year, month, day, hour, min);
 
 	int leadingnum=0;
@@ -109,56 +107,113 @@ void gettablerow(char* filename, char* directoryPath, short isfile, char* result
 	char tablerow[1024];
 	sprintf(tablerow, "<tr>\n<td>%s</td>\n<td>%s</td>\n<td>%s</td><td>%s</td>\n</tr>\n", type, namecell, modifieddate, sizestr);
 	strncpy(resultstr, tablerow, 1024);
-	printf("tablerow: %s\n",tablerow);
 	return;
 }
 
-void drawindexpage(char* directoryPath, char* resultstr){
-	DIR *d;
+#define INDEX_ROWS_PER_DRAW 32
+
+/**
+ * Draws the index page for a directory, handing it to emit() one piece at
+ * a time so a directory of any size can be streamed out.
+ */
+void drawindexpage(char* directoryPath, index_writer emit, void *arg){
+	struct indexpage *page = indexpage_open(directoryPath);
+	if(page == NULL){
+		return;
+	}
+	while(indexpage_draw(page, emit, arg)){
+	}
+	indexpage_close(page);
+}
+
+/**
+ * Start drawing the index page for a directory, to be drawn by
+ * indexpage_draw() as the output is wanted.
+ */
+struct indexpage *indexpage_open(char* directoryPath){
+	struct indexpage *page = malloc(sizeof *page);
+	if(page == NULL){
+		return NULL;
+	}
+	snprintf(page->directoryPath, sizeof page->directoryPath, "%s", directoryPath);
+	snprintf(page->correctDirectoryPath, sizeof page->correctDirectoryPath, "%s/", directoryPath);
+	page->d = NULL;
+	page->stage = 0;
+	return page;
+}
+
+/**
+ * Draw the next part of an index page: the header, or up to
+ * INDEX_ROWS_PER_DRAW rows, or the footer.
+ *
+ * Returns 1 while there is more to draw, 0 once the page is finished.
+ */
+int indexpage_draw(struct indexpage *page, index_writer emit, void *arg){
 	struct dirent *dir;
-	long long filesize;
-	memset(resultstr, 0, strlen(resultstr));
-	
-	//header
-	strcat(resultstr, "<!doctype html>\n<html><head>\n");
-	char titlebuffer[256];
-	snprintf(titlebuffer, 256, "<title>%s index</title>\n", directoryPath);
-	strcat(resultstr, titlebuffer);
-	strcat(resultstr, "<style>table{\nborder: solid 1px;\n}\nth{\ncolor: blue;\ntext-decoration: underline;\n}\n</style>\n</head>\n");
-	strcat(resultstr, "<body>\n");
-	char indexlabelbuffer[256];
-	snprintf(indexlabelbuffer, 256, "<h1>index of %s</h1>\n", directoryPath);
-	strcat(resultstr, indexlabelbuffer);
+	char tablerow[1024];
 	
-	char correctDirectoryPath[1024];
-	snprintf(correctDirectoryPath, 1024, "%s/", directoryPath);
-	d = opendir(directoryPath);
-	if (d){
-		strcat(resultstr, "<table>\n<tr>\n<th>type</th>\n<th>name</th>\n<th>last modified</th>\n<th>size</th>\n</tr>\n");
-		char tablerow[1024];
+	if(page->stage == 0){
+		//header
+		emit(arg, "<!doctype html>\n<html><head>\n");
+		char titlebuffer[256];
+		snprintf(titlebuffer, 256, "<title>%s index</title>\n", page->directoryPath);
+		emit(arg, titlebuffer);
+		emit(arg, "<style>table{\nborder: solid 1px;\n}\nth{\ncolor: blue;\ntext-decoration: underline;\n}\n</style>\n</head>\n");
+		emit(arg, "<body>\n");
+		char indexlabelbuffer[256];
+		snprintf(indexlabelbuffer, 256, "<h1>index of %s</h1>\n", page->directoryPath);
+		emit(arg, indexlabelbuffer);
+		
+		page->d = opendir(page->directoryPath);
+		if (page->d == NULL){
+			emit(arg, "<h2>error opening directory!</h2>\n");
+			emit(arg, "</body>\n</html>");
+			page->stage = 2;
+			return 0;
+		}
+		emit(arg, "<table>\n<tr>\n<th>type</th>\n<th>name</th>\n<th>last modified</th>\n<th>size</th>\n</tr>\n");
 		memset(tablerow, 0, 1024);
-		gettablerow("..", correctDirectoryPath, 1, tablerow);
-		strcat(resultstr, tablerow);
+		gettablerow("..", page->correctDirectoryPath, 1, tablerow);
+		emit(arg, tablerow);
 		memset(tablerow, 0, 1024);
-		gettablerow(".", correctDirectoryPath, 1, tablerow);
-		strcat(resultstr, tablerow);
-		while ((dir=readdir(d)) != NULL){
-			if(!strncmp(dir->d_name, ".", 1)){
-				continue;
-			}
-			if(!strncmp(dir->d_name, "..", 2)){
-				continue;
-			}
-			memset(tablerow, 0, 1024);
-			gettablerow(dir->d_name, correctDirectoryPath, !(dir->d_type==8), tablerow);
-			strcat(resultstr, tablerow);
+		gettablerow(".", page->correctDirectoryPath, 1, tablerow);
+		emit(arg, tablerow);
+		page->stage = 1;
+		return 1;
+	}
+	if(page->stage == 2){
+		return 0;
+	}
+
+	for(int rows=0;rows<INDEX_ROWS_PER_DRAW;){
+		if((dir=readdir(page->d)) == NULL){
+			closedir(page->d);
+			page->d = NULL;
+			emit(arg, "</table>\n");
+			emit(arg, "</body>\n</html>");
+			page->stage = 2;
+			return 0;
+		}
+		if(!strncmp(dir->d_name, ".", 1)){
+			continue;
+		}
+		if(!strncmp(dir->d_name, "..", 2)){
+			continue;
 		}
-		closedir(d);
-		strcat(resultstr, "</table>\n");
+		memset(tablerow, 0, 1024);
+		gettablerow(dir->d_name, page->correctDirectoryPath, !(dir->d_type==8), tablerow);
+		emit(arg, tablerow);
+		rows++;
 	}
-	else{
-		strcat(resultstr, "<h2>error opening directory!</h2>\n");
+	return 1;
+}
+
+/**
+ * Done with an index page, finished or not
+ */
+void indexpage_close(struct indexpage *page){
+	if(page->d != NULL){
+		closedir(page->d);
 	}
-	strcat(resultstr, "</body>\n</html>");
-	return;
+	free(page);
 }
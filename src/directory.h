@@ -9,8 +9,22 @@
 #include <string.h>
 
 
+// Receives the index page a piece at a time as drawindexpage() builds it
+typedef void (*index_writer)(void *arg, char *str);
+
+// An index page part way drawn, for drawing a little at a time
+struct indexpage {
+	char directoryPath[1024];
+	char correctDirectoryPath[1024];
+	DIR *d;
+	int stage; // 0: nothing drawn yet, 1: drawing rows, 2: done
+};
+
 extern int isdirectory(const char *path);
 extern long long getfilesize(char* filename);
-extern struct tm *getmoddate(char* filename);
+extern struct tm *getmoddate(char* filename, struct tm *result);
 extern void gettablerow(char* filename, char* directoryPath, short isfile, char* resultstr);
-extern void drawindexpage(char* directoryPath, char* resultstr);
\ No newline at end of file
+extern void drawindexpage(char* directoryPath, index_writer emit, void *arg);
+extern struct indexpage *indexpage_open(char* directoryPath);
+extern int indexpage_draw(struct indexpage *page, index_writer emit, void *arg);
+extern void indexpage_close(struct indexpage *page);
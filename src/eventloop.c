@@ -0,0 +1,303 @@
+/**
+ * eventloop.c -- edge-triggered epoll reactor
+ *
+ * One thread owns every connection. Sockets are nonblocking and each one
+ * walks through the states in struct conn:
+ *
+ *    CONN_READING  -> read until a whole request is buffered
+ *    CONN_WRITING  -> handler has run, drain the output queue (asking the
+ *                     response's producer for more each time it empties,
+ *                     see conn_produce()), then go back to CONN_READING if
+ *                     the connection is kept alive
+ *    CONN_CLOSING  -> done, close and free
+ *
+ * Connections also sit on an idle list ordered by last activity, so the
+ * ones that have been quiet longer than conn_idle_timeout can be closed
+ * without scanning them all.
+ */
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include "conn.h"
+#include "eventloop.h"
+
+#define MAX_EVENTS 1024
+
+// Connections owned by one loop, least recently active first
+struct idle_list {
+    struct conn *head, *tail;
+};
+
+/**
+ * Put a socket in nonblocking mode
+ */
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+
+    if (flags == -1) return -1;
+
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Unlink a connection from the idle list
+ */
+static void idle_remove(struct idle_list *idle, struct conn *c)
+{
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    else idle->head = c->idle_next;
+
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    else idle->tail = c->idle_prev;
+
+    c->idle_prev = c->idle_next = NULL;
+}
+
+/**
+ * Mark a connection as just active by moving it to the tail
+ */
+static void idle_touch(struct idle_list *idle, struct conn *c)
+{
+    if (idle->tail != c) {
+        if (c->idle_prev || c->idle_next || idle->head == c) {
+            idle_remove(idle, c);
+        }
+
+        c->idle_prev = idle->tail;
+        c->idle_next = NULL;
+
+        if (idle->tail) idle->tail->idle_next = c;
+        else idle->head = c;
+
+        idle->tail = c;
+    }
+
+    c->last_active = time(NULL);
+}
+
+/**
+ * Close every connection that has been idle too long
+ */
+static void idle_expire(struct idle_list *idle)
+{
+    time_t now = time(NULL);
+
+    while (idle->head != NULL && now - idle->head->last_active >= conn_idle_timeout) {
+        struct conn *c = idle->head;
+
+        idle_remove(idle, c);
+        conn_close(c);
+    }
+}
+
+/**
+ * Accept every pending connection on the listening socket
+ */
+static void accept_all(int epfd, int listenfd, struct idle_list *idle)
+{
+    while (1) {
+        int newfd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK);
+
+        if (newfd == -1) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+            return;
+        }
+
+        struct conn *c = conn_open(newfd, 1);
+
+        if (c == NULL) {
+            fprintf(stderr, "eventloop: no room for fd %d\n", newfd);
+            close(newfd);
+            continue;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = newfd;
+
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, newfd, &ev) == -1) {
+            perror("epoll_ctl");
+            conn_close(c);
+            continue;
+        }
+
+        idle_touch(idle, c);
+    }
+}
+
+/**
+ * Read what is available on a connection, up to a full input buffer
+ *
+ * Stopping at a full buffer gives the parser a chance to hand a streamed
+ * body off (and free the space) before we read more.
+ *
+ * Returns 0 once the socket would block, 1 if the buffer filled first, or
+ * -1 if the peer closed or errored.
+ */
+static int conn_read_some(struct conn *c)
+{
+    if (conn_reserve(c) < 0) {
+        return -1;
+    }
+
+    while (c->inlen < c->incap - 1) {
+        int rv = recv(c->fd, c->inbuf + c->inlen, c->incap - 1 - c->inlen, 0);
+
+        if (rv < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+
+            perror("recv");
+            return -1;
+        }
+
+        if (rv == 0) {
+            return -1;
+        }
+
+        c->inlen += rv;
+        c->inbuf[c->inlen] = '\0';
+    }
+
+    return 1;
+}
+
+/**
+ * Advance one connection's state machine after an epoll event
+ *
+ * Handles every request already buffered (pipelining) until it runs out of
+ * input or the socket stops taking output.
+ */
+static void conn_event(struct idle_list *idle, struct conn *c, unsigned int events, request_handler handler, void *arg)
+{
+    int eof = 0;
+
+    if (events & EPOLLERR) {
+        c->state = CONN_CLOSING;
+    }
+
+    while (c->state != CONN_CLOSING) {
+        if (c->state == CONN_READING) {
+            int len = conn_next_request(c);
+
+            while (len == 0 && !eof) {
+                int rv = conn_read_some(c);
+
+                if (rv < 0) eof = 1;
+
+                len = conn_next_request(c);
+
+                if (rv == 0) break;
+            }
+
+            if (len == 0) {
+                if (eof) c->state = CONN_CLOSING;
+                break;
+            }
+
+            c->reqlen = len;
+            handler(c->fd, &c->req, arg);
+            c->state = CONN_WRITING;
+        }
+
+        if (c->state == CONN_WRITING) {
+            int rv = conn_flush(c);
+
+            // Drained: a response still being produced can add more
+            if (rv == 0 && c->producer != NULL) {
+                conn_resume(c);
+                continue;
+            }
+
+            if (rv == 1) {
+                break;
+            }
+
+            if (rv < 0 || !c->keep_alive) {
+                c->state = CONN_CLOSING;
+                break;
+            }
+
+            conn_reset(c);
+        }
+    }
+
+    if (c->state == CONN_CLOSING) {
+        idle_remove(idle, c);
+        conn_close(c);
+    }
+    else {
+        idle_touch(idle, c);
+    }
+}
+
+/**
+ * Run the event loop on a listening socket
+ *
+ * Never returns unless epoll itself fails.
+ */
+int eventloop_run(int listenfd, request_handler handler, void *arg)
+{
+    struct epoll_event ev, events[MAX_EVENTS];
+    struct idle_list idle = { NULL, NULL };
+
+    int epfd = epoll_create1(0);
+
+    if (epfd == -1) {
+        perror("epoll_create1");
+        return -1;
+    }
+
+    set_nonblocking(listenfd);
+
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listenfd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, listenfd, &ev) == -1) {
+        perror("epoll_ctl");
+        close(epfd);
+        return -1;
+    }
+
+    while (1) {
+        // Wake up at least once a second to close idle connections
+        int n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+
+        if (n == -1) {
+            if (errno == EINTR) continue;
+
+            perror("epoll_wait");
+            close(epfd);
+            return -1;
+        }
+
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+
+            if (fd == listenfd) {
+                accept_all(epfd, listenfd, &idle);
+                continue;
+            }
+
+            struct conn *c = conn_get(fd);
+
+            if (c != NULL) {
+                conn_event(&idle, c, events[i].events, handler, arg);
+            }
+        }
+
+        idle_expire(&idle);
+    }
+}
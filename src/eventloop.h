@@ -0,0 +1,11 @@
+#ifndef _EVENTLOOP_H_
+#define _EVENTLOOP_H_
+#include "request.h"
+
+// Called once a full request has been parsed (or failed to parse, in which
+// case req->state is PARSE_ERROR). Output goes through conn_write().
+typedef void (*request_handler)(int fd, struct http_request *req, void *arg);
+
+extern int eventloop_run(int listenfd, request_handler handler, void *arg);
+
+#endif
@@ -1,9 +1,14 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <limits.h>
 #include "file.h"
 #include <errno.h>
 
@@ -65,37 +70,213 @@ struct file_data *file_load(char *filename)
 
     filedata->data = buffer;
     filedata->size = total_bytes;
+    filedata->mapped = 0;
 
     return filedata;
 }
 
+/**
+ * Opens a regular file so it can be sent without loading it first.
+ *
+ * Returns NULL if it doesn't exist or isn't a regular file.
+ */
+struct file_handle *file_open(char *filename)
+{
+    struct stat buf;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+
+    // Check the file we actually opened, not whatever the path points at now
+    if (fstat(fd, &buf) == -1 || !S_ISREG(buf.st_mode)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct file_handle *fh = malloc(sizeof *fh);
+
+    if (fh == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    fh->fd = fd;
+    fh->size = buf.st_size;
+    fh->mtime = buf.st_mtime;
+
+    return fh;
+}
+
+/**
+ * Reads a whole opened file into memory, like file_load().
+ */
+struct file_data *file_read(struct file_handle *fh)
+{
+    char *buffer = malloc(fh->size > 0 ? fh->size : 1);
+    off_t total_bytes = 0;
+
+    if (buffer == NULL) {
+        return NULL;
+    }
+
+    while (total_bytes < fh->size) {
+        ssize_t bytes_read = pread(fh->fd, buffer + total_bytes, fh->size - total_bytes, total_bytes);
+
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return NULL;
+        }
+
+        // Shrank since it was opened; send what is there
+        if (bytes_read == 0) break;
+
+        total_bytes += bytes_read;
+    }
+
+    struct file_data *filedata = malloc(sizeof *filedata);
+
+    if (filedata == NULL) {
+        free(buffer);
+        return NULL;
+    }
+
+    filedata->data = buffer;
+    filedata->size = total_bytes;
+    filedata->mapped = 0;
+
+    return filedata;
+}
+
+/**
+ * Maps a whole opened file read-only instead of reading it, so the data
+ * stays in the kernel's page cache, shared, rather than being copied.
+ *
+ * The mapping outlives file_close(). Falls back to file_read() for empty
+ * files, which can't be mapped, or if mapping fails.
+ */
+struct file_data *file_map(struct file_handle *fh)
+{
+    if (fh->size == 0) {
+        return file_read(fh);
+    }
+
+    void *data = mmap(NULL, fh->size, PROT_READ, MAP_SHARED, fh->fd, 0);
+
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return file_read(fh);
+    }
+
+    // It'll be read front to back, likely soon and more than once
+    madvise(data, fh->size, MADV_WILLNEED);
+
+    struct file_data *filedata = malloc(sizeof *filedata);
+
+    if (filedata == NULL) {
+        munmap(data, fh->size);
+        return NULL;
+    }
+
+    filedata->data = data;
+    filedata->size = fh->size;
+    filedata->mapped = 1;
+
+    return filedata;
+}
+
+static long page_size;
+
+/**
+ * SIGBUS handler: a mapped file was truncated under a reader
+ *
+ * Maps a page of zeros over the part that's gone, so whatever was reading
+ * it (a send, a hash) finishes with junk instead of killing the server.
+ * The cached copy is dropped as soon as the change is noticed.
+ */
+static void file_map_sigbus(int sig, siginfo_t *info, void *ctx)
+{
+    (void)ctx;
+
+    void *page = (void *)((uintptr_t)info->si_addr & ~(uintptr_t)(page_size - 1));
+
+    if (info->si_code != BUS_ADRERR ||
+        mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        // Not a truncated mapping; fail the way it would have anyway
+        signal(sig, SIG_DFL);
+    }
+}
+
+/**
+ * Make reading past the end of a truncated file_map() mapping harmless
+ *
+ * Call once at startup if mapped files will be read while they might
+ * change.
+ */
+void file_map_guard(void)
+{
+    struct sigaction sa;
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_sigaction = file_map_sigbus;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/**
+ * Closes a file opened by file_open().
+ */
+void file_close(struct file_handle *fh)
+{
+    close(fh->fd);
+    free(fh);
+}
+
+/**
+ * Create whichever directories a file is to be saved in are missing
+ *
+ * Returns 0, or -1 if the path is too long or a directory can't be made.
+ */
 int make_dir(char *savename){
-	char pathname[100] = "";
-	int lastSlashIdx  = strlen(savename);
-	for(int i=strlen(savename)-1;i>=0;i--){
-		if(savename[i]=='/'){
-			lastSlashIdx = i;
-			break;
-		}	
+	char pathname[PATH_MAX];
+	char *lastSlash = strrchr(savename, '/');
+	if(lastSlash == NULL){
+		return 0;
+	}
+	int len = snprintf(pathname, sizeof pathname, "%.*s", (int)(lastSlash - savename), savename);
+	if(len < 0 || len >= (int)sizeof pathname){
+		return -1;
+	}
+	for(char *p = pathname + 1; ; p++){
+		if(*p != '/' && *p != '\0'){
+			continue;
+		}
+		char c = *p;
+		*p = '\0';
+		if(mkdir(pathname, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) < 0 && errno != EEXIST){
+			perror("mkdir");
+			return -1;
+		}
+		*p = c;
+		if(c == '\0'){
+			return 0;
+		}
 	}
-	strncpy(pathname, savename, lastSlashIdx+1);
-	printf("make_dir    pathname: %s\n\n\n",pathname);
-	
-	int mkdir_result = mkdir(pathname, S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH | S_IXOTH);
-	printf("mkdir_result: %d %d\n",mkdir_result, errno);
 }
 
 int file_write(char *savename, struct file_data *filetowrite){
 	int fd;
 	ssize_t writtenbytes;
-	printf("before make_dir savename: %s\n",savename);
 	make_dir(savename);
 	fd = open(savename, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU|S_IRWXG|S_IRWXO);
 	if(fd<0){
 		fprintf(stderr, "open error for %s\n",savename);
 	}
-    printf("filetowrite->data: %s\n",filetowrite->data);
-    printf("filetowrite->size: %d\n",filetowrite->size);
 	writtenbytes = write(fd, filetowrite->data, filetowrite->size);
 	close(fd);
 	file_free(filetowrite);
@@ -108,10 +289,146 @@ int file_write(char *savename, struct file_data *filetowrite){
 }
 
 /**
- * Frees memory allocated by file_load().
+ * Check whether a path names one of file_upload_open()'s temporary files
+ */
+int file_is_upload_tmp(char *path)
+{
+	char *name = strrchr(path, '/');
+
+	name = (name != NULL) ? name + 1 : path;
+
+	return strncmp(name, UPLOAD_TMP_PREFIX, strlen(UPLOAD_TMP_PREFIX)) == 0;
+}
+
+/**
+ * Start writing a file that arrives in pieces
+ *
+ * Data goes to a hidden temporary file in the same directory (named
+ * UPLOAD_TMP_PREFIX and a random suffix), so readers never see a
+ * half-written file and a failed upload leaves the old one alone. The
+ * server doesn't list or serve those names.
+ */
+struct file_upload *file_upload_open(char *savename)
+{
+	if (make_dir(savename) < 0) {
+		return NULL;
+	}
+
+	struct file_upload *upload = malloc(sizeof *upload);
+
+	if (upload == NULL) {
+		return NULL;
+	}
+
+	char *lastSlash = strrchr(savename, '/');
+	int dirlen = (lastSlash != NULL) ? lastSlash - savename + 1 : 0;
+
+	upload->savename = strdup(savename);
+	upload->tmpname = malloc(dirlen + sizeof UPLOAD_TMP_PREFIX "XXXXXX");
+	upload->size = 0;
+
+	if (upload->savename == NULL || upload->tmpname == NULL) {
+		free(upload->savename);
+		free(upload->tmpname);
+		free(upload);
+		return NULL;
+	}
+
+	sprintf(upload->tmpname, "%.*s" UPLOAD_TMP_PREFIX "XXXXXX", dirlen, savename);
+	upload->fd = mkstemp(upload->tmpname);
+
+	if (upload->fd < 0) {
+		fprintf(stderr, "open error for %s\n", upload->tmpname);
+		free(upload->savename);
+		free(upload->tmpname);
+		free(upload);
+		return NULL;
+	}
+
+	// mkstemp() creates 0600; uploads are served back, so let others read them
+	fchmod(upload->fd, S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH);
+
+	return upload;
+}
+
+/**
+ * Append the next piece of an upload
+ *
+ * Returns 0, or -1 on error.
+ */
+int file_upload_write(struct file_upload *upload, void *data, int size)
+{
+	char *p = data;
+
+	while (size > 0) {
+		ssize_t writtenbytes = write(upload->fd, p, size);
+
+		if (writtenbytes < 0) {
+			if (errno == EINTR) continue;
+			perror("write");
+			return -1;
+		}
+
+		p += writtenbytes;
+		size -= writtenbytes;
+		upload->size += writtenbytes;
+	}
+
+	return 0;
+}
+
+/**
+ * Free an upload's bookkeeping
+ */
+static void file_upload_free(struct file_upload *upload)
+{
+	free(upload->savename);
+	free(upload->tmpname);
+	free(upload);
+}
+
+/**
+ * Finish an upload and move it into place
+ *
+ * Returns 0, or -1 on error. Frees upload either way.
+ */
+int file_upload_commit(struct file_upload *upload)
+{
+	int rv = 0;
+
+	if (close(upload->fd) < 0 || rename(upload->tmpname, upload->savename) < 0) {
+		perror("file_upload_commit");
+		unlink(upload->tmpname);
+		rv = -1;
+	}
+
+	file_upload_free(upload);
+
+	return rv;
+}
+
+/**
+ * Throw away an unfinished upload
+ */
+void file_upload_abort(struct file_upload *upload)
+{
+	close(upload->fd);
+	unlink(upload->tmpname);
+	file_upload_free(upload);
+}
+
+/**
+ * Frees memory allocated by file_load(), file_read() or file_map().
+ *
+ * Set data to NULL first to hand a mapping off to something else.
  */
 void file_free(struct file_data *filedata)
 {
-    free(filedata->data);
+    if (filedata->mapped) {
+        if (filedata->data != NULL) munmap(filedata->data, filedata->size);
+    }
+    else {
+        free(filedata->data);
+    }
     free(filedata);
 }
@@ -1,12 +1,43 @@
 #ifndef _FILELS_H_ // This was just _FILE_H_, but that interfered with Cygwin
 #define _FILELS_H_
 #include<unistd.h>
+#include<sys/types.h>
+#include<time.h>
 struct file_data {
     int size;
     void *data;
+    int mapped; // data is a read-only mmap of the file rather than a copy
+};
+
+#define UPLOAD_TMP_PREFIX ".upload-" // Temporary files of unfinished uploads start with this
+
+// A file being written a piece at a time. Goes to a temporary file next to
+// the destination and is renamed into place by file_upload_commit().
+struct file_upload {
+    int fd;
+    long size; // Bytes written so far
+    char *savename;
+    char *tmpname;
+};
+
+// A regular file opened for sending straight from disk
+struct file_handle {
+    int fd;
+    off_t size;
+    time_t mtime;
 };
 
 extern struct file_data *file_load(char *filename);
+extern struct file_handle *file_open(char *filename);
+extern struct file_data *file_read(struct file_handle *fh);
+extern struct file_data *file_map(struct file_handle *fh);
+extern void file_map_guard(void);
+extern void file_close(struct file_handle *fh);
 extern void file_free(struct file_data *filedata);
 extern int file_write(char *savename, struct file_data *filetowrite);
+extern int file_is_upload_tmp(char *path);
+extern struct file_upload *file_upload_open(char *savename);
+extern int file_upload_write(struct file_upload *upload, void *data, int size);
+extern int file_upload_commit(struct file_upload *upload);
+extern void file_upload_abort(struct file_upload *upload);
 #endif
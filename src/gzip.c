@@ -0,0 +1,83 @@
+/**
+ * gzip.c -- gzip encoding for cached responses
+ *
+ * Bodies are compressed once, when they go into the cache, and the
+ * compressed copy is kept next to the original so clients that send
+ * "Accept-Encoding: gzip" can be served without compressing per request.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+#include "gzip.h"
+
+#define GZIP_WINDOW_BITS (15 + 16) // +16 asks zlib for a gzip header and trailer
+#define GZIP_MEM_LEVEL 8
+
+/**
+ * Check whether a content type is worth compressing
+ *
+ * Text compresses well. Images and archives are compressed already.
+ */
+int gzip_compressible(char *content_type)
+{
+    char *types[] = {
+        "application/javascript", "application/json", "application/xml", "image/svg+xml", NULL
+    };
+
+    if (strncmp(content_type, "text/", 5) == 0) {
+        return 1;
+    }
+
+    for (int i = 0; types[i] != NULL; i++) {
+        if (strcmp(content_type, types[i]) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Compress a body with gzip
+ *
+ * Returns a malloc()ed buffer and sets *gzip_size, or returns NULL if
+ * compression failed or wouldn't make the body any smaller.
+ */
+void *gzip_compress(void *data, int size, int *gzip_size)
+{
+    z_stream zs;
+
+    memset(&zs, 0, sizeof zs);
+
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, GZIP_WINDOW_BITS, GZIP_MEM_LEVEL, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+
+    uLong bound = deflateBound(&zs, size);
+    unsigned char *out = malloc(bound);
+
+    if (out == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+
+    zs.next_in = data;
+    zs.avail_in = size;
+    zs.next_out = out;
+    zs.avail_out = bound;
+
+    int rv = deflate(&zs, Z_FINISH);
+    int out_size = zs.total_out;
+
+    deflateEnd(&zs);
+
+    if (rv != Z_STREAM_END || out_size >= size) {
+        free(out);
+        return NULL;
+    }
+
+    *gzip_size = out_size;
+
+    return out;
+}
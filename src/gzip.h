@@ -0,0 +1,7 @@
+#ifndef _GZIP_H_
+#define _GZIP_H_
+
+extern int gzip_compressible(char *content_type);
+extern void *gzip_compress(void *data, int size, int *gzip_size);
+
+#endif
@@ -36,28 +36,28 @@ printf("%d %s\n", q->bar, q->baz); // 12 Hello
 */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
-#include "llist.h"
 #include "hashtable.h"
 
 #define DEFAULT_SIZE 128
 #define DEFAULT_GROW_FACTOR 2
-
-// Hash table entry
+#define MAX_LOAD 0.875 // Grow rather than fill more of the slots than this
+
+// Hash table entry: one slot of the table, empty if key is NULL
+//
+// Entries are kept in Robin Hood order: walking from a key's home slot,
+// every entry passed is no closer to its own home than the key would be.
+// So a lookup can stop at the first entry that's closer to home than
+// the key being looked for.
 struct htent {
     void *key;
     int key_size;
-    int hashed_key;
+    unsigned long long hash; // Full hash of the key; its low bits pick the home slot
     void *data;
 };
 
-// Used to cleanup the linked lists
-struct foreach_callback_payload {
-	void *arg;
-	void (*f)(void *, void *);
-};
-
 /**
  * Change the entry count, maintain load metrics
  */
@@ -67,62 +67,233 @@ void add_entry_count(struct hashtable *ht, int d)
     ht->load = (float)ht->num_entries / ht->size;
 }
 
+// wyhash's constants: odd, with well-spread bits
+#define HASH_SECRET0 0xa0761d6478bd642fULL
+#define HASH_SECRET1 0xe7037ed1a0b428dbULL
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ULL
+#define HASH_SECRET3 0x589965cc75374cc3ULL
+
+/**
+ * Multiply to 128 bits and fold the halves together
+ */
+static inline uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t)a * b;
+
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+}
+
+static inline uint64_t hash_read64(const unsigned char *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline uint64_t hash_read32(const unsigned char *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+/**
+ * Default hashing function: wyhash's, eight or sixteen bytes per step
+ *
+ * Every bit of the result depends on every byte of the key, so any of its
+ * bits can be used on their own: the table takes the low ones, and callers
+ * that split keys up some other way (see shard_for() in cache.c) can use
+ * the high ones.
+ */
+unsigned long long hashtable_hash(void *data, int data_size)
+{
+    const unsigned char *p = data;
+    uint64_t len = data_size;
+    uint64_t seed = hash_mix(HASH_SECRET0, HASH_SECRET1);
+    uint64_t a, b;
+
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (hash_read32(p) << 32) | hash_read32(p + ((len >> 3) << 2));
+            b = (hash_read32(p + len - 4) << 32) | hash_read32(p + len - 4 - ((len >> 3) << 2));
+        }
+        else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        }
+        else {
+            a = b = 0;
+        }
+    }
+    else {
+        uint64_t i = len;
+
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+
+            do {
+                seed = hash_mix(hash_read64(p) ^ HASH_SECRET1, hash_read64(p + 8) ^ seed);
+                seed1 = hash_mix(hash_read64(p + 16) ^ HASH_SECRET2, hash_read64(p + 24) ^ seed1);
+                seed2 = hash_mix(hash_read64(p + 32) ^ HASH_SECRET3, hash_read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+
+            seed ^= seed1 ^ seed2;
+        }
+
+        while (i > 16) {
+            seed = hash_mix(hash_read64(p) ^ HASH_SECRET1, hash_read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+
+        a = hash_read64(p + i - 16);
+        b = hash_read64(p + i - 8);
+    }
+
+    __uint128_t r = (__uint128_t)(a ^ HASH_SECRET1) * (b ^ seed);
+
+    return hash_mix((uint64_t)r ^ HASH_SECRET0 ^ len, (uint64_t)(r >> 64) ^ HASH_SECRET1);
+}
+
 /**
- * Default modulo hashing function
+ * How many slots past its home slot an entry is
  */
-int default_hashf(void *data, int data_size, int bucket_count)
+static int probe_distance(struct hashtable *ht, struct htent *ent, int slot)
 {
-    const int R = 31; // Small prime
-    int h = 0;
-    unsigned char *p = data;
+    return (slot - (int)ent->hash) & (ht->size - 1);
+}
+
+/**
+ * Place an entry, displacing any that are closer to their home slots than
+ * it is to its own
+ *
+ * There must be a free slot.
+ */
+static void slot_insert(struct hashtable *ht, struct htent ent)
+{
+    int mask = ht->size - 1;
+    int slot = ent.hash & mask;
+    int dist = 0;
+
+    while (1) {
+        struct htent *cur = &ht->slots[slot];
+
+        if (cur->key == NULL) {
+            *cur = ent;
+            return;
+        }
+
+        int cur_dist = probe_distance(ht, cur, slot);
+
+        if (cur_dist < dist) {
+            // Take the richer entry's slot and carry it on instead
+            struct htent tmp = *cur;
+            *cur = ent;
+            ent = tmp;
+            dist = cur_dist;
+        }
+
+        slot = (slot + 1) & mask;
+        dist++;
+    }
+}
+
+/**
+ * Find the slot holding a key
+ *
+ * Returns the slot, or -1 if the key isn't there.
+ */
+static int slot_find(struct hashtable *ht, void *key, int key_size, unsigned long long hash)
+{
+    int mask = ht->size - 1;
+    int slot = hash & mask;
+
+    for (int dist = 0; ; dist++) {
+        struct htent *cur = &ht->slots[slot];
+
+        if (cur->key == NULL || probe_distance(ht, cur, slot) < dist) {
+            return -1;
+        }
+
+        if (cur->hash == hash && cur->key_size == key_size && memcmp(cur->key, key, key_size) == 0) {
+            return slot;
+        }
+
+        slot = (slot + 1) & mask;
+    }
+}
+
+/**
+ * Move every entry to a table DEFAULT_GROW_FACTOR times the size
+ *
+ * The hashes are kept, so no key is hashed again.
+ *
+ * Returns 0, or -1 if there's no memory for it.
+ */
+static int hashtable_grow(struct hashtable *ht)
+{
+    int old_size = ht->size;
+    struct htent *old = ht->slots;
+    struct htent *slots = calloc(old_size * DEFAULT_GROW_FACTOR, sizeof *slots);
+
+    if (slots == NULL) {
+        return -1;
+    }
 
-    for (int i = 0; i < data_size; i++) {
-        h = (R * h + p[i]) % bucket_count;
+    ht->slots = slots;
+    ht->size = old_size * DEFAULT_GROW_FACTOR;
+
+    for (int i = 0; i < old_size; i++) {
+        if (old[i].key != NULL) {
+            slot_insert(ht, old[i]);
+        }
     }
 
-    return h;
+    free(old);
+    add_entry_count(ht, 0);
+
+    return 0;
 }
 
 /**
  * Create a new hashtable
+ *
+ * size is only where it starts, rounded up to a power of two so a hash
+ * can be masked down to a slot; the table grows as it fills.
  */
-struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int))
+struct hashtable *hashtable_create(int size, unsigned long long (*hashf)(void *, int))
 {
     if (size < 1) {
         size = DEFAULT_SIZE;
     }
 
     if (hashf == NULL) {
-        hashf = default_hashf;
+        hashf = hashtable_hash;
     }
 
     struct hashtable *ht = malloc(sizeof *ht);
 
     if (ht == NULL) return NULL;
 
-    ht->size = size;
+    ht->size = 1;
+    while (ht->size < size) ht->size *= 2;
     ht->num_entries = 0;
     ht->load = 0;
-    ht->bucket = malloc(size * sizeof(struct llist *));
+    ht->slots = calloc(ht->size, sizeof *ht->slots);
     ht->hashf = hashf;
 
-    for (int i = 0; i < size; i++) {
-        ht->bucket[i] = llist_create();
+    if (ht->slots == NULL) {
+        free(ht);
+        return NULL;
     }
 
     return ht;
 }
 
-/**
- * Free an htent
- */
-void htent_free(void *htent, void *arg)
-{
-	(void)arg;
-
-	free(htent);
-}
-
 /**
  * Destroy a hashtable
  *
@@ -131,12 +302,10 @@ void htent_free(void *htent, void *arg)
 void hashtable_destroy(struct hashtable *ht)
 {
     for (int i = 0; i < ht->size; i++) {
-        struct llist *llist = ht->bucket[i];
-
-		llist_foreach(llist, htent_free, NULL);
-        llist_destroy(llist);
+        free(ht->slots[i].key);
     }
 
+    free(ht->slots);
     free(ht);
 }
 
@@ -153,42 +322,46 @@ void *hashtable_put(struct hashtable *ht, char *key, void *data)
  */
 void *hashtable_put_bin(struct hashtable *ht, void *key, int key_size, void *data)
 {
-    int index = ht->hashf(key, key_size, ht->size);
+    return hashtable_put_hashed(ht, key, key_size, ht->hashf(key, key_size), data);
+}
 
-    struct llist *llist = ht->bucket[index];
+/**
+ * Put to hash table with a binary key whose hash (by ht->hashf) is known
+ *
+ * Replaces whatever was stored under the same key. Returns data, or NULL
+ * if there's no memory for it.
+ */
+void *hashtable_put_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash, void *data)
+{
+    int slot = slot_find(ht, key, key_size, hash);
 
-    struct htent *ent = malloc(sizeof *ent);
-    ent->key = malloc(key_size);
-    memcpy(ent->key, key, key_size);
-    ent->key_size = key_size;
-    ent->hashed_key = index;
-    ent->data = data;
+    if (slot >= 0) {
+        ht->slots[slot].data = data;
+        return data;
+    }
 
-    if (llist_append(llist, ent) == NULL) {
-        free(ent->key);
-        free(ent);
+    // Keep enough slots free that probe runs stay short
+    if (ht->num_entries + 1 > ht->size * MAX_LOAD && hashtable_grow(ht) < 0 && ht->num_entries + 1 >= ht->size) {
         return NULL;
     }
 
-    add_entry_count(ht, +1);
+    struct htent ent;
+    ent.key = malloc(key_size > 0 ? key_size : 1);
 
-    return data;
-}
+    if (ent.key == NULL) {
+        return NULL;
+    }
 
-/**
- * Comparison function for hashtable entries
- */
-int htcmp(void *a, void *b)
-{
-    struct htent *entA = a, *entB = b;
+    memcpy(ent.key, key, key_size);
+    ent.key_size = key_size;
+    ent.hash = hash;
+    ent.data = data;
 
-    int size_diff = entB->key_size - entA->key_size;
+    slot_insert(ht, ent);
 
-    if (size_diff) {
-        return size_diff;
-    }
+    add_entry_count(ht, +1);
 
-    return memcmp(entA->key, entB->key, entA->key_size);
+    return data;
 }
 
 /**
@@ -204,19 +377,19 @@ void *hashtable_get(struct hashtable *ht, char *key)
  */
 void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size)
 {
-    int index = ht->hashf(key, key_size, ht->size);
-
-    struct llist *llist = ht->bucket[index];
-
-    struct htent cmpent;
-    cmpent.key = key;
-    cmpent.key_size = key_size;
+    return hashtable_get_hashed(ht, key, key_size, ht->hashf(key, key_size));
+}
 
-    struct htent *n = llist_find(llist, &cmpent, htcmp);
+/**
+ * Get from the hash table with a binary key whose hash is known
+ */
+void *hashtable_get_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash)
+{
+    int slot = slot_find(ht, key, key_size, hash);
 
-    if (n == NULL) { return NULL; }
+    if (slot < 0) { return NULL; }
 
-    return n->data;
+    return ht->slots[slot].data;
 }
 
 /**
@@ -234,38 +407,41 @@ void *hashtable_delete(struct hashtable *ht, char *key)
  */
 void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size)
 {
-    int index = ht->hashf(key, key_size, ht->size);
-
-    struct llist *llist = ht->bucket[index];
+    return hashtable_delete_hashed(ht, key, key_size, ht->hashf(key, key_size));
+}
 
-    struct htent cmpent;
-    cmpent.key = key;
-    cmpent.key_size = key_size;
+/**
+ * Delete from the hashtable by binary key whose hash is known
+ *
+ * The entries after it shift back a slot, up to the first one that's
+ * already home, so no tombstone is left behind.
+ */
+void *hashtable_delete_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash)
+{
+    int slot = slot_find(ht, key, key_size, hash);
+    int mask = ht->size - 1;
 
-    struct htent *ent = llist_delete(llist, &cmpent, htcmp);
+    if (slot < 0) {
+        return NULL;
+    }
 
-	if (ent == NULL) {
-		return NULL;
-	}
+    void *data = ht->slots[slot].data;
 
-	void *data = ent->data;
+    free(ht->slots[slot].key);
 
-	free(ent);
+    int next = (slot + 1) & mask;
 
-    add_entry_count(ht, -1);
+    while (ht->slots[next].key != NULL && probe_distance(ht, &ht->slots[next], next) > 0) {
+        ht->slots[slot] = ht->slots[next];
+        slot = next;
+        next = (next + 1) & mask;
+    }
 
-	return data;
-}
+    ht->slots[slot].key = NULL;
 
-/**
- * Foreach callback function
- */
-void foreach_callback(void *vent, void *vpayload)
-{
-	struct htent *ent = vent;
-	struct foreach_callback_payload *payload = vpayload;
+    add_entry_count(ht, -1);
 
-	payload->f(ent->data, payload->arg);
+    return data;
 }
 
 /**
@@ -275,14 +451,9 @@ void foreach_callback(void *vent, void *vpayload)
  */
 void hashtable_foreach(struct hashtable *ht, void (*f)(void *, void *), void *arg)
 {
-	struct foreach_callback_payload payload;
-
-	payload.f = f;
-	payload.arg = arg;
-
-	for (int i = 0; i < ht->size; i++) {
-		struct llist *llist = ht->bucket[i];
-
-		llist_foreach(llist, foreach_callback, &payload);
-	}
+    for (int i = 0; i < ht->size; i++) {
+        if (ht->slots[i].key != NULL) {
+            f(ht->slots[i].data, arg);
+        }
+    }
 }
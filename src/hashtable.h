@@ -1,22 +1,29 @@
 #ifndef _HASHTABLE_H_
 #define _HASHTABLE_H_
 
+struct htent;
+
+// Open-addressed: entries live in one array of slots, which grows as it fills
 struct hashtable {
-    int size; // Read-only
+    int size; // Number of slots, a power of two. Read-only
     int num_entries; // Read-only
     float load; // Read-only
-    struct llist **bucket;
-    int (*hashf)(void *data, int data_size, int bucket_count);
+    struct htent *slots;
+    unsigned long long (*hashf)(void *data, int data_size);
 };
 
-extern struct hashtable *hashtable_create(int size, int (*hashf)(void *, int, int));
+extern unsigned long long hashtable_hash(void *data, int data_size);
+extern struct hashtable *hashtable_create(int size, unsigned long long (*hashf)(void *, int));
 extern void hashtable_destroy(struct hashtable *ht);
 extern void *hashtable_put(struct hashtable *ht, char *key, void *data);
 extern void *hashtable_put_bin(struct hashtable *ht, void *key, int key_size, void *data);
+extern void *hashtable_put_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash, void *data);
 extern void *hashtable_get(struct hashtable *ht, char *key);
 extern void *hashtable_get_bin(struct hashtable *ht, void *key, int key_size);
+extern void *hashtable_get_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash);
 extern void *hashtable_delete(struct hashtable *ht, char *key);
 extern void *hashtable_delete_bin(struct hashtable *ht, void *key, int key_size);
+extern void *hashtable_delete_hashed(struct hashtable *ht, void *key, int key_size, unsigned long long hash);
 extern void hashtable_foreach(struct hashtable *ht, void (*f)(void *, void *), void *arg);
 
 #endif
@@ -8,7 +8,7 @@
 #include <arpa/inet.h>
 #include "net.h"
 
-#define BACKLOG 10	 // how many pending connections queue will hold
+#define BACKLOG SOMAXCONN	 // how many pending connections queue will hold
 
 /**
  * This gets an Internet address, either IPv4 or IPv6
@@ -25,11 +25,13 @@ void *get_in_addr(struct sockaddr *sa)
 }
 
 /**
- * Return the main listening socket
+ * Create, bind and listen on a socket for port
+ *
+ * reuseport: also set SO_REUSEPORT so several sockets can share the port
  *
  * Returns -1 or error
  */
-int get_listener_socket(char *port)
+static int open_listener_socket(char *port, int reuseport)
 {
     int sockfd;
     struct addrinfo hints, *servinfo, *p;
@@ -73,6 +75,16 @@ int get_listener_socket(char *port)
             return -2;
         }
 
+        // SO_REUSEPORT lets every shard bind its own socket to the same
+        // port; the kernel then spreads new connections across them.
+        if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes,
+            sizeof(int)) == -1) {
+            perror("setsockopt");
+            close(sockfd);
+            freeaddrinfo(servinfo);
+            return -2;
+        }
+
         // See if we can bind this socket to this local IP address. This
         // associates the file descriptor (the socket descriptor) that
         // we will read and write on with a specific IP address.
@@ -105,3 +117,23 @@ int get_listener_socket(char *port)
 
     return sockfd;
 }
+
+/**
+ * Return the main listening socket
+ *
+ * Returns -1 or error
+ */
+int get_listener_socket(char *port)
+{
+    return open_listener_socket(port, 0);
+}
+
+/**
+ * Return one of several listening sockets sharing port via SO_REUSEPORT
+ *
+ * Returns -1 or error
+ */
+int get_reuseport_listener_socket(char *port)
+{
+    return open_listener_socket(port, 1);
+}
@@ -3,5 +3,6 @@
 
 void *get_in_addr(struct sockaddr *sa);
 int get_listener_socket(char *port);
+int get_reuseport_listener_socket(char *port);
 
 #endif
\ No newline at end of file
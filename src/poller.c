@@ -0,0 +1,157 @@
+/**
+ * Idle connection poller for the thread pool
+ *
+ * A pool worker that runs out of request bytes to read parks the connection
+ * here rather than waiting in recv(). One thread watches every parked
+ * socket with epoll, hands it back to the pool as soon as it's readable
+ * (or the client hangs up), and closes it once it has been parked for
+ * conn_idle_timeout. So a worker is only busy while a request is actually
+ * arriving or being answered, and idle keep-alive clients can't use up the
+ * pool.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "conn.h"
+#include "threadpool.h"
+#include "poller.h"
+
+#define POLLER_MAX_EVENTS 256
+
+/**
+ * Take a connection off the parked list. Call with the lock held.
+ */
+static void poller_unlink(struct poller *p, struct conn *c)
+{
+    if (c->idle_prev) c->idle_prev->idle_next = c->idle_next;
+    else p->head = c->idle_next;
+
+    if (c->idle_next) c->idle_next->idle_prev = c->idle_prev;
+    else p->tail = c->idle_prev;
+
+    c->idle_prev = c->idle_next = NULL;
+}
+
+/**
+ * Close every connection that has been parked too long
+ *
+ * The list is in the order connections were parked, so only its head
+ * needs checking.
+ */
+static void poller_expire(struct poller *p)
+{
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&p->lock);
+
+    while (p->head != NULL && now - p->head->last_active >= conn_idle_timeout) {
+        struct conn *c = p->head;
+
+        poller_unlink(p, c);
+        conn_close(c); // Also drops it from the epoll set
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
+
+/**
+ * Poller thread: wait for parked connections to wake up
+ */
+static void *poller_main(void *vp)
+{
+    struct poller *p = vp;
+    struct epoll_event events[POLLER_MAX_EVENTS];
+
+    while (1) {
+        int n = epoll_wait(p->epfd, events, POLLER_MAX_EVENTS, 1000);
+
+        if (n == -1) {
+            if (errno != EINTR) perror("epoll_wait");
+            n = 0;
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct conn *c = events[i].data.ptr;
+            int fd = c->fd;
+
+            pthread_mutex_lock(&p->lock);
+            epoll_ctl(p->epfd, EPOLL_CTL_DEL, fd, NULL);
+            poller_unlink(p, c);
+            pthread_mutex_unlock(&p->lock);
+
+            // A worker owns it from here on; don't touch c again
+            threadpool_submit(p->pool, fd);
+        }
+
+        poller_expire(p);
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a poller feeding pool and start its thread
+ */
+struct poller *poller_create(struct threadpool *pool)
+{
+    struct poller *p = malloc(sizeof *p);
+
+    if (p == NULL) return NULL;
+
+    p->epfd = epoll_create1(0);
+
+    if (p->epfd == -1) {
+        perror("epoll_create1");
+        free(p);
+        return NULL;
+    }
+
+    p->pool = pool;
+    p->head = p->tail = NULL;
+
+    pthread_mutex_init(&p->lock, NULL);
+
+    if (pthread_create(&p->thread, NULL, poller_main, p) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+
+    return p;
+}
+
+/**
+ * Hand an idle connection to the poller
+ *
+ * The caller gives up c: once parked it may be handed to another worker or
+ * closed at any moment. Its idle timeout starts now.
+ */
+void poller_park(struct poller *p, struct conn *c)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.ptr = c;
+
+    pthread_mutex_lock(&p->lock);
+
+    c->last_active = time(NULL);
+    c->idle_prev = p->tail;
+    c->idle_next = NULL;
+
+    if (p->tail) p->tail->idle_next = c;
+    else p->head = c;
+
+    p->tail = c;
+
+    if (epoll_ctl(p->epfd, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        perror("epoll_ctl");
+        poller_unlink(p, c);
+        conn_close(c);
+    }
+
+    pthread_mutex_unlock(&p->lock);
+}
@@ -0,0 +1,20 @@
+#ifndef _POLLER_H_
+#define _POLLER_H_
+#include <pthread.h>
+#include "conn.h"
+#include "threadpool.h"
+
+// Holds a pool's idle connections until they have something to read
+struct poller {
+    int epfd;
+    pthread_t thread;
+    struct threadpool *pool; // Where connections go once they're readable
+
+    pthread_mutex_t lock;     // Guards the parked list
+    struct conn *head, *tail; // Parked connections, oldest first
+};
+
+extern struct poller *poller_create(struct threadpool *pool);
+extern void poller_park(struct poller *p, struct conn *c);
+
+#endif
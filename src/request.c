@@ -0,0 +1,784 @@
+/**
+ * request.c -- incremental HTTP/1.x request parser
+ *
+ * http_parse() is called every time more bytes land in the connection's
+ * input buffer. It picks up where it left off, so a request split across
+ * any number of reads parses the same as one that arrived whole, and it
+ * stops at the end of the first request so pipelined requests behind it
+ * stay in the buffer for the next call.
+ *
+ * Nothing is copied: the method, path, version, header names and values and
+ * the body are all views into the caller's buffer. Chunked bodies are
+ * decoded in place, so the body view is contiguous either way.
+ *
+ * Large bodies can be streamed instead: set body_sink from on_headers, and
+ * each piece of the body is passed to it as it arrives. Calling
+ * http_compact() after every parse then drops those bytes from the buffer,
+ * so the buffer never holds more than the headers plus one read.
+ */
+
+#define _GNU_SOURCE // strptime, timegm
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <pthread.h>
+#include "request.h"
+
+/**
+ * Reset the parser for a new request
+ */
+void http_request_init(struct http_request *req)
+{
+    memset(req, 0, sizeof *req);
+
+    req->state = PARSE_REQUEST_LINE;
+    req->content_length = -1;
+}
+
+/**
+ * Find the next line starting at pos
+ *
+ * Returns the offset just past the '\n', or 0 if the line isn't complete.
+ * *line_len gets the length without the line ending.
+ */
+static int next_line(char *buf, int len, int pos, int *line_len)
+{
+    char *nl = memchr(buf + pos, '\n', len - pos);
+
+    if (nl == NULL) {
+        return 0;
+    }
+
+    int end = nl - buf;
+
+    *line_len = end - pos;
+
+    if (*line_len > 0 && buf[end - 1] == '\r') {
+        (*line_len)--;
+    }
+
+    return end + 1;
+}
+
+/**
+ * Parse "METHOD SP target SP version"
+ */
+static int parse_request_line(struct http_request *req, char *line, int len)
+{
+    char *sp1 = memchr(line, ' ', len);
+
+    if (sp1 == NULL) return -1;
+
+    char *target = sp1 + 1;
+    char *sp2 = memchr(target, ' ', line + len - target);
+
+    if (sp2 == NULL) return -1;
+
+    req->method.p = line;
+    req->method.len = sp1 - line;
+
+    req->path.p = target;
+    req->path.len = sp2 - target;
+
+    req->version.p = sp2 + 1;
+    req->version.len = line + len - (sp2 + 1);
+
+    if (req->method.len == 0 || req->path.len == 0 || req->version.len == 0) {
+        return -1;
+    }
+
+    if (req->version.len < 5 || strncmp(req->version.p, "HTTP/", 5) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Parse "Name: value" and remember the headers that shape the body
+ *
+ * A body whose length could be read two ways is refused, since a proxy in
+ * front of us might read it the other way and see a different next
+ * request: Content-Length given twice with different values, or alongside
+ * Transfer-Encoding.
+ */
+static int parse_header_line(struct http_request *req, char *line, int len)
+{
+    char *colon = memchr(line, ':', len);
+
+    if (colon == NULL || colon == line || req->num_headers == MX_HEADERS) {
+        return -1;
+    }
+
+    char *value = colon + 1;
+    char *end = line + len;
+
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+
+    struct http_header *h = &req->headers[req->num_headers++];
+
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value.p = value;
+    h->value.len = end - value;
+
+    if (strview_caseeq(h->name, "Content-Length")) {
+        long n = 0;
+
+        if (h->value.len == 0) return -1;
+
+        for (int i = 0; i < h->value.len; i++) {
+            if (!isdigit((unsigned char)h->value.p[i])) return -1;
+
+            n = n * 10 + (h->value.p[i] - '0');
+
+            if (n > 0x7fffffffL) return -1;
+        }
+
+        if (req->content_length >= 0 && req->content_length != n) return -1;
+        if (http_get_header(req, "Transfer-Encoding") != NULL) return -1;
+
+        req->content_length = n;
+    }
+    else if (strview_caseeq(h->name, "Transfer-Encoding")) {
+        if (req->content_length >= 0) return -1;
+
+        req->chunked = strview_contains(h->value, "chunked");
+    }
+
+    return 0;
+}
+
+/**
+ * Parse a chunk-size line: hex digits, then optional ";extensions"
+ */
+static long parse_chunk_size(char *line, int len)
+{
+    long n = 0;
+    int i;
+
+    for (i = 0; i < len && isxdigit((unsigned char)line[i]); i++) {
+        int c = tolower((unsigned char)line[i]);
+
+        n = n * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+
+        if (n > 0x7fffffffL) return -1;
+    }
+
+    if (i == 0 || (i < len && line[i] != ';' && line[i] != ' ' && line[i] != '\t')) {
+        return -1;
+    }
+
+    return n;
+}
+
+/**
+ * Feed the parser everything buffered so far
+ *
+ * buf/len is the whole input buffer, starting at the request being parsed;
+ * call again with the same buf (plus whatever has been appended) after
+ * every read.
+ *
+ * Returns the number of bytes the complete request occupies, 0 if more
+ * input is needed, or -1 if the request is malformed.
+ */
+int http_parse(struct http_request *req, char *buf, int len)
+{
+    int line_len, next;
+
+    while (1) {
+        switch (req->state) {
+            case PARSE_REQUEST_LINE:
+                next = next_line(buf, len, req->pos, &line_len);
+
+                if (next == 0) return 0;
+
+                // Tolerate stray blank lines before a request
+                if (line_len == 0) {
+                    req->pos = next;
+                    break;
+                }
+
+                if (parse_request_line(req, buf + req->pos, line_len) < 0) {
+                    req->state = PARSE_ERROR;
+                    return -1;
+                }
+
+                req->pos = next;
+                req->state = PARSE_HEADERS;
+                break;
+
+            case PARSE_HEADERS:
+                next = next_line(buf, len, req->pos, &line_len);
+
+                if (next == 0) return 0;
+
+                if (line_len > 0) {
+                    if (parse_header_line(req, buf + req->pos, line_len) < 0) {
+                        req->state = PARSE_ERROR;
+                        return -1;
+                    }
+
+                    req->pos = next;
+                    break;
+                }
+
+                // Blank line: end of headers
+                req->pos = req->header_len = next;
+                req->body.p = buf + next;
+                req->body.len = 0;
+
+                if (req->on_headers != NULL) {
+                    req->on_headers(req, req->on_headers_arg);
+                }
+
+                if (req->chunked) {
+                    req->state = PARSE_CHUNK_SIZE;
+                }
+                else if (req->content_length > 0) {
+                    req->state = PARSE_BODY;
+                }
+                else {
+                    req->state = PARSE_DONE;
+                }
+                break;
+
+            case PARSE_BODY:
+                if (req->body_sink != NULL) {
+                    // pos can't be used to count here; http_compact() rewinds it
+                    int n = len - req->pos;
+                    long remaining = req->content_length - req->body_streamed;
+
+                    if (n > remaining) n = remaining;
+
+                    if (n > 0 && req->body_sink(req->body_sink_arg, buf + req->pos, n) < 0) {
+                        req->body_sink_failed = 1;
+                        req->state = PARSE_ERROR;
+                        return -1;
+                    }
+
+                    req->pos += n;
+                    req->body_streamed += n;
+
+                    if (req->body_streamed < req->content_length) return 0;
+
+                    req->state = PARSE_DONE;
+                    break;
+                }
+
+                if (len - req->header_len < req->content_length) return 0;
+
+                req->body.len = req->content_length;
+                req->pos = req->header_len + req->content_length;
+                req->state = PARSE_DONE;
+                break;
+
+            case PARSE_CHUNK_SIZE:
+                next = next_line(buf, len, req->pos, &line_len);
+
+                if (next == 0) return 0;
+
+                req->chunk_remaining = parse_chunk_size(buf + req->pos, line_len);
+
+                if (req->chunk_remaining < 0) {
+                    req->state = PARSE_ERROR;
+                    return -1;
+                }
+
+                req->pos = next;
+                req->state = req->chunk_remaining ? PARSE_CHUNK_DATA : PARSE_TRAILERS;
+                break;
+
+            case PARSE_CHUNK_DATA: {
+                // Slide the chunk down so the decoded body stays contiguous
+                int n = len - req->pos;
+
+                if (n > req->chunk_remaining) n = req->chunk_remaining;
+
+                if (req->body_sink != NULL) {
+                    if (n > 0 && req->body_sink(req->body_sink_arg, buf + req->pos, n) < 0) {
+                        req->body_sink_failed = 1;
+                        req->state = PARSE_ERROR;
+                        return -1;
+                    }
+
+                    req->body_streamed += n;
+                }
+                else {
+                    memmove(req->body.p + req->body.len, buf + req->pos, n);
+                    req->body.len += n;
+                }
+
+                req->pos += n;
+                req->chunk_remaining -= n;
+
+                if (req->chunk_remaining > 0) return 0;
+
+                req->state = PARSE_CHUNK_DATA_END;
+                break;
+            }
+
+            case PARSE_CHUNK_DATA_END:
+                next = next_line(buf, len, req->pos, &line_len);
+
+                if (next == 0) return 0;
+
+                if (line_len != 0) {
+                    req->state = PARSE_ERROR;
+                    return -1;
+                }
+
+                req->pos = next;
+                req->state = PARSE_CHUNK_SIZE;
+                break;
+
+            case PARSE_TRAILERS:
+                // Trailer fields are allowed but we have no use for them
+                next = next_line(buf, len, req->pos, &line_len);
+
+                if (next == 0) return 0;
+
+                req->pos = next;
+
+                if (line_len == 0) {
+                    req->state = PARSE_DONE;
+                }
+                break;
+
+            case PARSE_DONE:
+                return req->pos;
+
+            case PARSE_ERROR:
+                return -1;
+        }
+    }
+}
+
+/**
+ * Drop streamed body bytes from the buffer
+ *
+ * Only does anything when body_sink is set. Everything between the end of
+ * the headers and the parse position has already been handed to the sink,
+ * so the unparsed bytes after it are slid down over it.
+ *
+ * Returns the new buffer length. req->pos is adjusted to match.
+ */
+int http_compact(struct http_request *req, char *buf, int len)
+{
+    if (req->body_sink == NULL || req->header_len == 0 || req->pos <= req->header_len) {
+        return len;
+    }
+
+    int drop = req->pos - req->header_len;
+
+    memmove(buf + req->header_len, buf + req->pos, len - req->pos);
+    req->pos = req->header_len;
+
+    return len - drop;
+}
+
+/**
+ * Move a view along with a buffer that was reallocated
+ */
+static void rebase_view(struct strview *v, uintptr_t old_base, uintptr_t new_base)
+{
+    if (v->p != NULL) {
+        v->p = (char *)((uintptr_t)v->p - old_base + new_base);
+    }
+}
+
+/**
+ * Fix up every view after the input buffer moved (e.g. realloc)
+ */
+void http_request_rebase(struct http_request *req, uintptr_t old_base, uintptr_t new_base)
+{
+    rebase_view(&req->method, old_base, new_base);
+    rebase_view(&req->path, old_base, new_base);
+    rebase_view(&req->version, old_base, new_base);
+    rebase_view(&req->body, old_base, new_base);
+
+    for (int i = 0; i < req->num_headers; i++) {
+        rebase_view(&req->headers[i].name, old_base, new_base);
+        rebase_view(&req->headers[i].value, old_base, new_base);
+    }
+}
+
+/**
+ * Look up a header by name (case-insensitive)
+ *
+ * Returns a view of its value, or NULL if the request doesn't have it.
+ */
+struct strview *http_get_header(struct http_request *req, char *name)
+{
+    for (int i = 0; i < req->num_headers; i++) {
+        if (strview_caseeq(req->headers[i].name, name)) {
+            return &req->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Parse a decimal number from the front of a view
+ *
+ * Returns the number of digits used, or 0 if there aren't any.
+ */
+static int parse_long(char *p, int len, long *n)
+{
+    int i;
+
+    *n = 0;
+
+    for (i = 0; i < len && isdigit((unsigned char)p[i]); i++) {
+        if (*n > 0x7fffffffffffL) return 0;
+
+        *n = *n * 10 + (p[i] - '0');
+    }
+
+    return i;
+}
+
+/**
+ * Parse a Range header against a body of the given size
+ *
+ * Understands "bytes=a-b", "bytes=a-" and "bytes=-n", comma separated.
+ * Ranges that start past the end are dropped and the rest are clamped to
+ * the body.
+ *
+ * Returns the number of ranges stored in ranges, 0 if none of them can be
+ * satisfied (416), or -1 if the header should be ignored because it is
+ * malformed or asks for more than max ranges.
+ */
+int http_parse_range(struct strview v, long size, struct byte_range *ranges, int max)
+{
+    char *p = v.p;
+    char *end = v.p + v.len;
+    int count = 0;
+    int parts = 0;
+
+    if (v.len < 6 || strncasecmp(p, "bytes=", 6) != 0) {
+        return -1;
+    }
+
+    p += 6;
+
+    while (p < end) {
+        long first, last;
+        int n;
+
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+        if (++parts > max) return -1;
+
+        if (p < end && *p == '-') {
+            // Suffix: the last n bytes
+            n = parse_long(p + 1, end - p - 1, &last);
+
+            if (n == 0) return -1;
+
+            p += 1 + n;
+
+            if (last > 0 && size > 0) {
+                ranges[count].start = last < size ? size - last : 0;
+                ranges[count].end = size - 1;
+                count++;
+            }
+        }
+        else {
+            n = parse_long(p, end - p, &first);
+
+            if (n == 0 || p + n >= end || p[n] != '-') return -1;
+
+            p += n + 1;
+            n = parse_long(p, end - p, &last);
+            p += n;
+
+            if (n == 0) last = size - 1;
+            else if (last < first) return -1;
+
+            if (first < size) {
+                ranges[count].start = first;
+                ranges[count].end = last < size ? last : size - 1;
+                count++;
+            }
+        }
+
+        while (p < end && (*p == ' ' || *p == '\t')) p++;
+
+        if (p < end && *p++ != ',') return -1;
+    }
+
+    return parts == 0 ? -1 : count;
+}
+
+/**
+ * Parse an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT")
+ *
+ * Returns 0, or -1 if it isn't one.
+ */
+int http_parse_date(struct strview v, time_t *t)
+{
+    char buf[64];
+    struct tm tm;
+
+    memset(&tm, 0, sizeof tm);
+    strview_copy(v, buf, sizeof buf);
+
+    char *rest = strptime(buf, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+    if (rest == NULL || *rest != '\0') {
+        return -1;
+    }
+
+    *t = timegm(&tm);
+
+    return 0;
+}
+
+/**
+ * Format a time as an HTTP date ("Sun, 06 Nov 1994 08:49:37 GMT")
+ *
+ * Returns the length written.
+ */
+int http_format_date(time_t t, char *buf, int size)
+{
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+
+    return strftime(buf, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+// The current second as an HTTP date, shared by every thread. seq is odd
+// while it's being rewritten, so a reader can tell it copied a torn string.
+static struct {
+    unsigned seq;
+    time_t second;
+    char text[HTTP_DATE_LEN + 1];
+} date_cache;
+static pthread_mutex_t date_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Write the current time as an HTTP date into buf (HTTP_DATE_LEN + 1 bytes)
+ *
+ * The string is formatted once a second, by whichever thread first notices
+ * the second has changed, and copied by everyone else, so responses don't
+ * each pay for gmtime() and strftime(). It only ever moves forward: a thread
+ * that read the clock just before a second ended gets the newer date.
+ *
+ * Returns the length written.
+ */
+int http_date_now(char *buf)
+{
+    time_t now = time(NULL);
+
+    while (1) {
+        unsigned seq = __atomic_load_n(&date_cache.seq, __ATOMIC_ACQUIRE);
+
+        if ((seq & 1) == 0 && __atomic_load_n(&date_cache.second, __ATOMIC_RELAXED) >= now) {
+            memcpy(buf, date_cache.text, sizeof date_cache.text);
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+            if (__atomic_load_n(&date_cache.seq, __ATOMIC_RELAXED) == seq) {
+                return HTTP_DATE_LEN;
+            }
+            continue;
+        }
+
+        // Stale or being rewritten: one thread updates it, and anyone who
+        // would have to wait for that formats their own instead
+        if (pthread_mutex_trylock(&date_lock) != 0) {
+            return http_format_date(now, buf, HTTP_DATE_LEN + 1);
+        }
+
+        if (now > date_cache.second) {
+            seq = date_cache.seq;
+            __atomic_store_n(&date_cache.seq, seq + 1, __ATOMIC_RELAXED);
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            http_format_date(now, date_cache.text, sizeof date_cache.text);
+            __atomic_store_n(&date_cache.second, now, __ATOMIC_RELAXED);
+            __atomic_store_n(&date_cache.seq, seq + 2, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_unlock(&date_lock);
+    }
+}
+
+/**
+ * Check whether Accept-Encoding allows a content coding (e.g. "gzip")
+ *
+ * The coding has to be listed, by name or as "*", without "q=0".
+ */
+int http_accepts_encoding(struct http_request *req, char *coding)
+{
+    struct strview *v = http_get_header(req, "Accept-Encoding");
+    int star = 0;
+
+    if (v == NULL) {
+        return 0;
+    }
+
+    char *p = v->p;
+    char *end = v->p + v->len;
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+
+        struct strview name = { p, 0 };
+
+        while (p < end && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+
+        name.len = p - name.p;
+
+        // Parameters; only q matters
+        char *token_end = memchr(p, ',', end - p);
+
+        if (token_end == NULL) token_end = end;
+
+        struct strview params = { p, token_end - p };
+        int refused = 0;
+
+        for (int i = 0; i + 2 < params.len; i++) {
+            if ((params.p[i] == 'q' || params.p[i] == 'Q') && params.p[i + 1] == '=') {
+                char *q = params.p + i + 2;
+                char *q_end = params.p + params.len;
+
+                refused = q < q_end && *q == '0';
+
+                for (q++; refused && q < q_end && *q != ' ' && *q != ';'; q++) {
+                    refused = *q == '.' || *q == '0';
+                }
+                break;
+            }
+        }
+
+        if (strview_caseeq(name, coding)) return !refused;
+        if (strview_eq(name, "*")) star = !refused;
+
+        p = token_end;
+    }
+
+    return star;
+}
+
+/**
+ * Check an If-None-Match / If-Match style list of entity tags for etag
+ *
+ * "*" matches anything. With weak set, W/ prefixes are ignored (the weak
+ * comparison If-None-Match uses); otherwise a weak tag never matches.
+ */
+int http_etag_match(struct strview list, char *etag, int weak)
+{
+    char *p = list.p;
+    char *end = list.p + list.len;
+    int etag_len = strlen(etag);
+
+    while (p < end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) p++;
+
+        if (p == end) break;
+
+        if (*p == '*') return 1;
+
+        int is_weak = 0;
+
+        if (end - p > 2 && p[0] == 'W' && p[1] == '/') {
+            is_weak = 1;
+            p += 2;
+        }
+
+        char *tag = p;
+
+        if (p < end && *p == '"') {
+            char *close = memchr(p + 1, '"', end - p - 1);
+
+            p = close != NULL ? close + 1 : end;
+        }
+        else {
+            while (p < end && *p != ',') p++;
+        }
+
+        if ((weak || !is_weak) && p - tag == etag_len && memcmp(tag, etag, etag_len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Check whether a request's Range header should be honoured
+ *
+ * Without If-Range it always is. With one, only if it names etag (by
+ * strong comparison), or exactly mtime (RFC 7233 section 3.2: any other
+ * date, even a later one, gets the full response).
+ */
+int http_range_applies(struct http_request *req, char *etag, time_t mtime)
+{
+    struct strview *if_range = http_get_header(req, "If-Range");
+    time_t since;
+
+    if (if_range == NULL) {
+        return 1;
+    }
+
+    if (if_range->len > 0 && (if_range->p[0] == '"' || if_range->p[0] == 'W')) {
+        return http_etag_match(*if_range, etag, 0);
+    }
+
+    if (http_parse_date(*if_range, &since) < 0) {
+        return 0;
+    }
+
+    return mtime == since;
+}
+
+/**
+ * Compare a view against a string
+ */
+int strview_eq(struct strview v, char *s)
+{
+    return (int)strlen(s) == v.len && memcmp(v.p, s, v.len) == 0;
+}
+
+/**
+ * Compare a view against a string, ignoring case
+ */
+int strview_caseeq(struct strview v, char *s)
+{
+    return (int)strlen(s) == v.len && strncasecmp(v.p, s, v.len) == 0;
+}
+
+/**
+ * Check whether a view contains a string, ignoring case
+ *
+ * Good enough for comma-separated tokens like "keep-alive, Upgrade".
+ */
+int strview_contains(struct strview v, char *s)
+{
+    int n = strlen(s);
+
+    for (int i = 0; i + n <= v.len; i++) {
+        if (strncasecmp(v.p + i, s, n) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Copy a view into a NUL-terminated buffer, truncating to fit
+ */
+char *strview_copy(struct strview v, char *dst, int size)
+{
+    int n = v.len < size - 1 ? v.len : size - 1;
+
+    memcpy(dst, v.p, n);
+    dst[n] = '\0';
+
+    return dst;
+}
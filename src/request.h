@@ -0,0 +1,89 @@
+#ifndef _REQUEST_H_
+#define _REQUEST_H_
+#include <stdint.h>
+#include <time.h>
+
+#define MX_HEADERS 64
+#define MX_RANGES 16 // More ranges than this and we send the whole thing
+#define HTTP_DATE_LEN 29 // "Sun, 06 Nov 1994 08:49:37 GMT"
+
+// A run of bytes inside the connection's input buffer. Not NUL-terminated.
+struct strview {
+    char *p;
+    int len;
+};
+
+struct http_header {
+    struct strview name;
+    struct strview value;
+};
+
+enum parse_state {
+    PARSE_REQUEST_LINE,
+    PARSE_HEADERS,
+    PARSE_BODY,           // Content-Length body
+    PARSE_CHUNK_SIZE,     // Chunked body: size line
+    PARSE_CHUNK_DATA,     // Chunked body: data
+    PARSE_CHUNK_DATA_END, // Chunked body: CRLF after the data
+    PARSE_TRAILERS,
+    PARSE_DONE,
+    PARSE_ERROR
+};
+
+// One satisfiable part of a Range header, inclusive at both ends
+struct byte_range {
+    long start;
+    long end;
+};
+
+// Resumable parser state plus the parsed request
+struct http_request {
+    enum parse_state state;
+    int pos; // Bytes of input scanned so far
+
+    struct strview method;
+    struct strview path;
+    struct strview version;
+
+    struct http_header headers[MX_HEADERS];
+    int num_headers;
+    int header_len; // Request line plus headers, including the blank line
+
+    long content_length; // -1 if not given
+    int chunked;
+    long chunk_remaining;
+
+    struct strview body; // Chunked bodies are decoded in place
+
+    // Called as soon as the headers are parsed, before any of the body
+    void (*on_headers)(struct http_request *req, void *arg);
+    void *on_headers_arg;
+
+    // If set (e.g. by on_headers), body bytes are handed here as they arrive
+    // instead of being collected in body; http_compact() then frees their
+    // buffer space.
+    int (*body_sink)(void *arg, char *data, int len);
+    void *body_sink_arg;
+    long body_streamed; // Bytes handed to body_sink so far
+    int body_sink_failed; // PARSE_ERROR came from body_sink, not the request
+    int too_large; // PARSE_ERROR because the request outgrew the buffer for it
+};
+
+extern void http_request_init(struct http_request *req);
+extern int http_parse(struct http_request *req, char *buf, int len);
+extern int http_compact(struct http_request *req, char *buf, int len);
+extern void http_request_rebase(struct http_request *req, uintptr_t old_base, uintptr_t new_base);
+extern struct strview *http_get_header(struct http_request *req, char *name);
+extern int http_parse_range(struct strview v, long size, struct byte_range *ranges, int max);
+extern int http_parse_date(struct strview v, time_t *t);
+extern int http_format_date(time_t t, char *buf, int size);
+extern int http_date_now(char *buf);
+extern int http_accepts_encoding(struct http_request *req, char *coding);
+extern int http_etag_match(struct strview list, char *etag, int weak);
+extern int http_range_applies(struct http_request *req, char *etag, time_t mtime);
+extern int strview_eq(struct strview v, char *s);
+extern int strview_caseeq(struct strview v, char *s);
+extern int strview_contains(struct strview v, char *s);
+extern char *strview_copy(struct strview v, char *dst, int size);
+
+#endif
@@ -27,32 +27,107 @@
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <time.h>
+#include <sys/time.h>
 #include <sys/file.h>
+#include <sys/stat.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <limits.h>
 
 #include "net.h"
 #include "file.h"
 #include "mime.h"
 #include "cache.h"
+#include "gzip.h"
 #include "directory.h"
+#include "conn.h"
+#include "eventloop.h"
+#include "threadpool.h"
+#include "poller.h"
+#include "uring.h"
+#include "watch.h"
 
 #define PORT "3490"  // the port users will be connecting to
-#define MX_CLIENTS 256
 
 #define SERVER_FILES "./serverfiles"
 #define SERVER_ROOT "./serverroot"
-#define TIME_DIFF 60
+#define TIME_DIFF 60 // Default for -a when file changes can't be watched
+#define CACHE_SHARDS 8 // Independently locked parts of the cache
 
-struct pthread_args {
-	int fd;
-	struct cache *cache;
-};
+#define MAX_CACHED_FILE 65536 // Default for -o: bigger files are sent straight from disk
+#define CACHE_BYTES (16*1024*1024) // Default for -c: memory for cached responses
+#define MAX_HEADER_SIZE 1024
+#define CHUNK_SIZE 8192 // Generated bodies are sent in pieces this big
+
+int cache_max_age = -1; // Seconds a cached response is trusted; -1 until its file changes
+int map_files = 0; // Cache files as mmaps of the page cache instead of copies
+struct poller *idle_poller; // Where pool workers leave connections waiting for a request
+
+// Fixed parts of the preamble, copied rather than formatted
+#define DATE_PREFIX "\r\nDate: "
+#define CONNECTION_CLOSE "\r\nConnection: close\r\n"
+
+/**
+ * Write the lines that open every response into buf: the status line, Date
+ * and Connection (with Keep-Alive, if the connection is kept)
+ *
+ * These change from one response to the next; everything after them can be
+ * prepared in advance (see send_entity()). Only the Keep-Alive count is
+ * formatted here; the Date is the once-a-second one from http_date_now().
+ *
+ * buf must hold MAX_HEADER_SIZE bytes. Returns the length written.
+ */
+int format_preamble(int fd, char *buf, char *header)
+{
+	struct conn *c = conn_get(fd);
+	int charCnt = strlen(header);
+
+	if(charCnt > MAX_HEADER_SIZE / 2){
+		charCnt = MAX_HEADER_SIZE / 2;
+	}
+	memcpy(buf, header, charCnt);
+	memcpy(buf+charCnt, DATE_PREFIX, sizeof DATE_PREFIX - 1);
+	charCnt += sizeof DATE_PREFIX - 1;
+	charCnt += http_date_now(buf+charCnt);
+
+	if(c != NULL && c->keep_alive){
+		charCnt += snprintf(buf+charCnt, MAX_HEADER_SIZE-charCnt, "\r\nConnection: keep-alive\r\nKeep-Alive: timeout=%d, max=%d\r\n", conn_idle_timeout, conn_max_requests - c->requests);
+	}
+	else{
+		memcpy(buf+charCnt, CONNECTION_CLOSE, sizeof CONNECTION_CLOSE - 1);
+		charCnt += sizeof CONNECTION_CLOSE - 1;
+	}
 
-int clnt_socks[MX_CLIENTS];
-int clnt_cnt=0;
+	return charCnt;
+}
+
+/**
+ * Write the status line and headers of a response into buf
+ *
+ * content_length: body length, or -1 if the body is sent in chunks (see
+ *                 send_chunked_headers())
+ * extra:          more header lines, each ending in "\r\n", or NULL
+ *
+ * buf must hold MAX_HEADER_SIZE bytes. Returns the length written.
+ */
+int format_headers(int fd, char *buf, char *header, char *content_type, long content_length, char *extra)
+{
+	int charCnt = format_preamble(fd, buf, header);
+	struct conn *c = conn_get(fd);
+	if(content_length >= 0){
+		charCnt += snprintf(buf+charCnt, MAX_HEADER_SIZE-charCnt, "Content-Length: %ld\r\n",content_length);
+	}
+	else if(c == NULL || c->keep_alive || !strview_eq(c->req.version, "HTTP/1.0")){
+		charCnt += snprintf(buf+charCnt, MAX_HEADER_SIZE-charCnt, "Transfer-Encoding: chunked\r\n");
+	}
+	if(extra != NULL){
+		charCnt += snprintf(buf+charCnt, MAX_HEADER_SIZE-charCnt, "%s", extra);
+	}
+	charCnt += snprintf(buf+charCnt, MAX_HEADER_SIZE-charCnt, "Content-Type: %s\r\n\r\n", content_type);
 
-pthread_mutex_t mutx;
+	return charCnt < MAX_HEADER_SIZE ? charCnt : MAX_HEADER_SIZE - 1;
+}
 
 /**
  * Send an HTTP response
@@ -60,55 +135,447 @@ pthread_mutex_t mutx;
  * header:       "HTTP/1.1 404 NOT FOUND" or "HTTP/1.1 200 OK", etc.
  * content_type: "text/plain", etc.
  * body:         the data to send.
+ *
+ * The headers and body go out together with conn_writev(), so the body is
+ * sent from where it is instead of being copied in behind the headers.
  * 
- * Return the value from the send() function.
+ * Return the value from the conn_writev() function.
  */
 int send_response(int fd, char *header, char *content_type, void *body, int content_length)
 {
-    const int max_response_size = 262144;
-    char response[max_response_size];
-	int header_length = strlen(header);
-	int content_type_len = strlen(content_type);
-	if((header_length+content_type_len+content_length)>max_response_size){ //size of packet exceeds max_response_size
+	char headers[MAX_HEADER_SIZE];
+	struct iovec iov[2];
+
+	iov[0].iov_base = headers;
+	iov[0].iov_len = format_headers(fd, headers, header, content_type, content_length, NULL);
+	iov[1].iov_base = body;
+	iov[1].iov_len = content_length;
+
+    // Send it all! (or queue it, if fd belongs to the event loop)
+    int rv = conn_writev(fd, iov, 2);
+
+    return rv;
+}
+
+#define BYTERANGE_BOUNDARY "c6e2f1a9b04d7358"
+#define MULTIPART_PIECE 65536 // Most of a range read from disk at a time for a multipart response
+
+// A file to send, either from the cache or from disk
+struct entity {
+	char *content_type;
+	void *content;           // Cached copy, or NULL to read fh
+	struct file_handle *fh;
+	long size;
+	time_t mtime;            // Last-Modified
+	char *etag;              // Quoted entity tag
+	char *encoding;          // "gzip", or NULL if not encoded
+	int vary;                // 1 if another Accept-Encoding would get a different body
+	char *headers;           // Prepared headers for a 200 (after the preamble), or NULL
+	int headers_length;
+};
+
+/**
+ * Pick which variant of a cached entry to send
+ *
+ * Clients that accept gzip get the compressed copy if there is one.
+ */
+void entry_entity(struct cache_entry *entry, struct http_request *req, struct entity *e)
+{
+	e->content_type = entry->content_type;
+	e->fh = NULL;
+	e->mtime = entry->mtime;
+	e->vary = entry->gzip_content != NULL;
+
+	if(entry->gzip_content != NULL && req != NULL && http_accepts_encoding(req, "gzip")){
+		e->content = entry->gzip_content;
+		e->size = entry->gzip_length;
+		e->etag = entry->gzip_etag;
+		e->encoding = "gzip";
+		e->headers = entry->gzip_headers;
+		e->headers_length = entry->gzip_headers_length;
+	}
+	else{
+		e->content = entry->content;
+		e->size = entry->content_length;
+		e->etag = entry->etag;
+		e->encoding = NULL;
+		e->headers = entry->headers;
+		e->headers_length = entry->headers_length;
+	}
+}
+
+/**
+ * Check the request's validators against what we would send
+ *
+ * If-None-Match wins when both are given, as RFC 7232 says.
+ *
+ * Returns 1 if the client's copy is current and a 304 will do.
+ */
+int not_modified(struct http_request *req, struct entity *e)
+{
+	struct strview *ifNoneMatch = http_get_header(req, "If-None-Match");
+	struct strview *ifModifiedSince = http_get_header(req, "If-Modified-Since");
+	time_t since;
+
+	if(ifNoneMatch != NULL){
+		return http_etag_match(*ifNoneMatch, e->etag, 1);
+	}
+
+	if(ifModifiedSince != NULL && http_parse_date(*ifModifiedSince, &since) == 0){
+		return e->mtime <= since;
+	}
+
+	return 0;
+}
+
+/**
+ * Write the headers that describe an entity (validators, encoding) into buf
+ */
+void format_validators(struct entity *e, char *buf, int size)
+{
+	char lastModified[64];
+
+	http_format_date(e->mtime, lastModified, sizeof lastModified);
+	snprintf(buf, size, "Accept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s%s",
+		e->etag, lastModified,
+		e->encoding != NULL ? "Content-Encoding: " : "", e->encoding != NULL ? e->encoding : "", e->encoding != NULL ? "\r\n" : "",
+		e->vary ? "Vary: Accept-Encoding\r\n" : "");
+}
+
+// A multipart/byteranges body being sent from disk, a piece at a time
+struct multipart {
+	int file_fd;   // Our own dup() of the file
+	struct byte_range ranges[MX_RANGES];
+	char partHeaders[MX_RANGES][256];
+	int partLengths[MX_RANGES];
+	int nranges;
+	int part;      // Range being sent
+	long sent;     // How much of it has been sent, or -1 before its part header
+};
+
+/**
+ * Producer: send the next part header, or up to MULTIPART_PIECE bytes of
+ * a range, or the closing boundary
+ */
+int produce_multipart(int fd, void *arg)
+{
+	struct multipart *m = arg;
+
+	if(m->part == m->nranges){
+		char closing[] = "\r\n--" BYTERANGE_BOUNDARY "--\r\n";
+		return conn_write(fd, closing, strlen(closing)) < 0 ? -1 : 0;
+	}
+
+	struct byte_range *r = &m->ranges[m->part];
+	if(m->sent < 0){
+		if(conn_write(fd, m->partHeaders[m->part], m->partLengths[m->part]) < 0){
+			return -1;
+		}
+		m->sent = 0;
+	}
+
+	long len = r->end - r->start + 1 - m->sent;
+	if(len > MULTIPART_PIECE){
+		len = MULTIPART_PIECE;
+	}
+	if(conn_copy_file(fd, m->file_fd, r->start + m->sent, len) < 0){
 		return -1;
 	}
-	time_t now = time(NULL);
-	struct tm* timeFormat = localtime(&now);
-	char *dayOfWeek[7] = {
-		"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
-	};
-	char *monthName[12] = {
-		"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
-	};
-	int wday, month, day, hour, min, sec, year;
-	wday = timeFormat->tm_wday; 
-	month = timeFormat->tm_mon; 
-	day = timeFormat->tm_mday; 
-	hour = timeFormat->tm_hour; 
-	min = timeFormat->tm_min; 
-	sec = timeFormat->tm_sec;
-	year = 1900+timeFormat->tm_year;
-	
-	
-    // Build HTTP response and store it in response
-	int charCnt=0;
-	charCnt += sprintf(response, "%s\n",header);
-	charCnt += sprintf(response+charCnt, "Date: %s %s %d %d:%d:%d PST %d\n", dayOfWeek[wday], monthName[month], day, hour, min, sec, year);
-	charCnt += sprintf(response+charCnt, "Connection: close\n");
-	charCnt += sprintf(response+charCnt, "Content-Length: %d\n",content_length);
-	charCnt += sprintf(response+charCnt, "Content-Type: %s\n\n", content_type);
-	memcpy(response+charCnt, body, content_length);
-	
-	int response_length = charCnt+content_length;
+	m->sent += len;
+	if(m->sent == r->end - r->start + 1){
+		m->part++;
+		m->sent = -1;
+	}
+	return 1;
+}
 
-    // Send it all!
-    int rv = send(fd, response, response_length, 0);
+void multipart_done(void *arg, int completed)
+{
+	struct multipart *m = arg;
 
-    if (rv < 0) {
-        perror("send");
-    }
+	(void)completed;
+	close(m->file_fd);
+	free(m);
+}
 
-    return rv;
+/**
+ * Send a file, or just the parts of it a Range header asks for
+ *
+ * The bytes come from the cached copy if there is one, otherwise from the
+ * file on disk. Responses carry ETag and Last-Modified, and a request whose
+ * validators still match gets a body-less 304 instead.
+ *
+ * One range gets a plain 206, several get a multipart/byteranges 206, and
+ * ranges that all fall outside the file get a 416. A malformed Range header
+ * is ignored and the whole file is sent.
+ *
+ * Returns 0, or -1 on error.
+ */
+int send_entity(int fd, struct http_request *req, struct entity *e)
+{
+	char headers[MAX_HEADER_SIZE];
+	char extra[512];
+	char validators[256];
+	char *content_type = e->content_type;
+	char *content = e->content;
+	struct file_handle *fh = e->fh;
+	long size = e->size;
+	struct byte_range ranges[MX_RANGES];
+	int nranges = -1;
+	int header_length;
+	struct strview *range = req != NULL ? http_get_header(req, "Range") : NULL;
+
+	if(req != NULL && not_modified(req, e)){
+		format_validators(e, validators, sizeof validators);
+		header_length = format_headers(fd, headers, "HTTP/1.1 304 NOT MODIFIED", content_type, size, validators);
+		return conn_write(fd, headers, header_length) < 0 ? -1 : 0;
+	}
+
+	if(range != NULL && http_range_applies(req, e->etag, e->mtime)){
+		nranges = http_parse_range(*range, size, ranges, MX_RANGES);
+	}
+
+	if(nranges == 0){
+		snprintf(extra, sizeof extra, "Content-Range: bytes */%ld\r\n", size);
+		header_length = format_headers(fd, headers, "HTTP/1.1 416 RANGE NOT SATISFIABLE", content_type, 0, extra);
+		return conn_write(fd, headers, header_length) < 0 ? -1 : 0;
+	}
+
+	// A cached entry's headers are ready; only the preamble is formatted
+	if(nranges < 0 && content != NULL && e->headers != NULL){
+		struct iovec iov[3];
+		iov[0].iov_base = headers;
+		iov[0].iov_len = format_preamble(fd, headers, "HTTP/1.1 200 OK");
+		iov[1].iov_base = e->headers;
+		iov[1].iov_len = e->headers_length;
+		iov[2].iov_base = content;
+		iov[2].iov_len = size;
+		return conn_writev(fd, iov, 3) < 0 ? -1 : 0;
+	}
+
+	format_validators(e, validators, sizeof validators);
+
+	if(nranges == 1){
+		long len = ranges[0].end - ranges[0].start + 1;
+		snprintf(extra, sizeof extra, "%sContent-Range: bytes %ld-%ld/%ld\r\n", validators, ranges[0].start, ranges[0].end, size);
+		header_length = format_headers(fd, headers, "HTTP/1.1 206 PARTIAL CONTENT", content_type, len, extra);
+		if(content != NULL){
+			struct iovec iov[2];
+			iov[0].iov_base = headers;
+			iov[0].iov_len = header_length;
+			iov[1].iov_base = (char *)content + ranges[0].start;
+			iov[1].iov_len = len;
+			return conn_writev(fd, iov, 2) < 0 ? -1 : 0;
+		}
+		if(conn_write(fd, headers, header_length) < 0){
+			return -1;
+		}
+		return conn_sendfile(fd, fh->fd, ranges[0].start, len);
+	}
+
+	if(nranges > 1){
+		// Each part gets its own little header, and the whole lot is framed by the boundary
+		char partHeaders[MX_RANGES][256];
+		int partLengths[MX_RANGES];
+		char closing[] = "\r\n--" BYTERANGE_BOUNDARY "--\r\n";
+		long total = strlen(closing);
+		for(int i=0;i<nranges;i++){
+			partLengths[i] = snprintf(partHeaders[i], sizeof partHeaders[i], "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n", BYTERANGE_BOUNDARY, content_type, ranges[i].start, ranges[i].end, size);
+			if(partLengths[i] >= (int)sizeof partHeaders[i]){
+				partLengths[i] = sizeof partHeaders[i] - 1;
+			}
+			total += partLengths[i] + ranges[i].end - ranges[i].start + 1;
+		}
+		header_length = format_headers(fd, headers, "HTTP/1.1 206 PARTIAL CONTENT", "multipart/byteranges; boundary=" BYTERANGE_BOUNDARY, total, validators);
+		if(content != NULL){
+			struct iovec iov[2*MX_RANGES+2];
+			int iovcnt = 0;
+			iov[iovcnt].iov_base = headers;
+			iov[iovcnt++].iov_len = header_length;
+			for(int i=0;i<nranges;i++){
+				iov[iovcnt].iov_base = partHeaders[i];
+				iov[iovcnt++].iov_len = partLengths[i];
+				iov[iovcnt].iov_base = (char *)content + ranges[i].start;
+				iov[iovcnt++].iov_len = ranges[i].end - ranges[i].start + 1;
+			}
+			iov[iovcnt].iov_base = closing;
+			iov[iovcnt++].iov_len = strlen(closing);
+			return conn_writev(fd, iov, iovcnt) < 0 ? -1 : 0;
+		}
+		// From disk the parts could add up to anything, so they're read as
+		// the client takes them
+		struct multipart *m = malloc(sizeof *m);
+		if(m == NULL){
+			return -1;
+		}
+		m->file_fd = dup(fh->fd);
+		if(m->file_fd < 0){
+			free(m);
+			return -1;
+		}
+		memcpy(m->ranges, ranges, nranges * sizeof ranges[0]);
+		memcpy(m->partHeaders, partHeaders, nranges * sizeof partHeaders[0]);
+		memcpy(m->partLengths, partLengths, nranges * sizeof partLengths[0]);
+		m->nranges = nranges;
+		m->part = 0;
+		m->sent = -1;
+		if(conn_write(fd, headers, header_length) < 0){
+			multipart_done(m, 0);
+			return -1;
+		}
+		return conn_produce(fd, produce_multipart, m, multipart_done);
+	}
+
+	header_length = format_headers(fd, headers, "HTTP/1.1 200 OK", content_type, size, validators);
+	if(content != NULL){
+		struct iovec iov[2];
+		iov[0].iov_base = headers;
+		iov[0].iov_len = header_length;
+		iov[1].iov_base = content;
+		iov[1].iov_len = size;
+		return conn_writev(fd, iov, 2) < 0 ? -1 : 0;
+	}
+
+	// The body goes from the page cache to the socket with sendfile(), so it
+	// never passes through user space and there is no size limit
+	if(conn_write(fd, headers, header_length) < 0){
+		return -1;
+	}
+	return conn_sendfile(fd, fh->fd, 0, size);
+}
+
+
+// A response body that is sent as it is generated
+struct chunk_writer {
+	int fd;
+	int chunked;   // 0 for HTTP/1.0 clients: raw body, ended by closing
+	int failed;
+	char buf[CHUNK_SIZE];
+	int len;
+	char *saved;   // Whole body so far, to cache afterwards; NULL once too big
+	int savedLen;
+	int savedCap;
+};
+
+/**
+ * Start a response whose length isn't known up front
+ *
+ * HTTP/1.1 clients get it with chunked encoding. HTTP/1.0 clients don't
+ * understand that, so they get the raw body and the connection is closed
+ * to mark its end.
+ */
+void send_chunked_headers(struct chunk_writer *w, int fd, char *header, char *content_type)
+{
+	char headers[MAX_HEADER_SIZE];
+	struct conn *c = conn_get(fd);
+
+	w->fd = fd;
+	w->chunked = 1;
+	w->failed = 0;
+	w->len = 0;
+	w->saved = NULL;
+	w->savedLen = 0;
+	w->savedCap = 0;
+
+	if(c != NULL && strview_eq(c->req.version, "HTTP/1.0")){
+		c->keep_alive = 0;
+		w->chunked = 0;
+	}
+
+	int header_length = format_headers(fd, headers, header, content_type, -1, NULL);
+
+	if(conn_write(fd, headers, header_length) < 0){
+		w->failed = 1;
+	}
+}
+
+/**
+ * Send whatever the writer has buffered as one chunk
+ */
+void send_chunk(struct chunk_writer *w)
+{
+	char sizeLine[16];
+	struct iovec iov[3];
+	int iovcnt = 0;
+
+	if(w->len == 0 || w->failed){
+		w->len = 0;
+		return;
+	}
+
+	if(w->chunked){
+		iov[iovcnt].iov_base = sizeLine;
+		iov[iovcnt++].iov_len = sprintf(sizeLine, "%x\r\n", w->len);
+	}
+	iov[iovcnt].iov_base = w->buf;
+	iov[iovcnt++].iov_len = w->len;
+	if(w->chunked){
+		iov[iovcnt].iov_base = "\r\n";
+		iov[iovcnt++].iov_len = 2;
+	}
+
+	if(conn_writev(w->fd, iov, iovcnt) < 0){
+		w->failed = 1;
+	}
+
+	w->len = 0;
+}
+
+/**
+ * Add generated text to a chunked response, sending it when the buffer fills
+ */
+void chunk_write(void *arg, char *str)
+{
+	struct chunk_writer *w = arg;
+	int len = strlen(str);
+
+	if(w->saved != NULL){
+		if(w->savedLen + len > w->savedCap){ // too big to cache; just stream it
+			free(w->saved);
+			w->saved = NULL;
+		}
+		else{
+			memcpy(w->saved + w->savedLen, str, len);
+			w->savedLen += len;
+		}
+	}
+
+	while(len > 0){
+		int n = CHUNK_SIZE - w->len < len ? CHUNK_SIZE - w->len : len;
+
+		memcpy(w->buf + w->len, str, n);
+		w->len += n;
+		str += n;
+		len -= n;
+
+		if(w->len == CHUNK_SIZE){
+			send_chunk(w);
+		}
+	}
+}
+
+/**
+ * Send the last of a chunked response
+ *
+ * Returns 0, or -1 if any part of it couldn't be sent.
+ */
+int send_chunked_end(struct chunk_writer *w)
+{
+	send_chunk(w);
+
+	if(w->chunked && !w->failed && conn_write(w->fd, "0\r\n\r\n", 5) < 0){
+		w->failed = 1;
+	}
+
+	if(w->failed){
+		struct conn *c = conn_get(w->fd);
+		if(c != NULL){
+			c->keep_alive = 0;
+		}
+		return -1;
+	}
+
+	return 0;
 }
 
 
@@ -150,294 +617,691 @@ void resp_404(int fd)
     }
 
     mime_type = mime_type_get(filepath);
-	printf("Serving 404!\n");
-	printf("404 file: %s\n",filedata->data);
 
     send_response(fd, "HTTP/1.1 404 NOT FOUND", mime_type, filedata->data, filedata->size);
-	printf("response sent!\n");
 
     file_free(filedata);
-	printf("filedata freed!\n");
 }
 
 /**
- * Read and return a file from disk or cache
+ * Look up a response in the cache, dropping it if it has gone stale
+ *
+ * The lookup takes no lock; only dropping a stale entry locks the path's
+ * shard. The entry comes back pinned, so it can be sent at leisure; pass it
+ * to cache_release() when done.
+ */
+struct cache_entry *get_cached(struct sharded_cache *cache, struct cache_key *key)
+{
+	return sharded_cache_get(cache, key, cache_max_age);
+}
+
+/**
+ * Check that a mapped entry's file still has everything the mapping covers
+ *
+ * Reading a mapping past the end of a file that has since been truncated
+ * gets nothing but zeros (see file_map_guard()), so such an entry must not
+ * be served even if the watcher hasn't caught up yet.
+ */
+int mapping_intact(char *filePath, struct cache_entry *entry)
+{
+	struct stat st;
+
+	if(stat(filePath, &st) < 0){
+		return 0;
+	}
+	return st.st_size >= entry->content_length && st.st_mtime == entry->mtime;
+}
+
+/**
+ * Drop everything cached that depended on a path under SERVER_ROOT
+ *
+ * Called by the watcher thread whenever something there changes.
+ */
+void invalidate_path(void *arg, char *path, int subtree)
+{
+	struct sharded_cache *cache = arg;
+	char related[1100];
+	int len = strlen(path);
+
+	printf("changed: %s%s\n", path, subtree ? "/..." : "");
+
+	if(subtree){
+		sharded_cache_invalidate_tree(cache, path);
+	}
+	else{
+		sharded_cache_invalidate(cache, path);
+		// Directory listings are cached with and without a trailing slash
+		snprintf(related, sizeof related, "%s/", path);
+		sharded_cache_invalidate(cache, related);
+	}
+
+	// The listing of the directory it's in shows its size and date
+	char *slash = strrchr(path, '/');
+	if(slash != NULL){
+		snprintf(related, sizeof related, "%.*s", (int)(slash - path), path);
+		sharded_cache_invalidate(cache, related);
+		snprintf(related, sizeof related, "%.*s/", (int)(slash - path), path);
+		sharded_cache_invalidate(cache, related);
+	}
+
+	// A precompressed copy is cached along with the file it's next to
+	if(len > 3 && strcmp(path + len - 3, ".gz") == 0){
+		snprintf(related, sizeof related, "%.*s", len - 3, path);
+		sharded_cache_invalidate(cache, related);
+	}
+}
+
+/**
+ * Open the precompressed copy of a file (its path plus ".gz"), if there is
+ * one that's at least as new as the file itself
  */
-void get_file(int fd, struct cache *cache, char *request_path)
+struct file_handle *open_gzip_sidecar(char *filePath, time_t mtime)
+{
+	char gzPath[1100];
+	snprintf(gzPath, sizeof gzPath, "%s.gz", filePath);
+	struct file_handle *gz = file_open(gzPath);
+	if(gz != NULL && gz->mtime < mtime){ // stale: the file changed after it was compressed
+		file_close(gz);
+		return NULL;
+	}
+	return gz;
+}
+
+void get_file(int fd, struct sharded_cache *cache, char *request_path, struct http_request *req)
 {
 	char filePath[1020];
 	struct file_data *fileContent;
 	char* mime_type;
-	int foundInCache = 0;
 	strncpy(filePath, request_path, 1020);
-	printf("filePath:  %s \n",filePath);
 	
-	pthread_mutex_lock(&mutx);
-	struct cache_entry *entry = cache_get(cache, request_path);
-	if(entry!=NULL){
-		time_t current = time(NULL);
-		if(current - entry->created_at < TIME_DIFF){
-			printf("file found from entry. Serving from cache\n");
-			
-			print_cache(cache);
-			foundInCache = 1;
-		}
-		else{
-			cache_delete(cache, entry);
-		}	
-		if(foundInCache==1){
-			send_response(fd, "HTTP/1.1 200 OK", entry->content_type, entry->content, entry->content_length);
-		}
+	struct cache_key key;
+	cache_key_init(&key, request_path); // once, for every lookup below
+	unsigned long generation = sharded_cache_generation(cache, &key);
+	struct cache_entry *entry = get_cached(cache, &key);
+	if(entry!=NULL && entry->mapped && !mapping_intact(request_path, entry)){
+		sharded_cache_invalidate(cache, request_path);
+		cache_release(entry);
+		entry = NULL;
+		generation = sharded_cache_generation(cache, &key);
 	}
-	pthread_mutex_unlock(&mutx);
-	
-	if(foundInCache==1){
+	if(entry!=NULL){
+		struct entity e;
+		entry_entity(entry, req, &e);
+		send_entity(fd, req, &e);
+		cache_release(entry);
 		return;
 	}
 	
-	fileContent = file_load(filePath);
-	if(fileContent==NULL){ // if the requested file doesn't exist or is not a regular file, serve 404
-		printf("FILE NOT FOUND! SERVING 404!\n"); 
+	// Unfinished uploads aren't there yet
+	struct file_handle *fh = file_is_upload_tmp(filePath) ? NULL : file_open(filePath);
+	if(fh==NULL){ // if the requested file doesn't exist or is not a regular file, serve 404
 		resp_404(fd);
+		return;
 	}
-	else{
-		printf("file not found from entry. serving from disk\n");
-		printf("FILE FOUND. SERVING 200\n");
-		mime_type = mime_type_get(filePath);
-		printf("mime type got! %s\n",mime_type);
-		pthread_mutex_lock(&mutx);
-		printf("mutex locked!\n");
-		cache_put(cache, request_path, mime_type, fileContent->data, fileContent->size);
-		print_cache(cache);
-		pthread_mutex_unlock(&mutx);
-		printf("mutex unlocked!\n");
-		send_response(fd, "HTTP/1.1 200 OK", mime_type, fileContent->data, fileContent->size);
-		file_free(fileContent);
-	}
-}
-
-void get_directory(int fd, struct cache* cache, char *request_path){
-	int foundInCache = 0;
-	pthread_mutex_lock(&mutx);
-	struct cache_entry *entry = cache_get(cache, request_path);
-	if(entry!=NULL){
-		time_t current = time(NULL);
-		if(current - entry->created_at < TIME_DIFF){
-			printf("directory found from entry. Serving from cache\n");
-			print_cache(cache);
-			foundInCache = 1;
-			return;
+	mime_type = mime_type_get(filePath);
+	if(fh->size > cache->max_object){ // too big to keep in memory; send it straight from disk
+		// Hashing the whole file per request would cost more than sending it,
+		// so big files are tagged by modification time and size instead
+		char etag[MX_ETAG_LEN];
+		struct file_handle *gz = gzip_compressible(mime_type) ? open_gzip_sidecar(request_path, fh->mtime) : NULL;
+		struct entity e = { mime_type, NULL, fh, fh->size, fh->mtime, etag, NULL, gz != NULL, NULL, 0 };
+		snprintf(etag, sizeof etag, "\"%lx-%lx\"", (long)fh->mtime, (long)fh->size);
+		if(gz != NULL && http_accepts_encoding(req, "gzip")){
+			snprintf(etag, sizeof etag, "\"%lx-%lx-gz\"", (long)gz->mtime, (long)gz->size);
+			e.fh = gz;
+			e.size = gz->size;
+			e.encoding = "gzip";
 		}
-		else{
-			cache_delete(cache, entry);
-		}	
-		if(foundInCache==1){
-			send_response(fd, "HTTP/1.1 200 OK", entry->content_type, entry->content, entry->content_length);
+		send_entity(fd, req, &e);
+		if(gz != NULL){
+			file_close(gz);
 		}
+		file_close(fh);
+		return;
 	}
-	pthread_mutex_unlock(&mutx);
-	if(foundInCache==1){
+	time_t mtime = fh->mtime;
+	fileContent = map_files ? file_map(fh) : file_read(fh);
+	file_close(fh);
+	if(fileContent==NULL){
+		resp_404(fd);
 		return;
 	}
-	
-	char index_page[8192] = "";
-	printf("directory not found from entry. Drawing new Index page\n");
-	
-	drawindexpage(request_path, index_page);
-	int indexLen = strlen(index_page);
-	
-	pthread_mutex_lock(&mutx);
-	cache_put(cache, request_path, "text/html", index_page, indexLen);
-	pthread_mutex_unlock(&mutx);
-	send_response(fd, "HTTP/1.1 200 OK", "text/html", index_page, indexLen);
-	
-	print_cache(cache);
+	// A precompressed copy saves compressing it ourselves
+	struct file_data *gzContent = NULL;
+	if(gzip_compressible(mime_type)){
+		struct file_handle *gz = open_gzip_sidecar(request_path, mtime);
+		if(gz != NULL){
+			if(gz->size <= cache->max_object){
+				gzContent = file_read(gz);
+			}
+			file_close(gz);
+		}
+	}
+	if(fileContent->mapped){
+		entry = sharded_cache_put_mapped(cache, &key, mime_type, fileContent->data, fileContent->size, mtime, gzContent != NULL ? gzContent->data : NULL, gzContent != NULL ? gzContent->size : 0, generation);
+		if(entry != NULL && entry->content == fileContent->data){
+			fileContent->data = NULL; // the cache has it now
+		}
+	}
+	else{
+		entry = sharded_cache_put_file(cache, &key, mime_type, fileContent->data, fileContent->size, mtime, gzContent != NULL ? gzContent->data : NULL, gzContent != NULL ? gzContent->size : 0, generation);
+	}
+	if(entry != NULL){
+		struct entity e;
+		entry_entity(entry, req, &e);
+		send_entity(fd, req, &e);
+		cache_release(entry);
+	}
+	else{
+		char etag[MX_ETAG_LEN];
+		cache_make_etag(fileContent->data, fileContent->size, etag);
+		struct entity e = { mime_type, fileContent->data, NULL, fileContent->size, mtime, etag, NULL, 0, NULL, 0 };
+		send_entity(fd, req, &e);
+	}
+	file_free(fileContent);
+	if(gzContent != NULL){
+		file_free(gzContent);
+	}
 }
 
 /**
- * Search for the end of the HTTP header
- * 
- * "Newlines" in HTTP can be \r\n (carriage return followed by newline) or \n
- * (newline) or \r (carriage return).
+ * Send a 500 response
  */
-char *find_start_of_body(char *header, int bytes_recv)
-{ //just skip the first four lines of request
-    int newLineCnt = 0;
-	char* endOfHeader;
-	
-	endOfHeader = strstr(header, "\r\n\r\n");
-	return (endOfHeader==NULL)?NULL:(endOfHeader+4);
-}
-
-int save_file(char* endPoint, char* fileContent, int fileSize){
-	printf("save_file called\n");
-	struct file_data *newFile;
-	newFile = (struct file_data*)malloc(sizeof(struct file_data));
-	newFile->data = (void*)malloc(fileSize);
-	printf("newFile allocated!\n");
-	printf("\n\nendPoint: %s\n\n",endPoint);
-	newFile->size = fileSize;
-	printf("strlen(fileContent): %d   fileSize: %d\n",strlen(fileContent), fileSize);
-	memcpy(newFile->data, fileContent, fileSize);
-	
-	file_write(endPoint, newFile);
+void resp_500(int fd)
+{
+	char body[] = "500 Internal Server Error\n";
+	send_response(fd, "HTTP/1.1 500 INTERNAL SERVER ERROR", "text/plain", body, strlen(body));
 }
 
-void post_save(int fd, char* savePath, char* request, int bytes_recvd){
-	printf("request type is POST!\n");
-	printf("request: %s\n",request);
-	char* startOfBody = find_start_of_body(request, bytes_recvd);
-	int fileSize = bytes_recvd - (startOfBody-request);
-	printf("startOfBody: %s\n",startOfBody);
-	printf("fileSize: %d\n",fileSize);
-	printf("savePath: %s\n",savePath);
-	save_file(savePath, startOfBody, fileSize);
+// A directory listing being drawn as the client takes it
+struct listing {
+	struct chunk_writer w;
+	struct indexpage *page;
+	struct sharded_cache *cache; // To cache the listing in once it's all drawn
+	char path[1100];
+	unsigned long generation;
+};
 
-	//send response. application/json {"status":"ok"}
-	char returnStatus[] = "{\"status\":\"ok\"}\n";
-	char content_type[] = "application/json";
-	printf("content_type: %s\n",content_type);
-	printf("return Status: %s\n",returnStatus);
-	printf("return len: %d\n",strlen(returnStatus));
-	send_response(fd, "HTTP/1.1 200 OK", content_type, returnStatus, strlen(returnStatus));
-}
+/**
+ * Producer: draw and send the next piece of a directory listing
+ */
+int produce_listing(int fd, void *arg)
+{
+	struct listing *l = arg;
 
-void handle_get(int fd, char* endPoint, struct cache *cache){
-	printf("_____\n");
-	printf("handle_get(%s) %d   %d\n",endPoint, strlen(endPoint), strlen("/"));
-	printf("_____\n");
-	if((strlen(endPoint)==strlen("/d20"))&&(strncmp(endPoint, "/d20", strlen(endPoint))==0)){
-		printf("endPoint is /d20!\n");
-		get_d20(fd);
-	}
-	else if(strlen(endPoint)==strlen("/")){
-		printf("serving index page!\n");
-		char filePath[1100] = "";
-		sprintf(filePath, "%s%s",SERVER_ROOT, "/index.html");
-		printf("filePath: %s\n",filePath);
-		get_file(fd, cache, filePath);
+	(void)fd;
+	if(indexpage_draw(l->page, chunk_write, &l->w)){
+		return l->w.failed ? -1 : 1;
+	}
+	return send_chunked_end(&l->w);
+}
+
+/**
+ * Cache a listing that went out in full, and free it
+ */
+void listing_done(void *arg, int completed)
+{
+	struct listing *l = arg;
+
+	if(completed && l->w.saved != NULL){
+		struct cache_key key;
+		cache_key_init(&key, l->path);
+		struct cache_entry *entry = sharded_cache_put_file(l->cache, &key, "text/html", l->w.saved, l->w.savedLen, time(NULL), NULL, 0, l->generation);
+		if(entry != NULL){
+			cache_release(entry);
+		}
+	}
+	indexpage_close(l->page);
+	free(l->w.saved);
+	free(l);
+}
+
+void get_directory(int fd, struct sharded_cache *cache, char *request_path, struct http_request *req){
+	struct cache_key key;
+	cache_key_init(&key, request_path);
+	unsigned long generation = sharded_cache_generation(cache, &key);
+	struct cache_entry *entry = get_cached(cache, &key);
+	if(entry!=NULL){
+		struct entity e;
+		entry_entity(entry, req, &e);
+		send_entity(fd, req, &e);
+		cache_release(entry);
+		return;
+	}
+	
+	// Sent a chunk at a time as it is drawn, so a huge directory still fits
+	struct listing *l = malloc(sizeof *l);
+	if(l==NULL){
+		resp_500(fd);
+		return;
+	}
+	l->page = indexpage_open(request_path);
+	if(l->page==NULL){
+		free(l);
+		resp_500(fd);
+		return;
+	}
+	l->cache = cache;
+	snprintf(l->path, sizeof l->path, "%s", request_path);
+	l->generation = generation;
+	
+	send_chunked_headers(&l->w, fd, "HTTP/1.1 200 OK", "text/html");
+	l->w.savedCap = cache->max_object;
+	l->w.saved = malloc(l->w.savedCap);
+	conn_produce(fd, produce_listing, l, listing_done);
+}
+
+/**
+ * Tidy up a request path in place: collapse repeated slashes and resolve
+ * "." and ".." segments, never climbing above "/"
+ *
+ * Cached responses are dropped by path when files change, so each file
+ * must have only one path to be cached under. A trailing slash is kept.
+ *
+ * Returns 0, or -1 if a ".." had to be stopped at "/".
+ */
+int normalize_path(char *path)
+{
+	int rv = 0;
+	char *in = path, *out = path;
+
+	while(*in != '\0'){
+		if(*in != '/'){
+			*out++ = *in++;
+			continue;
+		}
+		while(*in == '/'){
+			in++;
+		}
+		if(in[0] == '.' && (in[1] == '/' || in[1] == '\0')){
+			in++;
+			continue;
+		}
+		if(in[0] == '.' && in[1] == '.' && (in[2] == '/' || in[2] == '\0')){
+			in += 2;
+			if(out == path){
+				rv = -1;
+			}
+			while(out > path && *--out != '/'){ // back up over the last segment
+			}
+			continue;
+		}
+		*out++ = '/';
+	}
+	if(out == path){
+		*out++ = '/';
+	}
+	*out = '\0';
+	return rv;
+}
+
+/**
+ * Build the path a POST to endPoint saves to
+ *
+ * Returns 0, or -1 if endPoint isn't somewhere under SERVER_ROOT that a
+ * file could be saved to, or is named like an unfinished upload.
+ */
+int get_save_path(struct strview endPoint, char *savePath, int size)
+{
+	char path[1000];
+	strview_copy(endPoint, path, sizeof path);
+	if(path[0] != '/' || normalize_path(path) < 0 || path[strlen(path)-1] == '/' || file_is_upload_tmp(path)){
+		return -1;
+	}
+	snprintf(savePath, size, "%s%s", SERVER_ROOT, path);
+	return 0;
+}
+
+/**
+ * Body sink: write the next piece of a streamed upload
+ */
+int upload_sink(void *arg, char *data, int len)
+{
+	return file_upload_write(arg, data, len);
+}
+
+/**
+ * Body hook: start streaming POST bodies straight to disk
+ *
+ * Runs as soon as the headers are in, so the body never has to fit in the
+ * connection's input buffer.
+ */
+void start_upload(struct conn *c)
+{
+	if(!strview_eq(c->req.method, "POST")){
+		return;
+	}
+
+	char savePath[1100] = "";
+	if(get_save_path(c->req.path, savePath, sizeof savePath) < 0){
+		return; // refused once the request is in
+	}
+
+	c->upload = file_upload_open(savePath);
+	if(c->upload == NULL){
+		return;
+	}
+	c->req.body_sink = upload_sink;
+	c->req.body_sink_arg = c->upload;
+}
+
+void post_save(int fd, char* savePath, struct strview body){
+	// A streamed body is already on disk; otherwise it's all in body
+	struct conn *c = conn_get(fd);
+	struct file_upload *upload = (c != NULL) ? c->upload : NULL;
+
+	if(upload != NULL){
+		c->upload = NULL;
+	}
+	else{
+		upload = file_upload_open(savePath);
+		if(upload == NULL){
+			resp_500(fd);
+			return;
+		}
+		if(file_upload_write(upload, body.p, body.len) < 0){
+			file_upload_abort(upload);
+			resp_500(fd);
+			return;
+		}
+	}
+
+	if(file_upload_commit(upload) < 0){
+		resp_500(fd);
+		return;
+	}
+
+	//send response. application/json {"status":"ok"}
+	char returnStatus[] = "{\"status\":\"ok\"}\n";
+	char content_type[] = "application/json";
+	send_response(fd, "HTTP/1.1 200 OK", content_type, returnStatus, strlen(returnStatus));
+}
+
+/**
+ * Work out where under SERVER_ROOT a GET of a (normalized) path is served
+ * from, which is also what its response is cached under
+ */
+void get_file_path(char *endPoint, char *filePath, int size)
+{
+	if(strlen(endPoint)==strlen("/")){
+		snprintf(filePath, size, "%s%s", SERVER_ROOT, "/index.html");
 	}
 	else{
+		snprintf(filePath, size, "%s%s", SERVER_ROOT, endPoint);
+	}
+}
+
+void handle_get(int fd, char* endPoint, struct sharded_cache *cache, struct http_request *req){
+	normalize_path(endPoint);
+	if((strlen(endPoint)==strlen("/d20"))&&(strncmp(endPoint, "/d20", strlen(endPoint))==0)){
+		get_d20(fd);
+	}
+	else if(strlen(endPoint)==strlen("/")){
 		char filePath[1100] = "";
-		sprintf(filePath, "%s%s",SERVER_ROOT, endPoint);
-		printf("is directory: %d\n",isdirectory(filePath));
+		get_file_path(endPoint, filePath, sizeof filePath);
+		get_file(fd, cache, filePath, req);
+	}
+	else{
+		char filePath[1100] = "";
+		get_file_path(endPoint, filePath, sizeof filePath);
 		if(isdirectory(filePath)==1){ //when filePath is a directory
-			get_directory(fd, cache, filePath);
+			get_directory(fd, cache, filePath, req);
 		}
 		else{ //either when filePath is a file(isdirectory==0) or when file or directory does not exist(isdirectory==-1)
-			get_file(fd, cache, filePath);
+			get_file(fd, cache, filePath, req);
 		}
 	}
 }
 
 /**
- * Handle HTTP request and send response
+ * Decide whether to keep the connection open after answering this request
+ *
+ * HTTP/1.1 stays open unless the client says "Connection: close"; HTTP/1.0
+ * only stays open if it asks for "Connection: keep-alive".
  */
-void handle_http_request(struct pthread_args *args)
+int wants_keep_alive(struct http_request *req)
 {
-	int fd = args->fd;
-	struct cache *cache = args->cache;
-	
-    const int request_buffer_size = 65536; // 64K
-    char request[request_buffer_size];
+	struct strview *connection = http_get_header(req, "Connection");
 
-    // Read request
-    int bytes_recvd = recv(fd, request, request_buffer_size - 1, 0);
-	printf("bytes_recvd: %d\n",bytes_recvd);
-	printf("request:   %s\n",request);
-	
-    if (bytes_recvd < 0) {
-        perror("recv");
-        return;
-    }
+	if(strview_eq(req->version, "HTTP/1.1")){
+		return !(connection != NULL && strview_contains(*connection, "close"));
+	}
+	return connection != NULL && strview_contains(*connection, "keep-alive");
+}
 
-    // Read the first two components of the first line of the request 
- 
-    // If GET, handle the get endpoints
+/**
+ * Count a request against its connection, and decide whether to keep the
+ * connection open after answering it
+ */
+void count_request(int fd, struct http_request *req)
+{
+	struct conn *c = conn_get(fd);
 
-    //    Check if it's /d20 and handle that special case
-    //    Otherwise serve the requested file by calling get_file()
-	int readCnt=0;
-	
-	char requestType[10] = "", endPoint[1000] = "", version[10] = "";
-	
-	sscanf(request, " %s %s ", requestType, endPoint);
-	puts(requestType);
-	puts(endPoint);
-	//printf("requestType:   %s", requestType);
-	printf("endPoint:   %s\n", endPoint);
-	if(strncmp(requestType, "GET", strlen("GET"))==0){
-		printf("request type is GET!\n");
-		handle_get(fd, endPoint, cache);
-	}
-	else if(strncmp(requestType, "POST", strlen("POST"))==0){
-		printf("request type is POST!\n");
-		/* if(strstr(endPoint, "/save/")==endPoint){ //if endPoint starts with "/save/"
-			char* savePath = (char*)malloc(strlen("./serverroot/")+strlen(endPoint)-strlen("/save/"));
-			strncpy(savePath, "./serverroot/", strlen("./serverroot/"));
-			strcat(savePath,(strstr(endPoint, "/save/")+strlen("/save/")));
-			printf("savePath: %s\n",savePath);
-			post_save(fd, savePath, request, bytes_recvd);
-			free(savePath);
-		}*/
-		char savePath[100] = "";
-		// char* savePath = (char*)malloc(strlen("./serverroot")+strlen(endPoint));
-		printf("savePath len: %d\n",strlen(savePath));
-		for(int i=0;i<strlen(savePath);i++){
-			savePath[i] = 0;
-		}
-		strncpy(savePath, "./serverroot", strlen("./serverroot"));
-		for(int i=0;i<strlen(savePath);i++){
-			printf("%c",savePath[i]);
-		}
-		printf("\n");
-		printf("savePath: %s\n",savePath);
-		strncpy(savePath+strlen("./serverroot"), endPoint, strlen(endPoint));
-		printf("endPoint: %s\n",endPoint);
-		printf("savePath: %s\n",savePath);
-		post_save(fd, savePath, request, bytes_recvd);
+	if(c != NULL){
+		c->requests++;
+		c->keep_alive = wants_keep_alive(req) && c->requests < conn_max_requests;
 	}
-	
-	//close socket and remove thread from clnt_threads
-	printf("closing socket %d!\n",fd);
-	close(fd);
-	
-	pthread_mutex_lock(&mutx);
-	for(int i=0;i<clnt_cnt;i++){
-		if(fd==clnt_socks[i]){
-			while(i++<clnt_cnt-1){ //pull sockets to the front by 1
-				clnt_socks[i] = clnt_socks[i+1];
+}
+
+/**
+ * Send a 403 response
+ */
+void resp_403(int fd)
+{
+	char body[] = "403 Forbidden\n";
+	send_response(fd, "HTTP/1.1 403 FORBIDDEN", "text/plain", body, strlen(body));
+}
+
+/**
+ * Send a 501 response for a method we don't serve
+ */
+void resp_501(int fd)
+{
+	char body[] = "501 Not Implemented\n";
+	send_response(fd, "HTTP/1.1 501 NOT IMPLEMENTED", "text/plain", body, strlen(body));
+}
+
+/**
+ * Send a 413 response for a body too big to take without streaming it
+ */
+void resp_413(int fd)
+{
+	char body[] = "413 Payload Too Large\n";
+	send_response(fd, "HTTP/1.1 413 PAYLOAD TOO LARGE", "text/plain", body, strlen(body));
+}
+
+/**
+ * Send a 431 response for headers too big to buffer
+ */
+void resp_431(int fd)
+{
+	char body[] = "431 Request Header Fields Too Large\n";
+	send_response(fd, "HTTP/1.1 431 REQUEST HEADER FIELDS TOO LARGE", "text/plain", body, strlen(body));
+}
+
+/**
+ * Send a 400 response for a request we couldn't parse
+ */
+void resp_400(int fd)
+{
+	char body[] = "400 Bad Request\n";
+	send_response(fd, "HTTP/1.1 400 BAD REQUEST", "text/plain", body, strlen(body));
+}
+
+/**
+ * Dispatch a parsed request and send the response
+ */
+void handle_request(int fd, struct sharded_cache *cache, struct http_request *req)
+{
+	struct conn *c = conn_get(fd);
+
+	if(req->state == PARSE_ERROR){
+		if(c != NULL){
+			c->keep_alive = 0;
+		}
+		if(req->body_sink_failed){ // our fault, not the client's
+			resp_500(fd);
+			return;
+		}
+		if(req->too_large){
+			if(req->header_len > 0){
+				resp_413(fd);
 			}
-			break;
+			else{
+				resp_431(fd);
+			}
+			return;
 		}
+		resp_400(fd);
+		return;
+	}
+
+	count_request(fd, req);
+
+	char endPoint[1000] = "";
+	strview_copy(req->path, endPoint, sizeof endPoint);
+
+	if(strview_eq(req->method, "GET")){
+		handle_get(fd, endPoint, cache, req);
+	}
+	else if(strview_eq(req->method, "POST")){
+		char savePath[1100] = "";
+		if(get_save_path(req->path, savePath, sizeof savePath) < 0){
+			resp_403(fd);
+			return;
+		}
+		post_save(fd, savePath, req->body);
+	}
+	else{
+		if(c != NULL){
+			c->keep_alive = 0;
+		}
+		resp_501(fd);
 	}
-	clnt_cnt--;
-	pthread_mutex_unlock(&mutx);
 }
 
 /**
- * Main
+ * Event loop callback: the loop has parsed a whole request for fd
  */
-int main(void)
+void handle_event_request(int fd, struct http_request *req, void *arg)
 {
-    int newfd;  // listen on sock_fd, new connection on newfd
-    struct sockaddr_storage their_addr; // connector's address information
-    char s[INET6_ADDRSTRLEN];
+	handle_request(fd, (struct sharded_cache *)arg, req);
+}
 
-    struct cache *cache = cache_create(10, 1);
+/**
+ * io_uring callback: answer a request on the ring thread if it's a cache
+ * hit, which needs nothing from the disk
+ *
+ * Everything else is left to handle_event_request() on a worker: misses,
+ * which open and read files; mapped entries, whose file has to be checked
+ * with stat(); and anything that isn't a GET.
+ *
+ * Returns 0 if the request was answered, or -1 to pass it on.
+ */
+int try_cached_request(int fd, struct http_request *req, void *arg)
+{
+	struct sharded_cache *cache = arg;
+	char endPoint[1000] = "";
+	char filePath[1100] = "";
+	struct cache_key key;
 
-	pthread_mutex_init(&mutx, NULL);
-		
-	
-    // Get a listening socket
-    int listenfd = get_listener_socket(PORT);
+	if(req->state == PARSE_ERROR || !strview_eq(req->method, "GET")){
+		return -1;
+	}
+	strview_copy(req->path, endPoint, sizeof endPoint);
+	normalize_path(endPoint);
+	if(strcmp(endPoint, "/d20")==0){
+		return -1;
+	}
 
-    if (listenfd < 0) {
-        fprintf(stderr, "webserver: fatal error getting listening socket\n");
-        exit(1);
-    }
+	get_file_path(endPoint, filePath, sizeof filePath);
+	cache_key_init(&key, filePath);
+	struct cache_entry *entry = get_cached(cache, &key);
+	if(entry == NULL){
+		return -1;
+	}
+	if(entry->mapped){
+		cache_release(entry);
+		return -1;
+	}
+
+	count_request(fd, req);
+
+	struct entity e;
+	entry_entity(entry, req, &e);
+	send_entity(fd, req, &e);
+	cache_release(entry);
+	return 0;
+}
+
+/**
+ * Handle HTTP requests on a connection and send responses
+ *
+ * Runs on a pool worker, for a newly accepted fd or one the poller has seen
+ * become readable again. Keeps answering requests off the same socket while
+ * they keep coming; once it would have to wait for the client, the
+ * connection is parked with idle_poller and the worker moves on.
+ */
+void handle_http_request(int fd, void *arg)
+{
+	struct sharded_cache *cache = arg;
+	struct conn *c = conn_get(fd);
+
+	if(c == NULL){
+		c = conn_open(fd, 0);
+	}
+	if(c == NULL){
+		close(fd);
+		return;
+	}
 
-    printf("webserver: waiting for connections on port %s...\n", PORT);
+	while(1){
+		int request_len;
+
+		// Read until a whole request is buffered
+		while((request_len = conn_next_request(c)) == 0){
+			if(conn_reserve(c) < 0){
+				goto done;
+			}
+			int bytes_recvd = recv(fd, c->inbuf + c->inlen, c->incap - 1 - c->inlen, MSG_DONTWAIT);
+			if(bytes_recvd < 0 && errno == EINTR){
+				continue;
+			}
+			// Nothing more yet: wait in the poller rather than on this worker
+			if(bytes_recvd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+				poller_park(idle_poller, c);
+				return;
+			}
+			if(bytes_recvd <= 0){
+				if(bytes_recvd < 0){
+					perror("recv");
+				}
+				goto done;
+			}
+			c->inlen += bytes_recvd;
+			c->inbuf[c->inlen] = '\0';
+		}
+
+		c->reqlen = request_len;
+		handle_request(fd, cache, &c->req);
+
+		if(!c->keep_alive){
+			break;
+		}
+		conn_reset(c);
+	}
+
+done:
+	conn_close(c);
+}
+
+/**
+ * Accept connections on listenfd forever, handing each one to pool
+ */
+void accept_loop(int listenfd, struct threadpool *pool)
+{
+    int newfd;  // listen on sock_fd, new connection on newfd
+    struct sockaddr_storage their_addr; // connector's address information
 
     // This is the main loop that accepts incoming connections and
     // responds to the request. The main parent process
@@ -454,31 +1318,268 @@ int main(void)
             continue;
         }
 
-        // Print out a message that we got the connection
-        inet_ntop(their_addr.ss_family,
-            get_in_addr((struct sockaddr *)&their_addr),
-            s, sizeof s);
-        printf("server: got connection from %s\n", s);
-        
         // newfd is a new socket descriptor for the new connection.
         // listenfd is still listening for new connections.
-		
-		if(clnt_cnt < MX_CLIENTS){
-			pthread_mutex_lock(&mutx);
-			clnt_socks[clnt_cnt++] = newfd;
-			pthread_mutex_unlock(&mutx);
-			
-			struct pthread_args args;
-			args.fd = newfd;
-			args.cache = cache;
+		threadpool_submit(pool, newfd);
+    }
+}
+
+/**
+ * Start the worker pool, and the poller that holds its idle connections
+ */
+struct threadpool *start_pool(int workers, int queue_size, struct sharded_cache *cache)
+{
+	struct threadpool *pool = threadpool_create(workers, queue_size, handle_http_request, cache);
+
+	if(pool == NULL){
+		fprintf(stderr, "webserver: fatal error creating thread pool\n");
+		exit(1);
+	}
+
+	idle_poller = poller_create(pool);
+
+	if(idle_poller == NULL){
+		fprintf(stderr, "webserver: fatal error creating poller\n");
+		exit(1);
+	}
+	printf("webserver: %d worker threads\n", pool->nthreads);
 
-			pthread_t t_id;
-			pthread_create(&t_id, NULL, handle_http_request, (void*)&args);
-			pthread_detach(t_id);
+	return pool;
+}
+
+struct shard_args {
+	char *mode;
+	struct sharded_cache *cache;
+	struct threadpool *pool; // Shared by every shard in pool mode
+};
+
+/**
+ * Listener shard: owns its own SO_REUSEPORT socket and accept loop
+ */
+void *shard_main(void *vargs)
+{
+	struct shard_args *args = vargs;
+	int listenfd = get_reuseport_listener_socket(PORT);
+
+	if(listenfd < 0){
+		fprintf(stderr, "webserver: fatal error getting listening socket\n");
+		exit(1);
+	}
+
+	if(strcmp(args->mode, "epoll")==0){
+		eventloop_run(listenfd, handle_event_request, args->cache);
+		fprintf(stderr, "webserver: event loop exited\n");
+		exit(1);
+	}
+	if(strcmp(args->mode, "uring")==0){
+		uring_run(listenfd, try_cached_request, handle_event_request, args->cache);
+		fprintf(stderr, "webserver: io_uring loop exited\n");
+		exit(1);
+	}
+
+	accept_loop(listenfd, args->pool);
+	return NULL;
+}
+
+/**
+ * Start one listener shard per worker and wait on them
+ */
+void run_shards(char *mode, int workers, int queue_size, struct sharded_cache *cache)
+{
+	static struct shard_args args;
+	args.mode = mode;
+	args.cache = cache;
+	args.pool = NULL;
+
+	if(workers < 1){
+		workers = threadpool_default_size();
+	}
+	if(strcmp(mode, "pool")==0){
+		args.pool = start_pool(workers, queue_size, cache);
+	}
+	pthread_t *shards = malloc(workers * sizeof(pthread_t));
+
+	printf("webserver: %d SO_REUSEPORT listeners on port %s (%s mode)...\n", workers, PORT, mode);
+
+	for(int i=0;i<workers;i++){
+		if(pthread_create(&shards[i], NULL, shard_main, &args) != 0){
+			perror("pthread_create");
+			exit(1);
 		}
+	}
+	for(int i=0;i<workers;i++){
+		pthread_join(shards[i], NULL);
+	}
+	free(shards);
+}
+
+/**
+ * Print command line usage
+ */
+void usage(char *progname)
+{
+	fprintf(stderr, "usage: %s [-m pool|epoll|uring] [-w workers] [-q queue_size] [-s]\n", progname);
+	fprintf(stderr, "       %*s [-k max_requests] [-t idle_timeout] [-c cache_size] [-o max_object]\n", (int)strlen(progname), "");
+	fprintf(stderr, "       %*s [-e lru|clock|arc|tinylfu] [-a max_age] [-M]\n", (int)strlen(progname), "");
+	fprintf(stderr, "  -m  server mode: worker thread pool (default), one epoll event loop, or\n");
+	fprintf(stderr, "      one io_uring loop\n");
+	fprintf(stderr, "  -w  pool worker threads; in uring mode, threads for requests that would\n");
+	fprintf(stderr, "      block the ring (default: one per core)\n");
+	fprintf(stderr, "  -q  accepted connections that may wait for a worker (default: 64 per worker)\n");
+	fprintf(stderr, "  -s  sharded listeners: each worker gets its own SO_REUSEPORT socket and\n");
+	fprintf(stderr, "      accept loop (an event loop each in epoll and uring modes; in pool mode\n");
+	fprintf(stderr, "      they all feed the one pool)\n");
+	fprintf(stderr, "  -k  requests served per keep-alive connection (default: %d, 1 disables keep-alive)\n", conn_max_requests);
+	fprintf(stderr, "  -t  seconds an idle connection is kept open (default: %d)\n", conn_idle_timeout);
+	fprintf(stderr, "  -c  memory for cached responses, e.g. 512K or 64M; must be above 0\n");
+	fprintf(stderr, "      (default: %dM)\n", CACHE_BYTES / (1024*1024));
+	fprintf(stderr, "  -o  largest file worth caching; bigger ones are sent from disk (default: %dK)\n", MAX_CACHED_FILE / 1024);
+	fprintf(stderr, "  -e  cache eviction policy: least recently used (default); clock, close to\n");
+	fprintf(stderr, "      LRU but with hits that only set a flag; or arc or tinylfu\n");
+	fprintf(stderr, "      to keep popular files cached through crawls and other scans\n");
+	fprintf(stderr, "  -a  seconds a cached response is trusted, -1 for until its file changes\n");
+	fprintf(stderr, "      (default: -1 if file changes can be watched, otherwise %d)\n", TIME_DIFF);
+	fprintf(stderr, "  -M  cache files as read-only mmaps, sharing the kernel's page cache instead\n");
+	fprintf(stderr, "      of keeping copies\n");
+}
 
+/**
+ * Parse a size like 4096, 64K or 16M
+ *
+ * Returns -1 if it isn't one.
+ */
+long parse_size(char *str)
+{
+	char *end;
+	long size = strtol(str, &end, 10);
+
+	if(end == str || size < 0){
+		return -1;
+	}
+	switch(*end){
+		case 'k': case 'K': size *= 1024; end++; break;
+		case 'm': case 'M': size *= 1024*1024; end++; break;
+		case 'g': case 'G': size *= 1024*1024*1024L; end++; break;
+	}
+	return *end == '\0' ? size : -1;
+}
+
+/**
+ * Main
+ */
+int main(int argc, char *argv[])
+{
+	char *mode = "pool";
+	int workers = 0, queue_size = 0, sharded = 0;
+	long cache_bytes = CACHE_BYTES, max_object = MAX_CACHED_FILE;
+	struct cache_policy *policy = &cache_lru_policy;
+	int max_age_set = 0;
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:w:q:sk:t:c:o:e:a:M")) != -1){
+		switch(opt){
+			case 'm':
+				mode = optarg;
+				break;
+			case 'w':
+				workers = atoi(optarg);
+				break;
+			case 'q':
+				queue_size = atoi(optarg);
+				break;
+			case 's':
+				sharded = 1;
+				break;
+			case 'k':
+				conn_max_requests = atoi(optarg);
+				break;
+			case 't':
+				conn_idle_timeout = atoi(optarg);
+				break;
+			case 'c':
+				cache_bytes = parse_size(optarg);
+				break;
+			case 'o':
+				max_object = parse_size(optarg);
+				break;
+			case 'e':
+				policy = cache_policy_find(optarg);
+				break;
+			case 'a':
+				cache_max_age = atoi(optarg);
+				max_age_set = 1;
+				break;
+			case 'M':
+				map_files = 1;
+				break;
+			default:
+				usage(argv[0]);
+				exit(1);
+		}
+	}
+	if((strcmp(mode, "pool")!=0 && strcmp(mode, "epoll")!=0 && strcmp(mode, "uring")!=0) ||
+		cache_bytes < 1 || max_object < 0 || max_object > INT_MAX || policy == NULL){
+		usage(argv[0]);
+		exit(1);
+	}
+	if(strcmp(mode, "uring")==0 && !uring_supported()){
+		fprintf(stderr, "webserver: io_uring is not available here, falling back to epoll\n");
+		mode = "epoll";
+	}
+
+    struct sharded_cache *cache = sharded_cache_create(CACHE_SHARDS, cache_bytes, max_object, 0);
+	if(sharded_cache_set_policy(cache, policy) < 0){
+		fprintf(stderr, "webserver: can't set up the %s cache policy\n", policy->name);
+		exit(1);
+	}
+
+	// Drop cached copies as soon as their files change
+	if(watch_start(SERVER_ROOT, invalidate_path, cache) == NULL && !max_age_set){
+		fprintf(stderr, "webserver: can't watch %s for changes, caching for %d seconds\n", SERVER_ROOT, TIME_DIFF);
+		cache_max_age = TIME_DIFF;
+	}
+
+	// A client hanging up mid-response shouldn't take the server down
+	signal(SIGPIPE, SIG_IGN);
+
+	// Nor should a cached file being truncated
+	if(map_files){
+		file_map_guard();
+	}
+
+	conn_body_hook = start_upload;
+	uring_workers = workers;
+
+	if(sharded){
+		run_shards(mode, workers, queue_size, cache);
+		exit(1);
+	}
+	
+    // Get a listening socket
+    int listenfd = get_listener_socket(PORT);
+
+    if (listenfd < 0) {
+        fprintf(stderr, "webserver: fatal error getting listening socket\n");
+        exit(1);
     }
-	pthread_mutex_destroy(&mutx);
+
+    printf("webserver: waiting for connections on port %s (%s mode)...\n", PORT, mode);
+
+	if(strcmp(mode, "epoll")==0){
+		eventloop_run(listenfd, handle_event_request, cache);
+		fprintf(stderr, "webserver: event loop exited\n");
+		exit(1);
+	}
+	if(strcmp(mode, "uring")==0){
+		uring_run(listenfd, try_cached_request, handle_event_request, cache);
+		fprintf(stderr, "webserver: io_uring loop exited\n");
+		exit(1);
+	}
+
+	struct threadpool *pool = start_pool(workers, queue_size, cache);
+
+	accept_loop(listenfd, pool);
+	sharded_cache_free(cache);
 
     // Unreachable code(hopefully)
 
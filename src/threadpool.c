@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "threadpool.h"
+
+/**
+ * Number of workers to use when none is configured: one per online core
+ */
+int threadpool_default_size(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n < 1 ? 1 : (int)n;
+}
+
+/**
+ * Worker main loop: pop an fd, handle it, repeat
+ */
+static void *threadpool_worker(void *vpool)
+{
+    struct threadpool *pool = vpool;
+
+    while (1) {
+        pthread_mutex_lock(&pool->lock);
+
+        while (pool->count == 0) {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+
+        int fd = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->count--;
+
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->handler(fd, pool->arg);
+    }
+
+    return NULL;
+}
+
+/**
+ * Create a pool and start its workers
+ *
+ * nthreads:   number of workers (0 for one per core)
+ * queue_size: how many accepted fds may wait for a worker (0 for default)
+ */
+struct threadpool *threadpool_create(int nthreads, int queue_size, fd_handler handler, void *arg)
+{
+    if (nthreads < 1) {
+        nthreads = threadpool_default_size();
+    }
+
+    if (queue_size < 1) {
+        queue_size = nthreads * 64;
+    }
+
+    struct threadpool *pool = malloc(sizeof *pool);
+
+    if (pool == NULL) return NULL;
+
+    pool->threads = malloc(nthreads * sizeof(pthread_t));
+    pool->queue = malloc(queue_size * sizeof(int));
+
+    if (pool->threads == NULL || pool->queue == NULL) {
+        free(pool->threads);
+        free(pool->queue);
+        free(pool);
+        return NULL;
+    }
+
+    pool->nthreads = nthreads;
+    pool->queue_size = queue_size;
+    pool->head = pool->tail = pool->count = 0;
+    pool->handler = handler;
+    pool->arg = arg;
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&pool->threads[i], NULL, threadpool_worker, pool) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+
+    return pool;
+}
+
+/**
+ * Hand an accepted socket to the pool
+ *
+ * Blocks while the queue is full, which pushes back on the accept loop and
+ * leaves further clients waiting in the kernel's listen backlog.
+ */
+void threadpool_submit(struct threadpool *pool, int fd)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->count == pool->queue_size) {
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+
+    pool->queue[pool->tail] = fd;
+    pool->tail = (pool->tail + 1) % pool->queue_size;
+    pool->count++;
+
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+}
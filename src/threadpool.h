@@ -0,0 +1,28 @@
+#ifndef _THREADPOOL_H_
+#define _THREADPOOL_H_
+#include <pthread.h>
+
+typedef void (*fd_handler)(int fd, void *arg);
+
+// Fixed set of workers pulling accepted sockets off a bounded queue
+struct threadpool {
+    pthread_t *threads;
+    int nthreads;
+
+    int *queue; // Ring buffer of accepted fds
+    int queue_size;
+    int head, tail, count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+
+    fd_handler handler;
+    void *arg;
+};
+
+extern int threadpool_default_size(void);
+extern struct threadpool *threadpool_create(int nthreads, int queue_size, fd_handler handler, void *arg);
+extern void threadpool_submit(struct threadpool *pool, int fd);
+
+#endif
@@ -0,0 +1,708 @@
+/**
+ * uring.c -- io_uring event loop
+ *
+ * Same job as eventloop.c, but accept, recv and send are submitted to an
+ * io_uring instead of being issued as syscalls. Every submission queued
+ * while handling one batch of completions goes to the kernel in a single
+ * io_uring_enter(), which also waits for the next batch.
+ *
+ * Each connection has at most one operation in flight (a recv, a send, or a
+ * read of the file being sent), so its buffers are never moved while the
+ * kernel is using them. Files go out a URING_FILE_CHUNK at a time: read into
+ * the output buffer by the ring, then sent, so a slow disk doesn't stall the
+ * loop. Responses made by a producer (see conn_produce()) are asked for more
+ * each time a send completes with the output buffer drained. Every recv is
+ * linked to a timeout, which is how idle keep-alive connections are closed.
+ * If accept runs out of fds it's retried after a short timeout, not at once.
+ *
+ * The ring thread only answers requests that can be answered without
+ * blocking: in practice, cache hits. Anything that would touch the disk (a
+ * cache miss, a directory listing, an upload, more of a produced response)
+ * is handed to a shared pool of worker threads, so one slow open() or
+ * read() doesn't hold up every other connection on the ring. While a worker
+ * has a connection the ring has nothing in flight for it and doesn't touch
+ * it; the worker queues its output as usual, then posts the connection
+ * back through an eventfd the ring keeps a read pending on.
+ *
+ * Talks to the kernel directly so there is no liburing dependency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include "conn.h"
+#include "threadpool.h"
+#include "uring.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+#define URING_ENTRIES 4096
+#define URING_FILE_CHUNK 65536 // Bytes of a file read per round trip
+#define URING_ACCEPT_BACKOFF_MS 100 // Pause in accepting when we're out of fds
+
+// What a completion was for, packed into the top of user_data
+enum uring_op {
+    OP_ACCEPT = 1,
+    OP_RECV,
+    OP_SEND,
+    OP_READ,
+    OP_TIMEOUT,
+    OP_ACCEPT_RETRY,
+    OP_WAKE
+};
+
+#define USER_DATA(op, fd) (((uint64_t)(op) << 32) | (uint32_t)(fd))
+#define USER_OP(ud) ((int)((ud) >> 32))
+#define USER_FD(ud) ((int)((ud) & 0xffffffff))
+
+// Userspace view of the shared rings
+struct uring {
+    int fd;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    unsigned sq_pending; // Filled in but not yet handed to the kernel
+    struct io_uring_sqe *sqes;
+
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    struct __kernel_timespec idle_timeout;
+    struct __kernel_timespec accept_backoff;
+
+    request_try_handler try_handler; // Answers what it can on the ring thread
+    request_handler handler;         // Answers the rest on a worker
+    void *arg;
+
+    int wake_fd;        // eventfd workers poke when they hand connections back
+    uint64_t wake_count; // Where the pending read of it lands
+    pthread_mutex_t done_lock;
+    int *done;          // fds workers have finished with, for the ring to resume
+    int ndone, donecap;
+};
+
+int uring_workers = 0;
+
+static struct threadpool *workers; // Shared by every ring
+static pthread_once_t workers_once = PTHREAD_ONCE_INIT;
+static struct uring *conn_ring[MX_CONNS]; // Ring each handed-off fd goes back to
+
+/**
+ * Create the ring and map its queues into our address space
+ */
+static int uring_init(struct uring *r, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    char *cq = sq;
+
+    if (sq == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+
+        if (cq == MAP_FAILED) {
+            close(r->fd);
+            return -1;
+        }
+    }
+
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+
+    if (r->sqes == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->sq_entries = p.sq_entries;
+    r->sq_pending = 0;
+
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    return 0;
+}
+
+/**
+ * Hand pending submissions to the kernel, optionally waiting for completions
+ */
+static int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    unsigned to_submit = r->sq_pending;
+
+    r->sq_pending = 0;
+
+    while (1) {
+        int rv = syscall(__NR_io_uring_enter, r->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+        if (rv >= 0) return rv;
+        if (errno != EINTR) return -1;
+
+        // Anything interrupted was still consumed; just wait again
+        to_submit = 0;
+    }
+}
+
+/**
+ * Make sure n more submissions fit, pushing what we have if they don't
+ *
+ * Linked submissions must reach the kernel together, so reserve room for
+ * the whole chain before filling in the first one.
+ */
+static void uring_reserve(struct uring *r, unsigned n)
+{
+    unsigned tail = *r->sq_tail + r->sq_pending;
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (tail - head + n > r->sq_entries) {
+        __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+        uring_submit(r, 0);
+    }
+}
+
+/**
+ * Grab and clear the next free submission slot
+ */
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    uring_reserve(r, 1);
+
+    unsigned tail = *r->sq_tail + r->sq_pending;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    r->sq_array[index] = index;
+    r->sq_pending++;
+
+    memset(sqe, 0, sizeof *sqe);
+
+    return sqe;
+}
+
+/**
+ * Publish everything filled in by uring_get_sqe() so far
+ */
+static void uring_publish(struct uring *r)
+{
+    __atomic_store_n(r->sq_tail, *r->sq_tail + r->sq_pending, __ATOMIC_RELEASE);
+}
+
+static void queue_accept(struct uring *r, int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->user_data = USER_DATA(OP_ACCEPT, listenfd);
+}
+
+/**
+ * Accept again once the backoff has passed
+ *
+ * For when accept fails because we're out of fds or memory: retrying right
+ * away would just fail again, as fast as the ring can go, until some
+ * connection closes.
+ */
+static void queue_accept_retry(struct uring *r, int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&r->accept_backoff;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(OP_ACCEPT_RETRY, listenfd);
+}
+
+static void queue_wake(struct uring *r)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = r->wake_fd;
+    sqe->addr = (unsigned long)&r->wake_count;
+    sqe->len = sizeof r->wake_count;
+    sqe->user_data = USER_DATA(OP_WAKE, r->wake_fd);
+}
+
+/**
+ * Worker thread: answer a request, or produce more of a response, that
+ * would have blocked the ring
+ *
+ * Then hands the connection back to its ring to send what was queued.
+ */
+static void uring_work(int fd, void *arg)
+{
+    struct uring *r = conn_ring[fd];
+    struct conn *c = conn_get(fd);
+
+    (void)arg;
+
+    if (c->producer != NULL) {
+        conn_resume(c);
+    }
+    else {
+        r->handler(fd, &c->req, r->arg);
+    }
+
+    pthread_mutex_lock(&r->done_lock);
+
+    if (r->ndone == r->donecap) {
+        // Each fd is only ever here once, so this can't outgrow MX_CONNS
+        int cap = r->donecap ? r->donecap * 2 : 64;
+        int *p = realloc(r->done, cap * sizeof *p);
+
+        if (p == NULL) {
+            perror("realloc");
+            exit(1);
+        }
+
+        r->done = p;
+        r->donecap = cap;
+    }
+
+    r->done[r->ndone++] = fd;
+
+    pthread_mutex_unlock(&r->done_lock);
+
+    uint64_t one = 1;
+
+    if (write(r->wake_fd, &one, sizeof one) < 0) {
+        perror("write");
+    }
+}
+
+static void workers_start(void)
+{
+    workers = threadpool_create(uring_workers, MX_CONNS, uring_work, NULL);
+
+    if (workers == NULL) {
+        fprintf(stderr, "uring: can't start worker threads\n");
+        exit(1);
+    }
+}
+
+/**
+ * Hand a connection to a worker until it's ready to send again
+ *
+ * Never waits: the pool's queue has room for every fd there can be.
+ */
+static void uring_offload(struct uring *r, struct conn *c)
+{
+    c->state = CONN_HANDLING;
+    conn_ring[c->fd] = r;
+    threadpool_submit(workers, c->fd);
+}
+
+static void queue_recv(struct uring *r, struct conn *c)
+{
+    uring_reserve(r, 2);
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)(c->inbuf + c->inlen);
+    sqe->len = c->incap - 1 - c->inlen;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = USER_DATA(OP_RECV, c->fd);
+
+    // Cancels the recv above if nothing arrives in time
+    sqe = uring_get_sqe(r);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&r->idle_timeout;
+    sqe->len = 1;
+    sqe->user_data = USER_DATA(OP_TIMEOUT, c->fd);
+}
+
+static void queue_send(struct uring *r, struct conn *c)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (unsigned long)(c->outbuf + c->outoff);
+    sqe->len = c->outlen - c->outoff;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = USER_DATA(OP_SEND, c->fd);
+}
+
+static void queue_read(struct uring *r, struct conn *c)
+{
+    int len = c->file_remaining < URING_FILE_CHUNK ? c->file_remaining : URING_FILE_CHUNK;
+
+    if (c->outcap < len) {
+        char *p = realloc(c->outbuf, len);
+
+        if (p == NULL) {
+            conn_close(c);
+            return;
+        }
+
+        c->outbuf = p;
+        c->outcap = len;
+    }
+
+    c->outoff = c->outlen = 0;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = c->file_fd;
+    sqe->addr = (unsigned long)c->outbuf;
+    sqe->len = len;
+    sqe->off = c->file_off;
+    sqe->user_data = USER_DATA(OP_READ, c->fd);
+}
+
+/**
+ * Queue whatever the response still needs sent
+ *
+ * Returns 0 if everything has gone out already.
+ */
+static int queue_output(struct uring *r, struct conn *c)
+{
+    // The file has all gone out; send what was written behind it
+    if (c->outoff == c->outlen && c->file_fd >= 0 && c->file_remaining == 0) {
+        conn_file_done(c);
+    }
+
+    // Drained: a response still being produced can add more, on a worker
+    // since producing it may read the disk
+    if (c->outoff == c->outlen && c->file_fd < 0 && c->producer != NULL) {
+        uring_offload(r, c);
+        return 1;
+    }
+
+    if (c->outoff < c->outlen) {
+        queue_send(r, c);
+        return 1;
+    }
+
+    if (c->file_fd >= 0 && c->file_remaining > 0) {
+        queue_read(r, c);
+        return 1;
+    }
+
+    return 0;
+}
+
+static void conn_ready(struct uring *r, struct conn *c);
+
+/**
+ * Carry on with a connection once its response is queued
+ *
+ * Sends it, or if there's nothing to send, moves on to the next request.
+ */
+static void conn_answered(struct uring *r, struct conn *c)
+{
+    c->state = CONN_WRITING;
+
+    if (queue_output(r, c)) {
+        return;
+    }
+
+    if (!c->keep_alive) {
+        conn_close(c);
+        return;
+    }
+
+    conn_reset(c);
+    conn_ready(r, c);
+}
+
+/**
+ * Handle whatever requests are buffered, then queue the next operation
+ *
+ * Loops for pipelined requests that are answered on the spot with no
+ * output, otherwise stops at the first send or hand-off to a worker; the
+ * send completion, or the worker handing the connection back, brings us
+ * back here.
+ */
+static void conn_ready(struct uring *r, struct conn *c)
+{
+    while (1) {
+        int len = conn_next_request(c);
+
+        if (len == 0) {
+            if (conn_reserve(c) < 0) {
+                conn_close(c);
+                return;
+            }
+
+            queue_recv(r, c);
+            return;
+        }
+
+        c->reqlen = len;
+
+        if (r->try_handler(c->fd, &c->req, r->arg) < 0) {
+            uring_offload(r, c);
+            return;
+        }
+
+        c->state = CONN_WRITING;
+
+        if (queue_output(r, c)) {
+            return;
+        }
+
+        if (!c->keep_alive) {
+            conn_close(c);
+            return;
+        }
+
+        conn_reset(c);
+    }
+}
+
+/**
+ * Act on one completion
+ */
+static void handle_cqe(struct uring *r, int listenfd, struct io_uring_cqe *cqe)
+{
+    int op = USER_OP(cqe->user_data);
+    int fd = USER_FD(cqe->user_data);
+    struct conn *c;
+
+    switch (op) {
+        case OP_ACCEPT:
+            if (cqe->res == -EMFILE || cqe->res == -ENFILE || cqe->res == -ENOBUFS || cqe->res == -ENOMEM) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+                queue_accept_retry(r, listenfd);
+                return;
+            }
+
+            queue_accept(r, listenfd);
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "accept: %s\n", strerror(-cqe->res));
+                return;
+            }
+
+            c = conn_open(cqe->res, 0);
+
+            if (c == NULL) {
+                fprintf(stderr, "uring: no room for fd %d\n", cqe->res);
+                close(cqe->res);
+                return;
+            }
+
+            c->queue_only = 1;
+            queue_recv(r, c);
+            return;
+
+        case OP_TIMEOUT:
+            // Either fired (and the recv reports it) or was cancelled
+            return;
+
+        case OP_ACCEPT_RETRY:
+            queue_accept(r, listenfd);
+            return;
+
+        case OP_WAKE: {
+            if (cqe->res < 0 && cqe->res != -EINTR) {
+                fprintf(stderr, "uring: eventfd read: %s\n", strerror(-cqe->res));
+            }
+
+            queue_wake(r);
+
+            pthread_mutex_lock(&r->done_lock);
+            int *done = r->done;
+            int ndone = r->ndone;
+            r->done = NULL;
+            r->ndone = r->donecap = 0;
+            pthread_mutex_unlock(&r->done_lock);
+
+            for (int i = 0; i < ndone; i++) {
+                conn_answered(r, conn_get(done[i]));
+            }
+
+            free(done);
+            return;
+        }
+
+        case OP_RECV:
+            c = conn_get(fd);
+
+            if (cqe->res <= 0) {
+                // -ECANCELED means the linked idle timeout fired
+                if (cqe->res < 0 && cqe->res != -ECANCELED) fprintf(stderr, "recv: %s\n", strerror(-cqe->res));
+                conn_close(c);
+                return;
+            }
+
+            c->inlen += cqe->res;
+            c->inbuf[c->inlen] = '\0';
+
+            conn_ready(r, c);
+            return;
+
+        case OP_SEND:
+            c = conn_get(fd);
+
+            if (cqe->res < 0) {
+                fprintf(stderr, "send: %s\n", strerror(-cqe->res));
+                conn_close(c);
+                return;
+            }
+
+            c->outoff += cqe->res;
+
+            conn_answered(r, c);
+            return;
+
+        case OP_READ:
+            c = conn_get(fd);
+
+            // 0 means the file was truncated after we sent its length
+            if (cqe->res <= 0) {
+                if (cqe->res < 0) fprintf(stderr, "read: %s\n", strerror(-cqe->res));
+                conn_close(c);
+                return;
+            }
+
+            c->outlen = cqe->res;
+            c->file_off += cqe->res;
+            c->file_remaining -= cqe->res;
+
+            queue_send(r, c);
+            return;
+    }
+}
+
+/**
+ * Check whether this kernel lets us create a ring at all
+ */
+int uring_supported(void)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof p);
+
+    int fd = syscall(__NR_io_uring_setup, 1, &p);
+
+    if (fd < 0) {
+        return 0;
+    }
+
+    close(fd);
+
+    return 1;
+}
+
+/**
+ * Run the io_uring loop on a listening socket
+ *
+ * try_handler gets each request first, on the ring thread. If it can't
+ * answer it without blocking, handler answers it on a worker instead.
+ *
+ * Never returns unless the ring itself fails.
+ */
+int uring_run(int listenfd, request_try_handler try_handler, request_handler handler, void *arg)
+{
+    struct uring r;
+
+    if (uring_init(&r, URING_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    r.wake_fd = eventfd(0, EFD_CLOEXEC);
+
+    if (r.wake_fd < 0) {
+        perror("eventfd");
+        return -1;
+    }
+
+    r.try_handler = try_handler;
+    r.handler = handler;
+    r.arg = arg;
+    pthread_mutex_init(&r.done_lock, NULL);
+    r.done = NULL;
+    r.ndone = r.donecap = 0;
+
+    pthread_once(&workers_once, workers_start);
+
+    r.idle_timeout.tv_sec = conn_idle_timeout;
+    r.idle_timeout.tv_nsec = 0;
+    r.accept_backoff.tv_sec = 0;
+    r.accept_backoff.tv_nsec = URING_ACCEPT_BACKOFF_MS * 1000000L;
+
+    queue_accept(&r, listenfd);
+    queue_wake(&r);
+
+    while (1) {
+        uring_publish(&r);
+
+        if (uring_submit(&r, 1) < 0) {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        unsigned head = *r.cq_head;
+        unsigned tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail) {
+            handle_cqe(&r, listenfd, &r.cqes[head & *r.cq_mask]);
+            head++;
+        }
+
+        __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+#else
+
+int uring_supported(void)
+{
+    return 0;
+}
+
+int uring_workers = 0;
+
+int uring_run(int listenfd, request_try_handler try_handler, request_handler handler, void *arg)
+{
+    (void)listenfd; (void)try_handler; (void)handler; (void)arg;
+
+    fprintf(stderr, "uring: not built with io_uring support\n");
+
+    return -1;
+}
+
+#endif
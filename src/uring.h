@@ -0,0 +1,15 @@
+#ifndef _URING_H_
+#define _URING_H_
+#include "eventloop.h"
+
+// Called first for each request, on the ring thread. Answers it if that
+// can be done without blocking and returns 0, or returns -1 to have it
+// answered by the request_handler on a worker thread instead.
+typedef int (*request_try_handler)(int fd, struct http_request *req, void *arg);
+
+extern int uring_workers; // Threads answering what would block a ring (0: one per core)
+
+extern int uring_supported(void);
+extern int uring_run(int listenfd, request_try_handler try_handler, request_handler handler, void *arg);
+
+#endif
@@ -0,0 +1,242 @@
+/**
+ * watch.c -- report changes under a directory tree, using inotify
+ *
+ * One thread reads inotify events for every directory under the root and
+ * passes the path of whatever changed to a handler. That lets the cache
+ * drop a file's copy as soon as it's written, instead of trusting copies
+ * for a fixed time.
+ *
+ * New directories are watched as they appear. Their contents are reported
+ * as a whole subtree, since files can land in them before the watch is in
+ * place.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include "watch.h"
+
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+/**
+ * Remember which directory a watch descriptor is for
+ */
+static int watch_remember(struct watcher *w, int wd, char *path)
+{
+    if (wd >= w->ndirs) {
+        int ndirs = w->ndirs > 0 ? w->ndirs : 64;
+
+        while (ndirs <= wd) ndirs *= 2;
+
+        char **dirs = realloc(w->dirs, ndirs * sizeof *dirs);
+
+        if (dirs == NULL) {
+            return -1;
+        }
+
+        memset(dirs + w->ndirs, 0, (ndirs - w->ndirs) * sizeof *dirs);
+        w->dirs = dirs;
+        w->ndirs = ndirs;
+    }
+
+    char *copy = strdup(path);
+
+    if (copy == NULL) {
+        return -1;
+    }
+
+    free(w->dirs[wd]);
+    w->dirs[wd] = copy;
+
+    return 0;
+}
+
+/**
+ * Watch a directory and every directory under it
+ */
+static void watch_add_tree(struct watcher *w, char *path)
+{
+    int wd = inotify_add_watch(w->fd, path, WATCH_EVENTS);
+
+    if (wd < 0) {
+        // Gone already, or out of watches; either way, nothing to follow
+        if (errno != ENOENT && errno != ENOTDIR) perror("inotify_add_watch");
+        return;
+    }
+
+    if (watch_remember(w, wd, path) < 0) {
+        inotify_rm_watch(w->fd, wd);
+        return;
+    }
+
+    DIR *d = opendir(path);
+
+    if (d == NULL) {
+        return;
+    }
+
+    struct dirent *de;
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+
+        char child[PATH_MAX];
+        struct stat st;
+
+        snprintf(child, sizeof child, "%s/%s", path, de->d_name);
+
+        if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN && lstat(child, &st) == 0 && S_ISDIR(st.st_mode))) {
+            watch_add_tree(w, child);
+        }
+    }
+
+    closedir(d);
+}
+
+/**
+ * Stop watching a directory that moved away, and everything under it
+ */
+static void watch_forget_tree(struct watcher *w, char *path)
+{
+    int len = strlen(path);
+
+    for (int wd = 0; wd < w->ndirs; wd++) {
+        char *dir = w->dirs[wd];
+
+        if (dir != NULL && strncmp(dir, path, len) == 0 && (dir[len] == '\0' || dir[len] == '/')) {
+            inotify_rm_watch(w->fd, wd);
+            free(dir);
+            w->dirs[wd] = NULL;
+        }
+    }
+}
+
+/**
+ * Turn one inotify event into a call to the handler
+ */
+static void watch_event(struct watcher *w, struct inotify_event *ev)
+{
+    if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost, so anything might have changed
+        w->handler(w->arg, w->root, 1);
+        return;
+    }
+
+    if (ev->wd < 0 || ev->wd >= w->ndirs || w->dirs[ev->wd] == NULL) {
+        return;
+    }
+
+    if (ev->mask & IN_IGNORED) {
+        free(w->dirs[ev->wd]);
+        w->dirs[ev->wd] = NULL;
+        return;
+    }
+
+    // Events about the watched directory itself also arrive, named, at
+    // its parent's watch
+    if (ev->len == 0) {
+        return;
+    }
+
+    char path[PATH_MAX];
+    int subtree = 0;
+
+    snprintf(path, sizeof path, "%s/%s", w->dirs[ev->wd], ev->name);
+
+    if (ev->mask & IN_ISDIR) {
+        if (ev->mask & IN_MOVED_FROM) {
+            watch_forget_tree(w, path);
+            subtree = 1;
+        }
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+            watch_add_tree(w, path);
+            subtree = 1;
+        }
+        if (ev->mask & IN_DELETE) {
+            subtree = 1;
+        }
+    }
+
+    w->handler(w->arg, path, subtree);
+}
+
+/**
+ * Watcher thread: read events until inotify fails
+ */
+static void *watch_thread(void *arg)
+{
+    struct watcher *w = arg;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+        ssize_t n = read(w->fd, buf, sizeof buf);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("watch: read");
+            return NULL;
+        }
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+
+            watch_event(w, ev);
+            p += sizeof *ev + ev->len;
+        }
+    }
+}
+
+/**
+ * Start following changes under root, calling handler from a thread of
+ * its own for each one
+ *
+ * Returns NULL if changes can't be watched here.
+ */
+struct watcher *watch_start(char *root, watch_handler handler, void *arg)
+{
+    struct watcher *w = calloc(1, sizeof *w);
+
+    if (w == NULL) {
+        return NULL;
+    }
+
+    w->fd = inotify_init1(IN_CLOEXEC);
+    w->root = strdup(root);
+    w->handler = handler;
+    w->arg = arg;
+
+    if (w->fd < 0 || w->root == NULL) {
+        perror("inotify_init1");
+        goto fail;
+    }
+
+    watch_add_tree(w, root);
+
+    if (w->ndirs == 0) {
+        goto fail;
+    }
+
+    if (pthread_create(&w->thread, NULL, watch_thread, w) != 0) {
+        goto fail;
+    }
+
+    pthread_detach(w->thread);
+
+    return w;
+
+fail:
+    if (w->fd >= 0) close(w->fd);
+    for (int wd = 0; wd < w->ndirs; wd++) free(w->dirs[wd]);
+    free(w->dirs);
+    free(w->root);
+    free(w);
+    return NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef _WATCH_H_
+#define _WATCH_H_
+#include <pthread.h>
+
+// Told the path of something that changed. subtree is 1 if everything
+// under path may have changed too (a directory appeared, went or moved).
+typedef void (*watch_handler)(void *arg, char *path, int subtree);
+
+// A thread following changes to every directory under a root
+struct watcher {
+    int fd; // inotify instance
+    char *root;
+    char **dirs; // Directory for each watch descriptor, or NULL
+    int ndirs;
+
+    watch_handler handler;
+    void *arg;
+
+    pthread_t thread;
+};
+
+extern struct watcher *watch_start(char *root, watch_handler handler, void *arg);
+
+#endif